@@ -0,0 +1,243 @@
+// Asynchronous access log.
+//
+// Every worker formats one line per answered request into its own ring
+// buffer, a single-producer single-consumer queue of bytes: the worker
+// only advances head, the flusher thread only advances tail. The flusher
+// sleeps on a futex until a worker that has queued lines wakes it at the
+// end of an event batch, lets FlushDelay ms of lines accumulate, and then
+// writes the contents of all rings with one writev(). A full ring drops the
+// line instead of blocking the worker; drops are counted in the worker's
+// metrics. Lines are in the Common Log Format, followed by the duration in
+// microseconds:
+//
+//   127.0.0.1 - - [16/Oct/2026:11:40:01 +0000] "GET /a.txt" 200 183 48
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string_view>
+#include <vector>
+
+static const long FlushDelay = 20; // ms
+
+// Longest line; longer paths are cut.
+static const size_t LogLineMax = 1024;
+
+struct LogRing {
+    char *buf;
+    size_t size;                     // a power of two
+    bool queued; // lines were put since the last accessLogKick()
+    alignas(64) std::atomic<size_t> head; // written by the worker
+    alignas(64) std::atomic<size_t> tail; // written by the flusher
+};
+
+struct AccessLog {
+    int fd;
+    std::vector<LogRing *> rings;
+    std::atomic<int> sleeping; // the futex the flusher waits on
+    pthread_t thread;
+};
+
+void logRingInit(LogRing *r, size_t size) {
+    size_t s = 4096;
+    while (s < size) {
+        s *= 2;
+    }
+    r->buf = (char *)malloc(s);
+    r->size = s;
+    r->head.store(0, std::memory_order_relaxed);
+    r->tail.store(0, std::memory_order_relaxed);
+    r->queued = false;
+}
+
+// Appends a line to r. Returns false, leaving r alone, if it does not fit.
+bool logRingPut(LogRing *r, const char *line, size_t n) {
+    size_t head = r->head.load(std::memory_order_relaxed);
+    size_t tail = r->tail.load(std::memory_order_acquire);
+    if (r->size - (head - tail) < n) {
+        return false;
+    }
+    size_t at = head & (r->size - 1);
+    size_t first = n < r->size - at ? n : r->size - at;
+    memcpy(r->buf + at, line, first);
+    memcpy(r->buf, line + first, n - first);
+    r->head.store(head + n, std::memory_order_release);
+    r->queued = true;
+    return true;
+}
+
+// Fills iov with the queued bytes of r, in up to two parts. Returns the
+// number of parts and sets *end to the head they reach.
+static int logRingPending(LogRing *r, struct iovec *iov, size_t *end) {
+    size_t tail = r->tail.load(std::memory_order_relaxed);
+    size_t head = r->head.load(std::memory_order_acquire);
+    *end = head;
+    if (head == tail) {
+        return 0;
+    }
+    size_t at = tail & (r->size - 1);
+    size_t n = head - tail;
+    size_t first = n < r->size - at ? n : r->size - at;
+    iov[0].iov_base = r->buf + at;
+    iov[0].iov_len = first;
+    if (first == n) {
+        return 1;
+    }
+    iov[1].iov_base = r->buf;
+    iov[1].iov_len = n - first;
+    return 2;
+}
+
+// Writes out what all rings hold. Returns the number of bytes written, or
+// -1 if the log could not be written; the lines are dropped then.
+ssize_t accessLogFlush(AccessLog *al) {
+    std::vector<struct iovec> iov(2 * al->rings.size());
+    std::vector<size_t> ends(al->rings.size());
+    int n = 0;
+    for (size_t i = 0; i < al->rings.size(); i++) {
+        n += logRingPending(al->rings[i], &iov[n], &ends[i]);
+    }
+    ssize_t total = 0;
+    int done = 0;
+    bool failed = false;
+    while (done < n) {
+        int count = n - done < IOV_MAX ? n - done : IOV_MAX;
+        ssize_t r = writev(al->fd, &iov[done], count);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            failed = true;
+            break;
+        }
+        total += r;
+        while (done < n and (size_t)r >= iov[done].iov_len) {
+            r -= iov[done].iov_len;
+            done++;
+        }
+        if (done < n) {
+            iov[done].iov_base = (char *)iov[done].iov_base + r;
+            iov[done].iov_len -= r;
+        }
+    }
+    for (size_t i = 0; i < al->rings.size(); i++) {
+        al->rings[i]->tail.store(ends[i], std::memory_order_release);
+    }
+    return failed ? -1 : total;
+}
+
+static bool accessLogPending(AccessLog *al) {
+    for (LogRing *r : al->rings) {
+        if (r->head.load(std::memory_order_relaxed) !=
+            r->tail.load(std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *runAccessLog(void *arg) {
+    AccessLog *al = (AccessLog *)arg;
+    while (true) {
+        al->sleeping.store(1); // seq_cst, pairs with accessLogKick()
+        if (!accessLogPending(al)) {
+            syscall(SYS_futex, &al->sleeping, FUTEX_WAIT_PRIVATE, 1, NULL,
+                    NULL, 0);
+        }
+        al->sleeping.store(0, std::memory_order_relaxed);
+        struct timespec delay = {0, FlushDelay * 1000000};
+        nanosleep(&delay, NULL);
+        if (-1 == accessLogFlush(al)) {
+            perror("access log write failed");
+        }
+    }
+    return NULL;
+}
+
+// Starts the flusher writing the rings of al to fd.
+int accessLogStart(AccessLog *al, int fd) {
+    al->fd = fd;
+    al->sleeping.store(0);
+    int err = pthread_create(&al->thread, 0, runAccessLog, al);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Wakes the flusher if r got lines since the last call and it sleeps.
+// Workers call it once per event batch, not per line.
+void accessLogKick(AccessLog *al, LogRing *r) {
+    if (!r->queued) {
+        return;
+    }
+    r->queued = false;
+    // the new head must be visible before sleeping is read, as sleeping is
+    // set before the flusher looks at the heads
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (al->sleeping.load(std::memory_order_relaxed) and
+        al->sleeping.exchange(0)) {
+        syscall(SYS_futex, &al->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL,
+                0);
+    }
+}
+
+// The formatted time of the current second, rebuilt once a second.
+struct LogClock {
+    time_t second;
+    char text[32]; // "16/Oct/2026:11:40:01 +0000"
+};
+
+// Formats an access log line into buf, which has LogLineMax bytes, and
+// returns its length. A status of 0 is logged as "-".
+size_t formatAccessLine(char *buf, LogClock *clock,
+                        const struct sockaddr_in &caddr,
+                        std::string_view request, int status, long long bytes,
+                        long durationUs) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec != clock->second) {
+        struct tm tm;
+        gmtime_r(&now.tv_sec, &tm);
+        strftime(clock->text, sizeof clock->text, "%d/%b/%Y:%H:%M:%S +0000",
+                 &tm);
+        clock->second = now.tv_sec;
+    }
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &caddr.sin_addr, addr, sizeof addr);
+    // keep the request on one line and its quotes balanced
+    char req[LogLineMax / 2];
+    size_t n = 0;
+    for (unsigned char ch : request) {
+        if (n + 5 > sizeof req) {
+            break;
+        }
+        if (ch < 0x20 or ch >= 0x7f or ch == '"' or ch == '\\') {
+            n += snprintf(req + n, 5, "\\x%02x", ch);
+        } else {
+            req[n++] = ch;
+        }
+    }
+    // a CGI child that writes to the socket itself leaves the status open
+    char code[16] = "-";
+    if (status) {
+        snprintf(code, sizeof code, "%d", status);
+    }
+    int len = snprintf(buf, LogLineMax, "%s - - [%s] \"%.*s\" %s %lld %ld\n",
+                       addr, clock->text, (int)n, req, code, bytes,
+                       durationUs);
+    return len < (int)LogLineMax ? len : LogLineMax - 1;
+}
@@ -0,0 +1,63 @@
+#include <gtest/gtest.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "accesslog.cc"
+
+TEST(AccessLogTest, RingWrapsAndDrops) {
+    LogRing r;
+    logRingInit(&r, 100); // rounded up to 4096
+    ASSERT_EQ(r.size, 4096u);
+    std::string line(1000, 'a');
+    for (int i = 0; i < 4; i++) {
+        EXPECT_TRUE(logRingPut(&r, line.data(), line.size()));
+    }
+    EXPECT_FALSE(logRingPut(&r, line.data(), line.size()));
+    EXPECT_EQ(r.head.load(), 4000u);
+
+    int fds[2];
+    ASSERT_EQ(0, pipe2(fds, O_NONBLOCK));
+    AccessLog al;
+    al.fd = fds[1];
+    al.rings.push_back(&r);
+    EXPECT_EQ(accessLogFlush(&al), 4000);
+    char buf[8192];
+    EXPECT_EQ(read(fds[0], buf, sizeof buf), 4000);
+    // the next line straddles the end of the buffer
+    std::string wrapped = std::string(500, 'x') + std::string(500, 'y');
+    EXPECT_TRUE(logRingPut(&r, wrapped.data(), wrapped.size()));
+    EXPECT_EQ(accessLogFlush(&al), 1000);
+    ASSERT_EQ(read(fds[0], buf, sizeof buf), 1000);
+    EXPECT_EQ(std::string(buf, 1000), wrapped);
+    EXPECT_EQ(accessLogFlush(&al), 0);
+    close(fds[0]);
+    close(fds[1]);
+    free(r.buf);
+}
+
+TEST(AccessLogTest, Format) {
+    LogClock clock = {0, ""};
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_addr.s_addr = htonl(0x7f000001);
+    char buf[LogLineMax];
+    std::string line(buf, formatAccessLine(buf, &clock, addr, "GET /a.txt",
+                                           200, 183, 48));
+    EXPECT_EQ(line.substr(0, 15), "127.0.0.1 - - [");
+    EXPECT_EQ(line.substr(line.find(']')),
+              "] \"GET /a.txt\" 200 183 48\n");
+    line.assign(buf, formatAccessLine(buf, &clock, addr, "GET /\"a\\\n", 0,
+                                      0, 7));
+    EXPECT_EQ(line.substr(line.find(']')),
+              "] \"GET /\\x22a\\x5c\\x0a\" - 0 7\n");
+    // very long requests are cut, the line stays whole
+    std::string target(5000, 'p');
+    line.assign(buf, formatAccessLine(buf, &clock, addr, target, 404, 0, 1));
+    EXPECT_LT(line.size(), LogLineMax);
+    EXPECT_EQ(line.substr(line.size() - 11), "p\" 404 0 1\n");
+}
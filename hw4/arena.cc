@@ -0,0 +1,109 @@
+// Bump allocation of request-scoped memory.
+//
+// Every connection has an arena for the strings its request needs while it
+// is served: lookup keys built from the path, CGI environment entries and
+// the like. They are all taken back at once when the next request starts.
+// An allocation that does not fit gets a heap block of its own, and the
+// next reset replaces the arena's block by one large enough for all of
+// them, so once a connection has seen its largest request the requests
+// that follow allocate nothing from the heap.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string_view>
+
+// The smallest block an arena allocates.
+static const size_t ArenaMinBlock = 1024;
+
+// A block taken when the arena's block ran out, followed by its memory.
+struct ArenaSpill {
+    ArenaSpill *next;
+    size_t size;
+};
+
+struct Arena {
+    char *block; // NULL until the first allocation
+    size_t size;
+    size_t used;
+    ArenaSpill *spill; // freed by the next arenaReset()
+    size_t spilled;    // their total size
+};
+
+void arenaInit(Arena *a) { memset(a, 0, sizeof *a); }
+
+static void arenaFreeSpill(Arena *a) {
+    while (a->spill) {
+        ArenaSpill *next = a->spill->next;
+        free(a->spill);
+        a->spill = next;
+    }
+    a->spilled = 0;
+}
+
+// Returns n bytes aligned for any scalar, valid until the next
+// arenaReset().
+void *arenaAlloc(Arena *a, size_t n) {
+    n = (n + 15) & ~(size_t)15;
+    if (a->block == NULL) {
+        a->size = n > ArenaMinBlock ? n : ArenaMinBlock;
+        a->block = (char *)malloc(a->size);
+    }
+    if (a->size - a->used >= n) {
+        void *p = a->block + a->used;
+        a->used += n;
+        return p;
+    }
+    // sizeof(ArenaSpill) keeps the memory that follows it 16-byte aligned
+    ArenaSpill *s = (ArenaSpill *)malloc(sizeof *s + n);
+    s->next = a->spill;
+    s->size = n;
+    a->spill = s;
+    a->spilled += n;
+    return s + 1;
+}
+
+// Takes back everything allocated since the last reset.
+void arenaReset(Arena *a) {
+    if (a->spill) {
+        size_t need = a->used + a->spilled, size = ArenaMinBlock;
+        while (size < need) {
+            size *= 2;
+        }
+        arenaFreeSpill(a);
+        free(a->block);
+        a->block = (char *)malloc(size);
+        a->size = size;
+    }
+    a->used = 0;
+}
+
+void arenaFree(Arena *a) {
+    arenaFreeSpill(a);
+    free(a->block);
+    arenaInit(a);
+}
+
+// Returns the NUL-terminated concatenation of x and y.
+char *arenaConcat(Arena *a, std::string_view x, std::string_view y) {
+    char *s = (char *)arenaAlloc(a, x.size() + y.size() + 1);
+    memcpy(s, x.data(), x.size());
+    memcpy(s + x.size(), y.data(), y.size());
+    s[x.size() + y.size()] = 0;
+    return s;
+}
+
+// Returns a string formatted like by printf().
+char *arenaPrintf(Arena *a, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    char *s = (char *)arenaAlloc(a, n + 1);
+    va_start(ap, fmt);
+    vsnprintf(s, n + 1, fmt, ap);
+    va_end(ap);
+    return s;
+}
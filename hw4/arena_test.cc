@@ -0,0 +1,32 @@
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.cc"
+
+TEST(ArenaTest, GrowsToTheLargestRequest) {
+    Arena a;
+    arenaInit(&a);
+    char *s = arenaConcat(&a, "sub/", "index.html");
+    EXPECT_STREQ(s, "sub/index.html");
+    EXPECT_STREQ(arenaPrintf(&a, "%s=%d", "n", 42), "n=42");
+    EXPECT_EQ((uintptr_t)arenaAlloc(&a, 3) % 16, 0u);
+    EXPECT_EQ(a.spill, nullptr);
+    char *big = (char *)arenaAlloc(&a, 3000); // spills
+    EXPECT_NE(a.spill, nullptr);
+    EXPECT_EQ((uintptr_t)big % 16, 0u);
+    memset(big, 1, 3000);
+    EXPECT_STREQ(s, "sub/index.html");
+
+    arenaReset(&a);
+    EXPECT_EQ(a.spill, nullptr);
+    EXPECT_EQ(a.used, 0u);
+    EXPECT_GE(a.size, 3000u + 48);
+    char *block = a.block;
+    arenaConcat(&a, "sub/", "index.html");
+    arenaAlloc(&a, 3000); // fits now
+    EXPECT_EQ(a.spill, nullptr);
+    arenaReset(&a);
+    EXPECT_EQ(a.block, block);
+    arenaFree(&a);
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Runs the end-to-end benchmarks against a fresh ./webserver and appends
+# one JSON object per scenario to $BENCH_OUT (default bench.jsonl), tagged
+# with the commit, so runs can be compared over time. The docroot is made
+# by bench_fixture.sh in $BENCH_DIR (default /tmp/webserver-bench).
+# usage: ./bench.sh [SECONDS]
+#   WORKERS=N   server workers (default 1)
+#   RATE=N      requests per second of the open-loop scenario (default 5000)
+#   SERVER_ARGS extra arguments for ./webserver, e.g. --io-uring
+set -e
+secs=${1:-5}
+docroot=${BENCH_DIR:-/tmp/webserver-bench}
+out=${BENCH_OUT:-bench.jsonl}
+port=${PORT:-18080}
+rate=${RATE:-5000}
+rev=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+./bench_fixture.sh "$docroot"
+./webserver --workers "${WORKERS:-1}" --access-log none $SERVER_ARGS \
+    "$port" "$docroot" 2>/dev/null &
+pid=$!
+trap 'kill $pid 2>/dev/null' EXIT
+sleep 0.5
+run() {
+    name=$1
+    shift
+    ./loadgen -j -l "$name" -d "$secs" -p "$pid" "$@" |
+        sed "s/^{/{\"rev\": \"$rev\", \"workers\": ${WORKERS:-1}, /" |
+        tee -a "$out"
+}
+run small -c 64 127.0.0.1 "$port" /small.html
+run small-open -c 64 -r "$rate" 127.0.0.1 "$port" /small.html
+run small-new-conn -c 16 -N 127.0.0.1 "$port" /small.html
+run large -c 8 127.0.0.1 "$port" /large.bin
+run dir -c 16 127.0.0.1 "$port" /huge/
+run cgi -c 8 127.0.0.1 "$port" /cgi.sh
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Creates the docroot the benchmarks in bench.sh run against:
+#   small.html        1 KiB
+#   large.bin         16 MiB
+#   huge/             a directory of N (default 100000) empty files
+#   cgi.sh            a CGI script answering a few bytes
+#   index.html        links to the above
+# usage: ./bench_fixture.sh DIR [N]
+set -e
+dir=${1:?DIR}
+n=${2:-100000}
+mkdir -p "$dir/huge"
+head -c 1024 /dev/zero | tr '\0' 'x' > "$dir/small.html"
+if [ "$(stat -c %s "$dir/large.bin" 2>/dev/null)" != 16777216 ]; then
+    head -c 16777216 /dev/urandom > "$dir/large.bin"
+fi
+have=$(ls -f "$dir/huge" | wc -l)
+if [ "$have" -lt $((n + 2)) ]; then
+    (cd "$dir/huge" && seq -f 'file%06.0f' 1 "$n" | xargs touch)
+fi
+cat > "$dir/cgi.sh" <<'CGI'
+#!/bin/sh
+printf 'Content-Type: text/plain\r\n\r\nhello from %s\n' "$QUERY_STRING"
+CGI
+chmod +x "$dir/cgi.sh"
+cat > "$dir/index.html" <<'HTML'
+<!DOCTYPE html>
+<title>bench</title>
+<a href="small.html">small</a> <a href="large.bin">large</a>
+<a href="huge/">huge</a> <a href="cgi.sh">cgi</a>
+HTML
@@ -0,0 +1,17 @@
+#!/bin/sh
+# Compares webserver throughput at 1, 4 and N workers.
+# usage: ./bench_workers.sh DOCROOT PATH [N]
+set -e
+docroot=${1:?DOCROOT}
+path=${2:?PATH}
+n=${3:-$(nproc)}
+port=${PORT:-18080}
+for workers in 1 4 "$n"; do
+    ./webserver --workers "$workers" --pin "$port" "$docroot" 2>/dev/null &
+    pid=$!
+    sleep 0.5
+    printf 'workers=%-3s ' "$workers"
+    ./loadgen -c 64 -d 5 127.0.0.1 "$port" "$path"
+    kill "$pid"
+    wait "$pid" 2>/dev/null || true
+done
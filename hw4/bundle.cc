@@ -0,0 +1,422 @@
+// Read-only document roots packed into a single file.
+//
+// mkbundle packs a directory into a bundle: every regular file with its
+// precomputed response heads and ETag, a gzip variant where sendFile()
+// would offer one, and the index.html or listing page of every directory,
+// behind an open-addressing hash index of the paths. Given a bundle as
+// DOCROOT, the webserver maps it once at startup and answers a request with
+// a hash lookup; heads and small bodies are written from the mapping and
+// larger bodies are sent with sendfile() from the bundle's fd. Nothing is
+// stat()ed, opened, cached or invalidated per request.
+//
+// Layout, in host byte order, offsets from the start of the file:
+//
+//   BundleHeader
+//   uint32_t slots[slotCount]  entry index + 1, or 0; linear probing
+//   BundleEntry entries[entryCount]
+//   paths, heads and bodies, each followed by a NUL
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+static const char BundleMagic[8] = {'H', 'W', '4', 'B', 'N', 'D', 'L', '1'};
+
+// Bodies at least this large are sent with sendfile() instead of from the
+// mapping.
+static const uint64_t BundleSendfileSize = 64 << 10;
+
+struct BundleHeader {
+    char magic[8];
+    uint64_t size; // of the whole file
+    uint32_t entryCount;
+    uint32_t slotCount; // a power of two, larger than entryCount
+    uint64_t slotsOff;
+    uint64_t entriesOff;
+};
+
+struct BundleSpan {
+    uint64_t off;
+    uint64_t len; // without the NUL that follows
+};
+
+// One representation of a path: its body, its 200 and 304 response heads
+// without the Connection header, and the validators they carry.
+struct BundleVariant {
+    BundleSpan body;
+    BundleSpan head;
+    BundleSpan notModifiedHead;
+    BundleSpan etag;
+    int64_t mtime;
+};
+
+enum BundleKind : uint32_t {
+    BundleFile, // "a/b.txt", and "a/" or "" for the page of a directory
+    BundleDir,  // "a", which is redirected to "a/"
+};
+
+struct BundleEntry {
+    uint64_t hash; // bundleHash() of path
+    BundleSpan path;
+    uint32_t kind;
+    uint32_t hasGzip;
+    BundleVariant plain;
+    BundleVariant gzip;
+};
+
+struct Bundle {
+    const char *map;
+    size_t size;
+    const BundleHeader *header;
+    const uint32_t *slots;
+    const BundleEntry *entries;
+    std::shared_ptr<PathInfo> file; // owns the fd that sendfile() reads
+};
+
+// FNV-1a.
+uint64_t bundleHash(std::string_view s) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (unsigned char ch : s) {
+        h = (h ^ ch) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static bool bundleSpanValid(const Bundle *b, const BundleSpan &s) {
+    return s.off <= b->size and s.len < b->size - s.off and
+           b->map[s.off + s.len] == 0;
+}
+
+static bool bundleVariantValid(const Bundle *b, const BundleVariant &v) {
+    return bundleSpanValid(b, v.body) and bundleSpanValid(b, v.head) and
+           bundleSpanValid(b, v.notModifiedHead) and
+           bundleSpanValid(b, v.etag);
+}
+
+// Maps the bundle at path and checks that its index stays within the file.
+// Returns -1 with errno set on failure, EINVAL if it is not a bundle.
+int bundleOpen(Bundle *b, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    auto file = std::make_shared<PathInfo>();
+    file->fd = fd;
+    if (-1 == fstat(fd, &file->st)) {
+        return -1;
+    }
+    b->size = file->st.st_size;
+    if (b->size < sizeof(BundleHeader)) {
+        errno = EINVAL;
+        return -1;
+    }
+    void *map = mmap(0, b->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    b->map = (const char *)map;
+    b->header = (const BundleHeader *)map;
+    const BundleHeader *h = b->header;
+    uint32_t n = h->entryCount;
+    bool valid = 0 == memcmp(h->magic, BundleMagic, sizeof BundleMagic) and
+                 h->size == b->size and h->slotCount > n and
+                 (h->slotCount & (h->slotCount - 1)) == 0 and
+                 h->slotsOff % alignof(uint32_t) == 0 and
+                 h->entriesOff % alignof(BundleEntry) == 0 and
+                 h->slotsOff <= b->size and
+                 (b->size - h->slotsOff) / sizeof(uint32_t) >= h->slotCount and
+                 h->entriesOff <= b->size and
+                 (b->size - h->entriesOff) / sizeof(BundleEntry) >= n;
+    if (valid) {
+        b->slots = (const uint32_t *)(b->map + h->slotsOff);
+        b->entries = (const BundleEntry *)(b->map + h->entriesOff);
+        for (uint32_t i = 0; i < h->slotCount and valid; i++) {
+            valid = b->slots[i] <= n;
+        }
+        for (uint32_t i = 0; i < n and valid; i++) {
+            const BundleEntry &e = b->entries[i];
+            valid = bundleSpanValid(b, e.path) and
+                    bundleVariantValid(b, e.plain) and
+                    (!e.hasGzip or bundleVariantValid(b, e.gzip));
+        }
+    }
+    if (!valid) {
+        munmap(map, b->size);
+        errno = EINVAL;
+        return -1;
+    }
+    b->file = file;
+    return 0;
+}
+
+std::string_view bundleBytes(const Bundle *b, const BundleSpan &s) {
+    return std::string_view(b->map + s.off, s.len);
+}
+
+// Returns the entry of path, which has no leading slash, or NULL. The
+// probe stops after every slot, should a bundle that passed bundleOpen()
+// still have no empty one.
+const BundleEntry *bundleLookup(const Bundle *b, std::string_view path) {
+    uint64_t hash = bundleHash(path);
+    uint32_t mask = b->header->slotCount - 1;
+    uint32_t i = hash & mask;
+    for (uint32_t n = 0; n < b->header->slotCount; n++, i = (i + 1) & mask) {
+        uint32_t slot = b->slots[i];
+        if (slot == 0) {
+            return NULL;
+        }
+        const BundleEntry *e = &b->entries[slot - 1];
+        if (e->hash == hash and bundleBytes(b, e->path) == path) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// A path on its way into a bundle.
+struct BundleInput {
+    std::string path;
+    uint32_t kind;
+    std::string body;
+    struct stat st;
+    const char *type; // the Content-Type header line
+    bool hasGzip;
+    std::string gzip;
+    struct stat gzipSt;
+    const char *gzipEtagSuffix;
+};
+
+static bool readWholeFile(const std::string &path, std::string *out) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    out->clear();
+    char buf[65536];
+    ssize_t r;
+    while ((r = read(fd, buf, sizeof buf)) > 0) {
+        out->append(buf, r);
+    }
+    close(fd);
+    return r == 0;
+}
+
+// Adds the gzip variant sendFile() would offer for the file at fsPath: a
+// current fsPath.gz, else a compressed copy of a compressible file.
+static void bundleAddGzip(BundleInput *in, const std::string &fsPath) {
+    struct stat gst;
+    std::string gzPath = fsPath + ".gz";
+    if (0 == stat(gzPath.c_str(), &gst) and S_ISREG(gst.st_mode) and
+        gst.st_mtime >= in->st.st_mtime and readWholeFile(gzPath, &in->gzip)) {
+        in->hasGzip = true;
+        in->gzipSt = gst;
+        in->gzipEtagSuffix = "";
+    } else if (isCompressible(fsPath.c_str()) and
+               (off_t)in->body.size() >= MinCompressSize and
+               (off_t)in->body.size() <= MaxCompressSize and
+               gzipCompress(in->body.data(), in->body.size(), &in->gzip)) {
+        in->hasGzip = true;
+        in->gzipSt = in->st;
+        in->gzipEtagSuffix = "-gz";
+    }
+}
+
+// Collects the directory root + rel, where rel is "" or ends with a slash,
+// and everything below it. Symlinks to files are followed; symlinks to
+// directories are skipped, as one pointing up the tree would be collected
+// until the path got too long.
+static int bundleCollect(const std::string &root, const std::string &rel,
+                         std::vector<BundleInput> *out) {
+    std::string dir = root + "/" + rel;
+    std::shared_ptr<DirListing> d = readDirListing(dir.c_str());
+    if (d == nullptr) {
+        return -1;
+    }
+    BundleInput page;
+    page.path = rel;
+    page.kind = BundleFile;
+    page.type = contentTypeHeader("index.html");
+    page.hasGzip = false;
+    std::string index = dir + "index.html";
+    if (0 == stat(index.c_str(), &page.st) and S_ISREG(page.st.st_mode)) {
+        if (!readWholeFile(index, &page.body)) {
+            return -1;
+        }
+        bundleAddGzip(&page, index);
+    } else {
+        if (-1 == stat(dir.c_str(), &page.st)) {
+            return -1;
+        }
+        DirPage p = {0, DirPageEntries, false, false};
+        renderDirPage(&page.body, *d, "/" + rel, p);
+    }
+    out->push_back(std::move(page));
+    for (uint32_t i : d->byName) {
+        std::string name = d->names.data() + d->entries[i].name;
+        if (name == "..") {
+            continue;
+        }
+        std::string fsPath = dir + name;
+        BundleInput in;
+        in.path = rel + name;
+        in.type = contentTypeHeader(name);
+        in.hasGzip = false;
+        if (-1 == lstat(fsPath.c_str(), &in.st)) {
+            return -1;
+        }
+        if (S_ISLNK(in.st.st_mode)) {
+            if (-1 == stat(fsPath.c_str(), &in.st)) {
+                return -1;
+            }
+            if (S_ISDIR(in.st.st_mode)) {
+                fprintf(stderr, "skipping symlinked directory %s\n",
+                        in.path.c_str());
+                continue;
+            }
+        }
+        if (S_ISDIR(in.st.st_mode)) {
+            in.kind = BundleDir;
+            out->push_back(std::move(in));
+            if (-1 == bundleCollect(root, rel + name + "/", out)) {
+                return -1;
+            }
+            continue;
+        }
+        if (!S_ISREG(in.st.st_mode)) {
+            continue;
+        }
+        if (0 == access(fsPath.c_str(), X_OK)) {
+            fprintf(stderr, "skipping CGI script %s\n", in.path.c_str());
+            continue;
+        }
+        in.kind = BundleFile;
+        if (!readWholeFile(fsPath, &in.body)) {
+            return -1;
+        }
+        bundleAddGzip(&in, fsPath);
+        out->push_back(std::move(in));
+    }
+    return 0;
+}
+
+// Appends s and a NUL to data, which starts at offset base of the file.
+static BundleSpan bundlePut(std::string *data, uint64_t base,
+                            std::string_view s) {
+    BundleSpan span = {base + data->size(), s.size()};
+    data->append(s);
+    data->push_back(0);
+    return span;
+}
+
+static BundleVariant bundlePutVariant(std::string *data, uint64_t base,
+                                      const std::string &body,
+                                      const struct stat &st, const char *extra,
+                                      const char *etagSuffix) {
+    std::string head, notModifiedHead, etag;
+    formatFileHeads(&head, &notModifiedHead, &etag, body.size(), st, extra,
+                    etagSuffix);
+    BundleVariant v;
+    // bodies start 8-byte aligned, which is all the kernel may care for
+    data->resize((data->size() + 7) & ~(size_t)7);
+    v.body = bundlePut(data, base, body);
+    v.head = bundlePut(data, base, head);
+    v.notModifiedHead = bundlePut(data, base, notModifiedHead);
+    v.etag = bundlePut(data, base, etag);
+    v.mtime = st.st_mtime;
+    return v;
+}
+
+// Packs the directory root into a bundle at out, which is replaced
+// atomically. Returns -1 with errno set on failure.
+int bundleWrite(const char *root, const char *out) {
+    std::vector<BundleInput> inputs;
+    if (-1 == bundleCollect(root, "", &inputs)) {
+        return -1;
+    }
+    BundleHeader h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, BundleMagic, sizeof BundleMagic);
+    h.entryCount = inputs.size();
+    h.slotCount = 2;
+    while (h.slotCount < 2 * inputs.size()) {
+        h.slotCount *= 2;
+    }
+    h.slotsOff = sizeof h;
+    h.entriesOff = (h.slotsOff + h.slotCount * sizeof(uint32_t) + 7) & ~7ull;
+    uint64_t base = h.entriesOff + inputs.size() * sizeof(BundleEntry);
+    std::vector<uint32_t> slots(h.slotCount);
+    std::vector<BundleEntry> entries(inputs.size());
+    std::string data;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        const BundleInput &in = inputs[i];
+        BundleEntry &e = entries[i];
+        memset(&e, 0, sizeof e);
+        e.hash = bundleHash(in.path);
+        e.path = bundlePut(&data, base, in.path);
+        e.kind = in.kind;
+        if (in.kind == BundleFile) {
+            std::string extra = in.type;
+            if (in.hasGzip) {
+                extra += "Vary: Accept-Encoding\r\n";
+            }
+            e.plain = bundlePutVariant(&data, base, in.body, in.st,
+                                       extra.c_str(), "");
+        } else {
+            e.plain = bundlePutVariant(&data, base, "", in.st, "", "");
+        }
+        e.hasGzip = in.hasGzip;
+        if (in.hasGzip) {
+            std::string extra = std::string(in.type) + GzipHeaders;
+            e.gzip = bundlePutVariant(&data, base, in.gzip, in.gzipSt,
+                                      extra.c_str(), in.gzipEtagSuffix);
+        }
+        uint32_t mask = h.slotCount - 1;
+        uint32_t s = e.hash & mask;
+        while (slots[s] != 0) {
+            s = (s + 1) & mask;
+        }
+        slots[s] = i + 1;
+    }
+    h.size = base + data.size();
+    std::string tmp = std::string(out) + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    std::string file((const char *)&h, sizeof h);
+    file.append((const char *)slots.data(), slots.size() * sizeof(uint32_t));
+    file.resize(h.entriesOff);
+    file.append((const char *)entries.data(),
+                entries.size() * sizeof(BundleEntry));
+    file += data;
+    size_t done = 0;
+    while (done < file.size()) {
+        ssize_t r = write(fd, file.data() + done, file.size() - done);
+        if (r < 0 and errno != EINTR) {
+            int err = errno;
+            close(fd);
+            unlink(tmp.c_str());
+            errno = err;
+            return -1;
+        }
+        done += r > 0 ? r : 0;
+    }
+    if (-1 == close(fd) or -1 == rename(tmp.c_str(), out)) {
+        int err = errno;
+        unlink(tmp.c_str());
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "webserver.cc"
+
+TEST(BundleTest, RoundTrip) {
+    char dir[] = "/tmp/bundle_test.XXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    std::string root = dir;
+    mkdir((root + "/d").c_str(), 0755);
+    std::string text(4096, 'x');
+    int fd = open((root + "/d/t.txt").c_str(), O_CREAT | O_WRONLY, 0644);
+    ASSERT_EQ(write(fd, text.data(), text.size()), (ssize_t)text.size());
+    close(fd);
+    close(open((root + "/run.sh").c_str(), O_CREAT | O_WRONLY, 0755));
+    std::string out = root + ".b";
+    ASSERT_EQ(bundleWrite(dir, out.c_str()), 0);
+
+    Bundle b;
+    ASSERT_EQ(bundleOpen(&b, out.c_str()), 0);
+    EXPECT_EQ(bundleLookup(&b, "run.sh"), nullptr); // CGI is left out
+    EXPECT_EQ(bundleLookup(&b, "d/t.tx"), nullptr);
+    const BundleEntry *e = bundleLookup(&b, "d");
+    ASSERT_NE(e, nullptr);
+    EXPECT_EQ(e->kind, BundleDir);
+    e = bundleLookup(&b, "");
+    ASSERT_NE(e, nullptr);
+    EXPECT_NE(bundleBytes(&b, e->plain.body).find("href=\"/d/\""),
+              std::string_view::npos);
+    e = bundleLookup(&b, "d/t.txt");
+    ASSERT_NE(e, nullptr);
+    EXPECT_EQ(e->kind, BundleFile);
+    EXPECT_EQ(bundleBytes(&b, e->plain.body), text);
+    std::string_view head = bundleBytes(&b, e->plain.head);
+    EXPECT_EQ(head.find("HTTP/1.1 200 OK\r\nContent-Length: 4096\r\n"), 0u);
+    EXPECT_NE(head.find("Vary: Accept-Encoding\r\n"), std::string_view::npos);
+    ASSERT_TRUE(e->hasGzip);
+    std::string etag(bundleBytes(&b, e->plain.etag));
+    etag.insert(etag.size() - 1, "-gz");
+    EXPECT_EQ(bundleBytes(&b, e->gzip.etag), etag);
+    std::string_view gz = bundleBytes(&b, e->gzip.body);
+    EXPECT_LT(gz.size(), text.size());
+    EXPECT_NE(bundleBytes(&b, e->gzip.head).find(GzipHeaders),
+              std::string_view::npos);
+
+    truncate(out.c_str(), 100); // a bundle that fails validation
+    Bundle bad;
+    EXPECT_EQ(bundleOpen(&bad, out.c_str()), -1);
+    EXPECT_EQ(errno, EINVAL);
+    for (const char *name : {"/d/t.txt", "/d", "/run.sh", ".b", ""}) {
+        remove((root + name).c_str());
+    }
+}
+
+TEST(BundleTest, SymlinkedDirectoriesAreSkipped) {
+    char dir[] = "/tmp/bundle_test.XXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    std::string root = dir;
+    mkdir((root + "/d").c_str(), 0755);
+    close(open((root + "/d/t.txt").c_str(), O_CREAT | O_WRONLY, 0644));
+    ASSERT_EQ(symlink("..", (root + "/d/up").c_str()), 0); // a loop
+    ASSERT_EQ(symlink("d/t.txt", (root + "/t.txt").c_str()), 0);
+    std::string out = root + ".b";
+    ASSERT_EQ(bundleWrite(dir, out.c_str()), 0);
+
+    Bundle b;
+    ASSERT_EQ(bundleOpen(&b, out.c_str()), 0);
+    EXPECT_EQ(bundleLookup(&b, "d/up"), nullptr);
+    EXPECT_EQ(bundleLookup(&b, "d/up/"), nullptr);
+    const BundleEntry *e = bundleLookup(&b, "t.txt");
+    ASSERT_NE(e, nullptr);
+    EXPECT_EQ(e->kind, BundleFile);
+    for (const char *name : {"/d/up", "/d/t.txt", "/t.txt", "/d", ".b", ""}) {
+        remove((root + name).c_str());
+    }
+}
+
+TEST(BundleTest, LookupInFullIndex) {
+    // bundleOpen() accepts slots that all point to the one entry
+    BundleHeader h{};
+    h.slotCount = 2;
+    uint32_t slots[] = {1, 1};
+    BundleEntry e{};
+    e.hash = bundleHash("a");
+    e.path = {0, 1};
+    Bundle b;
+    b.map = "a";
+    b.header = &h;
+    b.slots = slots;
+    b.entries = &e;
+    EXPECT_EQ(bundleLookup(&b, "a"), &e);
+    EXPECT_EQ(bundleLookup(&b, "b"), nullptr);
+}
@@ -0,0 +1,160 @@
+// Pools of persistent CGI processes.
+//
+// Spawning a process per request dominates the latency of hot CGI scripts.
+// A script given with --cgi-pool SCRIPT=N instead gets N long-lived
+// processes per worker thread. They are started with CGI_POOL=1 in their
+// environment and a Unix socket as stdin and stdout, over which they are
+// sent one request at a time and answer it:
+//
+//   request:  "ENVBYTES BODYBYTES\n", the environment as NAME=VALUE lines,
+//             then the request body
+//   response: "BYTES\n", then the CGI output: headers, empty line, body
+//
+// poolecho.cc is an example. Requests arriving while all processes of a
+// pool are busy wait in the pool's queue.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Bodies of pooled requests are collected in memory up to this size;
+// larger ones go to a freshly spawned process instead.
+static const size_t CgiPoolMaxBody = 1 << 20;
+
+struct CgiPoolSpec {
+    std::string path; // as cleanupPath() leaves it, e.g. "cgi/app"
+    int procs;
+};
+
+struct CgiProc {
+    struct CgiPool *pool;
+    pid_t pid;
+    int fd;            // our end of the socket, -1 if the process is gone
+    long spawned;      // nowMs() of the last spawn attempt
+    bool busy;         // a request was sent and not answered yet
+    struct Conn *conn; // the connection waiting for the answer, if any
+    std::string send;  // request frame
+    size_t sendOff;
+    std::string recv; // response frame read so far
+};
+
+struct CgiPool {
+    struct Worker *w;
+    std::string path;
+    std::vector<CgiProc> procs;
+    std::deque<struct Conn *> waiting;
+};
+
+// Parses a --cgi-pool argument, SCRIPT=N. Returns false if it is invalid.
+bool parseCgiPoolSpec(const char *arg, CgiPoolSpec *spec) {
+    const char *eq = strrchr(arg, '=');
+    if (eq == NULL or eq == arg) {
+        return false;
+    }
+    char *end;
+    long n = strtol(eq + 1, &end, 10);
+    if (*end or n < 1 or n > 1024) {
+        return false;
+    }
+    const char *path = arg;
+    while (*path == '/' or (path[0] == '.' and path[1] == '/')) {
+        path += *path == '/' ? 1 : 2;
+    }
+    spec->path.assign(path, eq - path);
+    spec->procs = n;
+    return !spec->path.empty();
+}
+
+// Starts the process of p, running pool's script. Returns -1 on failure,
+// leaving p->fd at -1.
+int cgiProcSpawn(CgiProc *p) {
+    p->fd = -1;
+    p->busy = false;
+    p->send.clear();
+    p->sendOff = 0;
+    p->recv.clear();
+    int sv[2];
+    if (-1 == socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+        perror("socketpair() failed");
+        return -1;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, sv[1], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, sv[1], STDOUT_FILENO);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t sigdef;
+    sigemptyset(&sigdef);
+    sigaddset(&sigdef, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigdef);
+    sigset_t none;
+    sigemptyset(&none);
+    posix_spawnattr_setsigmask(&attr, &none); // SIGCHLD is blocked here
+    posix_spawnattr_setflags(&attr,
+                             POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    char *path = (char *)p->pool->path.c_str();
+    char *argv[] = {path, 0};
+    char env0[] = "CGI_POOL=1";
+    char *envp[] = {env0, 0};
+    int err = posix_spawn(&p->pid, path, &actions, &attr, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(sv[1]);
+    if (err) {
+        fprintf(stderr, "posix_spawn(%s) failed: %s\n", path, strerror(err));
+        close(sv[0]);
+        return -1;
+    }
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    p->fd = sv[0];
+    return 0;
+}
+
+// Appends the head of a request frame: its size line and the environment.
+void cgiRequestHead(std::string *out, const char *method, const char *query,
+                    size_t bodyLen) {
+    char env[64];
+    std::string e = std::string("REQUEST_METHOD=") + method +
+                    "\nQUERY_STRING=" + query + "\n";
+    snprintf(env, sizeof env, "CONTENT_LENGTH=%zu\n", bodyLen);
+    e += env;
+    char head[48];
+    int n = snprintf(head, sizeof head, "%zu %zu\n", e.size(), bodyLen);
+    out->append(head, n);
+    out->append(e);
+}
+
+// Looks at the response frame read so far. Returns the CGI output once it
+// is complete, an empty view with NULL data() while more is needed, and
+// sets *bad if the frame is malformed.
+std::string_view cgiResponseOutput(const std::string &recv, bool *bad) {
+    *bad = false;
+    size_t nl = recv.find('\n');
+    if (nl == std::string::npos) {
+        *bad = recv.size() > 20;
+        return std::string_view();
+    }
+    ssize_t n = parseContentLength(std::string_view(recv.data(), nl));
+    if (n < 0) {
+        *bad = true;
+        return std::string_view();
+    }
+    if (recv.size() - nl - 1 < (size_t)n) {
+        return std::string_view();
+    }
+    *bad = recv.size() - nl - 1 > (size_t)n; // answers are never unasked for
+    return std::string_view(recv.data() + nl + 1, n);
+}
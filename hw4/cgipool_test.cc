@@ -0,0 +1,39 @@
+#include <gtest/gtest.h>
+#include <string>
+
+#include "parser.cc"
+#include "cgipool.cc"
+
+TEST(CgiPoolTest, ParseSpec) {
+    CgiPoolSpec spec;
+    ASSERT_TRUE(parseCgiPoolSpec("/cgi/app=4", &spec));
+    EXPECT_EQ(spec.path, "cgi/app");
+    EXPECT_EQ(spec.procs, 4);
+    ASSERT_TRUE(parseCgiPoolSpec("./a=b.sh=1", &spec));
+    EXPECT_EQ(spec.path, "a=b.sh");
+    EXPECT_FALSE(parseCgiPoolSpec("app", &spec));
+    EXPECT_FALSE(parseCgiPoolSpec("app=0", &spec));
+    EXPECT_FALSE(parseCgiPoolSpec("app=2x", &spec));
+    EXPECT_FALSE(parseCgiPoolSpec("/=2", &spec));
+}
+
+TEST(CgiPoolTest, Frames) {
+    std::string head;
+    cgiRequestHead(&head, "GET", "a=1", 3);
+    EXPECT_EQ(head, "53 3\nREQUEST_METHOD=GET\nQUERY_STRING=a=1\n"
+                    "CONTENT_LENGTH=3\n");
+
+    bool bad;
+    EXPECT_EQ(cgiResponseOutput("", &bad).data(), nullptr);
+    EXPECT_FALSE(bad);
+    EXPECT_EQ(cgiResponseOutput("5\nabc", &bad).data(), nullptr);
+    EXPECT_FALSE(bad);
+    EXPECT_EQ(cgiResponseOutput("5\nabcde", &bad), "abcde");
+    EXPECT_FALSE(bad);
+    EXPECT_EQ(cgiResponseOutput("0\n", &bad), "");
+    EXPECT_FALSE(bad);
+    cgiResponseOutput("5\nabcdef", &bad);
+    EXPECT_TRUE(bad);
+    cgiResponseOutput("x\n", &bad);
+    EXPECT_TRUE(bad);
+}
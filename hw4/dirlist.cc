@@ -0,0 +1,367 @@
+// Per-worker cache of directory listings.
+//
+// A directory is read with getdents64() in large batches, its entries are
+// sorted by name once and kept until the directory's inode or mtime (from
+// the stat cache) changes. Pages of ?offset=N&limit=M entries are rendered
+// from the cached entries, so browsing a directory of 100k files costs
+// O(limit) per request; the default first page is rendered once and kept
+// with the entries.
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Entries per page when the query has no limit, and the largest limit.
+static const size_t DirPageEntries = 1000;
+static const size_t DirMaxPageEntries = 10000;
+
+struct DirEntry {
+    uint32_t name; // offset into DirListing::names
+    bool dir;
+};
+
+struct DirListing {
+    std::string path; // the one it was read from, which keys it in DirCache
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    std::string names; // NUL-terminated names
+    std::vector<DirEntry> entries; // in directory order
+    std::vector<uint32_t> byName;  // indexes into entries, sorted
+    std::string page; // the default page, rendered on first use
+    size_t charged;   // bytes counted against DirCache::maxBytes
+};
+
+struct DirCache {
+    size_t maxBytes; // 0 disables caching
+    size_t maxEntries;
+    size_t bytes;
+    std::list<std::shared_ptr<DirListing>> lru; // most recently used first
+    // keyed by views of DirListing::path, so that lookups need no copy
+    std::unordered_map<std::string_view,
+                       std::list<std::shared_ptr<DirListing>>::iterator>
+        index;
+    long hits;
+    long misses;
+};
+
+void dirCacheInit(DirCache *dc, size_t maxBytes, size_t maxEntries) {
+    dc->maxBytes = maxBytes;
+    dc->maxEntries = maxEntries;
+    dc->bytes = 0;
+    dc->hits = dc->misses = 0;
+}
+
+static void dirCacheErase(DirCache *dc,
+                          std::list<std::shared_ptr<DirListing>>::iterator it) {
+    dc->bytes -= (*it)->charged;
+    dc->index.erase((*it)->path);
+    dc->lru.erase(it);
+}
+
+// The record getdents64() fills the buffer with; glibc only declares it
+// since 2.30.
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Reads the directory at path, which is "./" for the document root.
+// Returns NULL with errno set on failure.
+std::shared_ptr<DirListing> readDirListing(const char *path) {
+    bool root = 0 == strcmp(path, "./");
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return nullptr;
+    }
+    auto d = std::make_shared<DirListing>();
+    struct stat st;
+    if (-1 == fstat(fd, &st)) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return nullptr;
+    }
+    d->charged = 0;
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+    d->mtime = st.st_mtim;
+    const size_t bufSize = 256 << 10;
+    char *buf = (char *)malloc(bufSize);
+    while (true) {
+        long n = syscall(SYS_getdents64, fd, buf, bufSize);
+        if (n <= 0) {
+            int err = errno;
+            free(buf);
+            close(fd);
+            if (n == 0) {
+                break;
+            }
+            errno = err;
+            return nullptr;
+        }
+        for (long off = 0; off < n;) {
+            LinuxDirent64 *e = (LinuxDirent64 *)(buf + off);
+            off += e->d_reclen;
+            if (0 == strcmp(e->d_name, ".") or
+                (root and 0 == strcmp(e->d_name, ".."))) {
+                continue;
+            }
+            bool dir = e->d_type == DT_DIR;
+            if (e->d_type == DT_UNKNOWN or e->d_type == DT_LNK) {
+                struct stat est;
+                dir = 0 == fstatat(fd, e->d_name, &est, 0) and
+                      S_ISDIR(est.st_mode);
+            }
+            d->entries.push_back(DirEntry{(uint32_t)d->names.size(), dir});
+            d->names.append(e->d_name, strlen(e->d_name) + 1);
+        }
+    }
+    d->byName.resize(d->entries.size());
+    for (size_t i = 0; i < d->byName.size(); i++) {
+        d->byName[i] = i;
+    }
+    const char *names = d->names.data();
+    const std::vector<DirEntry> &entries = d->entries;
+    std::sort(d->byName.begin(), d->byName.end(),
+              [names, &entries](uint32_t a, uint32_t b) {
+                  return strcmp(names + entries[a].name,
+                                names + entries[b].name) < 0;
+              });
+    return d;
+}
+
+// Returns the listing of the directory at path, which currently has the
+// metadata st, from the cache if it is still current. Returns NULL with
+// errno set if the directory cannot be read.
+std::shared_ptr<DirListing> dirCacheGet(DirCache *dc, std::string_view path,
+                                        const struct stat &st) {
+    auto it = dc->index.find(path);
+    if (it != dc->index.end()) {
+        DirListing *d = it->second->get();
+        if (d->dev == st.st_dev and d->ino == st.st_ino and
+            d->mtime.tv_sec == st.st_mtim.tv_sec and
+            d->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            dc->hits++;
+            dc->lru.splice(dc->lru.begin(), dc->lru, it->second);
+            return *it->second;
+        }
+        dirCacheErase(dc, it->second);
+    }
+    dc->misses++;
+    std::string key(path);
+    std::shared_ptr<DirListing> d = readDirListing(key.c_str());
+    if (d == nullptr or dc->maxBytes == 0) {
+        return d;
+    }
+    // with an estimate for the default page, which is rendered later
+    d->charged = d->names.size() + d->entries.size() * sizeof(DirEntry) +
+                 d->byName.size() * sizeof(uint32_t) +
+                 std::min(d->entries.size(), DirPageEntries) * 96;
+    if (d->charged > dc->maxBytes / 8) {
+        return d; // too large to cache; pagination still bounds the page
+    }
+    while (!dc->lru.empty() and (dc->bytes + d->charged > dc->maxBytes or
+                                 dc->lru.size() >= dc->maxEntries)) {
+        dirCacheErase(dc, std::prev(dc->lru.end()));
+    }
+    dc->bytes += d->charged;
+    d->path = std::move(key);
+    dc->lru.push_front(d);
+    dc->index[d->path] = dc->lru.begin();
+    return d;
+}
+
+// Appends s with the characters special to HTML replaced by references.
+void appendHtmlEscaped(std::string *out, std::string_view s) {
+    for (char ch : s) {
+        switch (ch) {
+        case '&':
+            out->append("&amp;");
+            break;
+        case '<':
+            out->append("&lt;");
+            break;
+        case '>':
+            out->append("&gt;");
+            break;
+        case '"':
+            out->append("&quot;");
+            break;
+        case '\'':
+            out->append("&#39;");
+            break;
+        default:
+            out->push_back(ch);
+        }
+    }
+}
+
+// Appends s percent-encoded for use as a path segment of a URL.
+void appendUrlEscaped(std::string *out, std::string_view s) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (unsigned char ch : s) {
+        if (isalnum(ch) or strchr("-._~!$()*,;=@", ch)) {
+            out->push_back(ch);
+        } else {
+            out->push_back('%');
+            out->push_back(hex[ch >> 4]);
+            out->push_back(hex[ch & 15]);
+        }
+    }
+}
+
+// Appends the decoded path urlPath percent-encoded segment by segment.
+void appendUrlPath(std::string *out, std::string_view urlPath) {
+    while (!urlPath.empty()) {
+        size_t n = std::min(urlPath.find('/'), urlPath.size());
+        appendUrlEscaped(out, urlPath.substr(0, n));
+        if (n < urlPath.size()) {
+            out->push_back('/');
+            n++;
+        }
+        urlPath.remove_prefix(n);
+    }
+}
+
+// Returns the value of the parameter name in a query string, or an empty
+// view with a NULL data() if it is missing.
+std::string_view queryParam(std::string_view query, std::string_view name) {
+    while (!query.empty()) {
+        size_t amp = query.find('&');
+        std::string_view param = query.substr(0, amp);
+        if (param.size() > name.size() and param[name.size()] == '=' and
+            param.compare(0, name.size(), name) == 0) {
+            return param.substr(name.size() + 1);
+        }
+        if (amp == std::string_view::npos) {
+            break;
+        }
+        query.remove_prefix(amp + 1);
+    }
+    return std::string_view();
+}
+
+// Which entries of a listing a page shows, and in which order.
+struct DirPage {
+    size_t offset;
+    size_t limit;
+    bool unsorted; // ?sort=none: directory order
+    bool reverse;  // ?order=desc
+};
+
+// Reads the page parameters from a query string.
+DirPage parseDirPage(std::string_view query) {
+    DirPage p = {0, DirPageEntries, false, false};
+    ssize_t n = parseContentLength(queryParam(query, "offset"));
+    if (n > 0) {
+        p.offset = n;
+    }
+    n = parseContentLength(queryParam(query, "limit"));
+    if (n > 0) {
+        p.limit = std::min((size_t)n, DirMaxPageEntries);
+    }
+    p.unsorted = queryParam(query, "sort") == "none";
+    p.reverse = queryParam(query, "order") == "desc";
+    return p;
+}
+
+static bool isDefaultDirPage(const DirPage &p) {
+    return p.offset == 0 and p.limit == DirPageEntries and !p.unsorted and
+           !p.reverse;
+}
+
+static void appendDirPageLink(std::string *out, std::string_view urlPath,
+                              const DirPage &p, size_t offset,
+                              const char *label) {
+    char buf[128];
+    out->append("<a href=\"");
+    appendUrlPath(out, urlPath);
+    int n = snprintf(buf, sizeof buf,
+                     "?offset=%zu&amp;limit=%zu%s%s\">%s</a>\n", offset,
+                     p.limit, p.unsorted ? "&amp;sort=none" : "",
+                     p.reverse ? "&amp;order=desc" : "", label);
+    out->append(buf, n);
+}
+
+// Renders a page of the listing of the directory at urlPath, which ends
+// with a slash, into out. The links are absolute, as the same listing
+// answers targets like /dir/sub/.. that clean up to the directory.
+void renderDirPage(std::string *out, const DirListing &d,
+                   std::string_view urlPath, const DirPage &p) {
+    size_t total = d.entries.size();
+    size_t first = std::min(p.offset, total);
+    size_t last = std::min(first + p.limit, total);
+    out->reserve(out->size() + 256 + (last - first) * 96);
+    out->append("<!DOCTYPE html>\n<title>");
+    appendHtmlEscaped(out, urlPath);
+    out->append("</title>\n<h1>");
+    appendHtmlEscaped(out, urlPath);
+    out->append("</h1>\n");
+    if (total > p.limit or first > 0) {
+        char buf[80];
+        out->append(buf, snprintf(buf, sizeof buf, "<p>%zu-%zu of %zu\n",
+                                  first + (first < last), last, total));
+        if (first > 0) {
+            appendDirPageLink(out, urlPath, p,
+                              first > p.limit ? first - p.limit : 0,
+                              "previous");
+        }
+        if (last < total) {
+            appendDirPageLink(out, urlPath, p, last, "next");
+        }
+        out->append("</p>\n");
+    }
+    out->append("<ul>\n");
+    for (size_t i = first; i < last; i++) {
+        size_t k = p.reverse ? total - 1 - i : i;
+        const DirEntry &e = d.entries[p.unsorted ? k : d.byName[k]];
+        std::string_view name(d.names.data() + e.name);
+        out->append("<li><a href=\"");
+        appendUrlPath(out, urlPath);
+        appendUrlEscaped(out, name);
+        if (e.dir) {
+            out->push_back('/');
+        }
+        out->append("\">");
+        appendHtmlEscaped(out, name);
+        if (e.dir) {
+            out->push_back('/');
+        }
+        out->append("</a></li>\n");
+    }
+    out->append("</ul>\n");
+}
+
+// Returns the page of d that query asks for: the cached default page, or
+// one rendered into *scratch.
+std::string_view dirListingPage(DirListing *d, std::string_view urlPath,
+                                std::string_view query, std::string *scratch) {
+    DirPage p = parseDirPage(query);
+    if (!isDefaultDirPage(p)) {
+        renderDirPage(scratch, *d, urlPath, p);
+        return *scratch;
+    }
+    if (d->page.empty()) {
+        renderDirPage(&d->page, *d, urlPath, p);
+    }
+    return d->page;
+}
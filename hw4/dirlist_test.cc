@@ -0,0 +1,115 @@
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+
+#include "parser.cc"
+#include "dirlist.cc"
+
+TEST(DirListTest, Escaping) {
+    std::string s;
+    appendHtmlEscaped(&s, "a<b>&\"c'");
+    EXPECT_EQ(s, "a&lt;b&gt;&amp;&quot;c&#39;");
+    s.clear();
+    appendUrlEscaped(&s, "a b?#%:/\xc3\xa9~");
+    EXPECT_EQ(s, "a%20b%3F%23%25%3A%2F%C3%A9~");
+}
+
+TEST(DirListTest, PageParams) {
+    EXPECT_EQ(queryParam("a=1&b=2", "b"), "2");
+    EXPECT_EQ(queryParam("ab=1&b=", "b"), "");
+    EXPECT_EQ(queryParam("ab=1", "b").data(), nullptr);
+    DirPage p = parseDirPage("offset=20&limit=999999&sort=none&order=desc");
+    EXPECT_EQ(p.offset, 20u);
+    EXPECT_EQ(p.limit, DirMaxPageEntries);
+    EXPECT_TRUE(p.unsorted);
+    EXPECT_TRUE(p.reverse);
+    p = parseDirPage("limit=x");
+    EXPECT_EQ(p.offset, 0u);
+    EXPECT_EQ(p.limit, DirPageEntries);
+}
+
+TEST(DirListTest, SortPageAndInvalidate) {
+    char dir[] = "/tmp/dirlist_test.XXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    std::string path = std::string(dir) + "/";
+    for (const char *name : {"c", "a", "b<"}) {
+        close(open((path + name).c_str(), O_CREAT | O_WRONLY, 0644));
+    }
+    mkdir((path + "d").c_str(), 0755);
+    DirCache dc;
+    dirCacheInit(&dc, 1 << 20, 16);
+    struct stat st;
+    ASSERT_EQ(stat(dir, &st), 0);
+    std::shared_ptr<DirListing> d = dirCacheGet(&dc, path, st);
+    ASSERT_NE(d, nullptr);
+    std::string scratch;
+    std::string_view page = dirListingPage(d.get(), "/x/", "", &scratch);
+    EXPECT_NE(page.find("<h1>/x/</h1>"), std::string_view::npos);
+    size_t a = page.find(">a<"), b = page.find(">b&lt;<"),
+           c = page.find(">c<"), dd = page.find("href=\"/x/d/\">d/<");
+    EXPECT_LT(page.find(">../<"), a);
+    EXPECT_LT(a, b);
+    EXPECT_LT(b, c);
+    EXPECT_LT(c, dd);
+    EXPECT_NE(dd, std::string_view::npos);
+    EXPECT_EQ(page.data(), d->page.data()); // the default page is kept
+
+    page = dirListingPage(d.get(), "/x/", "offset=1&limit=2&order=desc",
+                          &scratch);
+    EXPECT_EQ(page.data(), scratch.data());
+    EXPECT_NE(page.find("2-3 of 5"), std::string_view::npos);
+    EXPECT_LT(page.find(">c<"), page.find(">b&lt;<"));
+    EXPECT_EQ(page.find(">a<"), std::string_view::npos);
+    EXPECT_NE(page.find("href=\"/x/?offset=0&amp;limit=2&amp;order=desc\""),
+              std::string_view::npos);
+    EXPECT_NE(page.find("href=\"/x/?offset=3&amp;limit=2&amp;order=desc\""),
+              std::string_view::npos);
+    std::string spaced;
+    renderDirPage(&spaced, *d, "/a b/%/", DirPage{0, 10, false, false});
+    EXPECT_NE(spaced.find("href=\"/a%20b/%25/c\""), std::string::npos);
+
+    EXPECT_EQ(dirCacheGet(&dc, path, st), d);
+    EXPECT_EQ(dc.hits, 1);
+    st.st_mtim.tv_nsec++; // as if an entry was added
+    unlink((path + "c").c_str());
+    std::shared_ptr<DirListing> d2 = dirCacheGet(&dc, path, st);
+    EXPECT_NE(d2, d);
+    EXPECT_EQ(d2->entries.size(), 4u);
+    EXPECT_EQ(dc.misses, 2);
+
+    for (const char *name : {"a", "b<", "d"}) {
+        remove((path + name).c_str());
+    }
+    rmdir(dir);
+}
+
+TEST(DirListTest, EvictsLeastRecentlyUsed) {
+    char dir[] = "/tmp/dirlist_test.XXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    std::string root = dir;
+    DirCache dc;
+    dirCacheInit(&dc, 1 << 20, 2);
+    std::shared_ptr<DirListing> ds[3];
+    struct stat st[3];
+    for (int i = 0; i < 3; i++) {
+        std::string path = root + "/" + char('a' + i) + "/";
+        mkdir(path.c_str(), 0755);
+        ASSERT_EQ(stat(path.c_str(), &st[i]), 0);
+        if (i == 2) {
+            EXPECT_EQ(dirCacheGet(&dc, root + "/a/", st[0]), ds[0]);
+        }
+        ds[i] = dirCacheGet(&dc, path, st[i]);
+    }
+    EXPECT_EQ(dc.hits, 1);
+    EXPECT_EQ(dirCacheGet(&dc, root + "/a/", st[0]), ds[0]);
+    EXPECT_EQ(dirCacheGet(&dc, root + "/c/", st[2]), ds[2]);
+    EXPECT_NE(dirCacheGet(&dc, root + "/b/", st[1]), ds[1]); // evicted
+    EXPECT_EQ(dc.hits, 3);
+    for (const char *name : {"/a", "/b", "/c", ""}) {
+        rmdir((root + name).c_str());
+    }
+}
@@ -0,0 +1,230 @@
+// Per-worker LRU cache of small static files.
+//
+// An entry keeps the whole file plus its precomputed response header, so a
+// hit is answered with a single writev() and no filesystem access. Every
+// cached file has an inotify watch; any change to it drops the entry.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct CachedFile {
+    std::string key;
+    std::string head; // status line and headers, without Connection
+    std::string notModifiedHead; // the same for 304 responses
+    std::string body;
+    std::string etag;
+    time_t mtime;
+    int wd;
+    bool hasVariant; // a compressed variant may be served instead
+};
+
+struct FileCache {
+    int inotifyFd;
+    size_t maxBytes;
+    size_t maxEntries;
+    size_t bytes;
+    std::list<std::shared_ptr<CachedFile>> lru; // most recently used first
+    // keyed by views of CachedFile::key, so that lookups need no copy
+    std::unordered_map<std::string_view,
+                       std::list<std::shared_ptr<CachedFile>>::iterator>
+        index;
+    std::unordered_map<int, std::vector<std::string>> watches;
+    long hits;
+    long misses;
+};
+
+// Returns -1 if inotify is not available; the cache is disabled then.
+int fileCacheInit(FileCache *fc, size_t maxBytes, size_t maxEntries) {
+    fc->maxBytes = maxBytes;
+    fc->maxEntries = maxEntries;
+    fc->bytes = 0;
+    fc->hits = fc->misses = 0;
+    fc->inotifyFd = -1;
+    if (maxBytes == 0 or maxEntries == 0) {
+        return 0;
+    }
+    fc->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fc->inotifyFd == -1) {
+        perror("inotify_init1() failed");
+        fc->maxBytes = fc->maxEntries = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Files larger than this are streamed with sendfile() instead.
+size_t fileCacheMaxFileSize(const FileCache *fc) { return fc->maxBytes / 8; }
+
+static void fileCacheErase(FileCache *fc, std::string_view key) {
+    auto it = fc->index.find(key);
+    if (it == fc->index.end()) {
+        return;
+    }
+    std::shared_ptr<CachedFile> f = *it->second;
+    fc->bytes -= f->head.size() + f->notModifiedHead.size() + f->body.size();
+    fc->lru.erase(it->second);
+    fc->index.erase(it);
+    auto w = fc->watches.find(f->wd);
+    if (w == fc->watches.end()) {
+        return;
+    }
+    std::vector<std::string> &keys = w->second;
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (keys[i] == key) {
+            keys[i] = keys.back();
+            keys.pop_back();
+            break;
+        }
+    }
+    if (keys.empty()) {
+        inotify_rm_watch(fc->inotifyFd, f->wd);
+        fc->watches.erase(w);
+    }
+}
+
+std::shared_ptr<CachedFile> fileCacheLookup(FileCache *fc,
+                                            std::string_view key) {
+    auto it = fc->index.find(key);
+    if (it == fc->index.end()) {
+        fc->misses++;
+        return nullptr;
+    }
+    fc->hits++;
+    fc->lru.splice(fc->lru.begin(), fc->lru, it->second);
+    return *it->second;
+}
+
+// Drops any entry for key and starts watching path for a new one. This is
+// done before the contents are read, so that a concurrent change is not
+// missed. Returns -1 on failure.
+int fileCacheWatch(FileCache *fc, std::string_view key, const char *path) {
+    if (fc->inotifyFd == -1) {
+        return -1;
+    }
+    fileCacheErase(fc, key);
+    return inotify_add_watch(fc->inotifyFd, path,
+                             IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF |
+                                 IN_DELETE_SELF | IN_CLOSE_WRITE);
+}
+
+// Drops a watch from fileCacheWatch() that ended up not being used.
+void fileCacheUnwatch(FileCache *fc, int wd) {
+    if (fc->watches.find(wd) == fc->watches.end()) {
+        inotify_rm_watch(fc->inotifyFd, wd);
+    }
+}
+
+// Formats the 200 and 304 response heads, without the Connection header,
+// of a size-byte file with the stat st and its ETag.
+void formatFileHeads(std::string *head, std::string *notModifiedHead,
+                     std::string *etagOut, size_t size, const struct stat &st,
+                     const char *extra, const char *etagSuffix) {
+    char etag[64], date[32], buf[512];
+    etagOut->assign(etag, formatETag(etag, st, etagSuffix));
+    formatHttpDate(date, st.st_mtime);
+    int n = snprintf(buf, sizeof buf,
+                     "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n"
+                     "Last-Modified: %s\r\n",
+                     etag, date);
+    notModifiedHead->assign(buf, n);
+    n = snprintf(buf, sizeof buf,
+                 "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n%s"
+                 "Accept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\n",
+                 size, extra, etag, date);
+    head->assign(buf, n);
+}
+
+// Stores body under key. wd, from fileCacheWatch(), watches the file the
+// body was read from, with metadata st. extra is added to the response
+// headers and etagSuffix to the ETag. Returns NULL, with wd released, if the
+// body is too large.
+std::shared_ptr<CachedFile> fileCacheStore(FileCache *fc,
+                                           std::string_view key, int wd,
+                                           std::string body,
+                                           const struct stat &st,
+                                           const char *extra = "",
+                                           const char *etagSuffix = "") {
+    if (body.size() > fileCacheMaxFileSize(fc)) {
+        fileCacheUnwatch(fc, wd);
+        return nullptr;
+    }
+    auto f = std::make_shared<CachedFile>();
+    f->key = key;
+    f->wd = wd;
+    f->body = std::move(body);
+    f->hasVariant = false;
+    f->mtime = st.st_mtime;
+    formatFileHeads(&f->head, &f->notModifiedHead, &f->etag, f->body.size(),
+                    st, extra, etagSuffix);
+    fc->watches[wd].push_back(f->key);
+    fc->lru.push_front(f);
+    fc->index[f->key] = fc->lru.begin();
+    fc->bytes += f->head.size() + f->notModifiedHead.size() + f->body.size();
+    while (fc->bytes > fc->maxBytes or fc->index.size() > fc->maxEntries) {
+        std::string victim = fc->lru.back()->key;
+        fileCacheErase(fc, victim);
+    }
+    return f;
+}
+
+// Reads the regular file fd, opened from path, into the cache under key.
+// Returns NULL if the file is too large or cannot be read or watched.
+std::shared_ptr<CachedFile> fileCacheInsert(FileCache *fc,
+                                            std::string_view key,
+                                            const char *path, int fd,
+                                            const struct stat &st,
+                                            const char *extra = "") {
+    if (fc->inotifyFd == -1 or !S_ISREG(st.st_mode) or
+        (size_t)st.st_size > fileCacheMaxFileSize(fc)) {
+        return nullptr;
+    }
+    int wd = fileCacheWatch(fc, key, path);
+    if (wd == -1) {
+        return nullptr;
+    }
+    std::string body(st.st_size, 0);
+    size_t got = 0;
+    while (got < body.size()) {
+        ssize_t r = pread(fd, &body[got], body.size() - got, got);
+        if (r <= 0) {
+            fileCacheUnwatch(fc, wd);
+            return nullptr;
+        }
+        got += r;
+    }
+    return fileCacheStore(fc, key, wd, std::move(body), st, extra);
+}
+
+// Drops the entries invalidated by pending inotify events.
+void fileCacheProcessEvents(FileCache *fc) {
+    alignas(struct inotify_event) char buf[4096];
+    while (true) {
+        ssize_t r = read(fc->inotifyFd, buf, sizeof buf);
+        if (r <= 0) {
+            return;
+        }
+        for (char *p = buf; p < buf + r;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof *ev + ev->len;
+            auto w = fc->watches.find(ev->wd);
+            if (w == fc->watches.end()) {
+                continue;
+            }
+            std::vector<std::string> keys = w->second;
+            for (const std::string &key : keys) {
+                fileCacheErase(fc, key);
+            }
+        }
+    }
+}
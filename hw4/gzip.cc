@@ -0,0 +1,35 @@
+// gzip encoding of static files, see sendFile().
+
+#include <string.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include <string>
+
+static const char GzipHeaders[] =
+    "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n";
+
+// Sizes of the files --gzip compresses.
+static const off_t MinCompressSize = 256;
+static const off_t MaxCompressSize = 16 << 20;
+
+// Compresses data[0:n] into a gzip stream. Returns false on zlib errors.
+bool gzipCompress(const char *data, size_t n, std::string *out,
+                  int level = 6) {
+    z_stream zs;
+    memset(&zs, 0, sizeof zs);
+    // 15 window bits + 16 selects the gzip wrapper
+    if (Z_OK != deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8,
+                             Z_DEFAULT_STRATEGY)) {
+        return false;
+    }
+    out->resize(deflateBound(&zs, n));
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = n;
+    zs.next_out = (Bytef *)&(*out)[0];
+    zs.avail_out = out->size();
+    int r = deflate(&zs, Z_FINISH);
+    out->resize(zs.total_out);
+    deflateEnd(&zs);
+    return r == Z_STREAM_END;
+}
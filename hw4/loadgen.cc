@@ -0,0 +1,647 @@
+// HTTP load generator for benchmarking webserver.
+//
+// Every thread runs an epoll loop over its share of the connections, which
+// are kept alive (or, with -N, opened anew for every request). In the
+// closed loop, the default, a connection sends its next request as soon as
+// the previous response is complete. With -r RATE the load is an open loop:
+// each connection has a fixed schedule of RATE/CONNS requests per second,
+// and a request's latency is measured from when it was due, not from when
+// the connection got around to sending it. A server that stalls is thus
+// charged for every request it held up instead of for one (no coordinated
+// omission). Responses end with their Content-Length, their last chunk or
+// the end of the connection.
+//
+// Results are the request rate, latency percentiles and, with -p PID, the
+// CPU time the server used per request; -j prints them as one JSON object.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+static const char *usage =
+    "usage: ./loadgen [-c CONNS] [-t THREADS] [-d SECONDS] [-r RATE] [-N]\n"
+    "                 [-p SERVER_PID] [-j] [-l LABEL] HOST PORT PATH\n";
+
+// Latencies in microseconds are counted in buckets 1/32 of a power of two
+// wide, so percentiles are accurate to about 3%.
+static const int SubBits = 5;
+static const int LatencyBuckets = 64 << SubBits;
+
+struct Latency {
+    uint64_t counts[LatencyBuckets];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+static int latencyBucket(uint64_t us) {
+    if (us < (1u << SubBits)) {
+        return us;
+    }
+    int e = 63 - __builtin_clzll(us);
+    return ((e - SubBits + 1) << SubBits) +
+           ((us >> (e - SubBits)) & ((1u << SubBits) - 1));
+}
+
+// Returns the smallest value of the bucket after b.
+static uint64_t latencyBucketEnd(int b) {
+    if (b < (1 << SubBits)) {
+        return b + 1;
+    }
+    int e = (b >> SubBits) + SubBits - 1;
+    uint64_t m = (b & ((1u << SubBits) - 1)) + (1u << SubBits) + 1;
+    return m << (e - SubBits);
+}
+
+static void latencyRecord(Latency *l, uint64_t us) {
+    l->counts[latencyBucket(us)]++;
+    l->count++;
+    l->sum += us;
+    if (us > l->max) {
+        l->max = us;
+    }
+}
+
+static void latencyAdd(Latency *to, const Latency &from) {
+    for (int i = 0; i < LatencyBuckets; i++) {
+        to->counts[i] += from.counts[i];
+    }
+    to->count += from.count;
+    to->sum += from.sum;
+    if (from.max > to->max) {
+        to->max = from.max;
+    }
+}
+
+// Returns the latency below which a fraction q of the requests completed,
+// rounded up to the end of its bucket but never above the maximum.
+static uint64_t latencyQuantile(const Latency &l, double q) {
+    uint64_t rank = (uint64_t)(q * l.count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < LatencyBuckets; i++) {
+        seen += l.counts[i];
+        if (seen >= rank) {
+            uint64_t end = latencyBucketEnd(i) - 1;
+            return end < l.max ? end : l.max;
+        }
+    }
+    return l.max;
+}
+
+// Where a connection is in the response it reads.
+enum ReadState {
+    ReadHead,
+    ReadBody,       // left bytes
+    ReadUntilClose, // a body without length
+    ReadChunkSize,
+    ReadChunkData,
+    ReadChunkEnd, // the CRLF after a chunk's data
+    ReadTrailer,
+};
+
+struct Thread;
+
+struct Client {
+    Thread *t;
+    int fd;          // -1 while not connected
+    bool connecting; // waiting for a non-blocking connect()
+    bool busy;       // a request is outstanding
+    double due;      // when the outstanding request was due, or sent
+    double next;     // when the next request is due, in the open loop
+    size_t sent;     // bytes of the request written
+    ReadState state;
+    std::string head; // the response head while it is read
+    int status;
+    bool close; // the server closes the connection after the response
+    long long left; // of the body or the current chunk
+    size_t lineLen; // of the current trailer line
+};
+
+struct Thread {
+    pthread_t thread;
+    int epfd;
+    std::vector<Client> clients;
+    Latency latency;
+    long completed;
+    long errors; // connections that failed or ended early
+    long non2xx; // responses with a status outside 200-399
+    long long bytes;
+};
+
+static struct sockaddr_in target;
+static std::string request;
+static bool newConnections; // -N
+static double interval;     // between a connection's requests, or 0
+static double startTime;
+static double endTime;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void setEvents(Client *c, uint32_t events, int op = EPOLL_CTL_MOD) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(c->t->epfd, op, c->fd, &ev);
+}
+
+static void disconnect(Client *c) {
+    if (c->fd != -1) {
+        close(c->fd); // also removes it from the epoll set
+        c->fd = -1;
+    }
+}
+
+// Starts a non-blocking connect(). Returns false on failure.
+static bool reconnect(Client *c) {
+    disconnect(c);
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd == -1) {
+        return false;
+    }
+    int yes = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    c->connecting = -1 == connect(c->fd, (struct sockaddr *)&target,
+                                  sizeof target);
+    if (c->connecting and errno != EINPROGRESS) {
+        disconnect(c);
+        return false;
+    }
+    setEvents(c, EPOLLIN | EPOLLOUT, EPOLL_CTL_ADD);
+    return true;
+}
+
+// Writes what is left of the request. Returns false on failure.
+static bool writeRequest(Client *c) {
+    while (c->sent < request.size()) {
+        ssize_t r = send(c->fd, request.data() + c->sent,
+                         request.size() - c->sent, MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EAGAIN or errno == EWOULDBLOCK) {
+                setEvents(c, EPOLLIN | EPOLLOUT);
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        c->sent += r;
+    }
+    setEvents(c, EPOLLIN);
+    return true;
+}
+
+// Sends the next request, which was due at due.
+static void sendRequest(Client *c, double due) {
+    c->busy = true;
+    c->due = due;
+    c->sent = 0;
+    c->state = ReadHead;
+    c->head.clear();
+    if (c->fd == -1 and !reconnect(c)) {
+        c->t->errors++;
+        c->busy = false;
+        return;
+    }
+    if (!c->connecting and !writeRequest(c)) {
+        c->t->errors++;
+        c->busy = false;
+        disconnect(c);
+    }
+}
+
+// Sends the next request if one is due.
+static void sendIfDue(Client *c, double t) {
+    if (c->busy or t >= endTime) {
+        return;
+    }
+    if (interval == 0) {
+        sendRequest(c, t);
+    } else if (c->next <= t) {
+        sendRequest(c, c->next);
+        c->next += interval;
+    }
+}
+
+static void finishResponse(Client *c) {
+    double t = now();
+    Thread *th = c->t;
+    c->busy = false;
+    if (t <= endTime) {
+        latencyRecord(&th->latency, (uint64_t)((t - c->due) * 1e6));
+        th->completed++;
+        if (c->status < 200 or c->status > 399) {
+            th->non2xx++;
+        }
+    }
+    if (c->close or newConnections) {
+        disconnect(c);
+    }
+    sendIfDue(c, t);
+}
+
+// Parses the response head in c->head. Returns false if it is malformed.
+static bool parseHead(Client *c) {
+    const char *h = c->head.c_str();
+    if (strncmp(h, "HTTP/1.", 7) != 0 or strlen(h) < 12) {
+        return false;
+    }
+    c->status = atoi(h + 9);
+    c->close = h[7] == '0';
+    c->state = ReadUntilClose;
+    if (c->status == 204 or c->status == 304 or c->status / 100 == 1) {
+        c->state = ReadBody;
+        c->left = 0;
+    }
+    for (const char *line = strchr(h, '\n'); line; line = strchr(line, '\n')) {
+        line++;
+        if (0 == strncasecmp(line, "Content-Length:", 15) and
+            c->state == ReadUntilClose) {
+            c->state = ReadBody;
+            c->left = atoll(line + 15);
+        } else if (0 == strncasecmp(line, "Transfer-Encoding:", 18) and
+                   strstr(line, "chunked") < strchr(line, '\n')) {
+            c->state = ReadChunkSize;
+            c->left = 0;
+        } else if (0 == strncasecmp(line, "Connection:", 11)) {
+            const char *v = line + 11 + strspn(line + 11, " ");
+            c->close = 0 == strncasecmp(v, "close", 5);
+        }
+    }
+    if (c->state == ReadUntilClose) {
+        c->close = true;
+    }
+    return true;
+}
+
+// Consumes n bytes of the response. Returns 1 once it is complete, 0 if
+// more is to come and -1 if it is malformed.
+static int consume(Client *c, const char *p, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        switch (c->state) {
+        case ReadHead: {
+            size_t old = c->head.size();
+            c->head.append(p + i, n - i);
+            size_t end = c->head.find("\r\n\r\n", old > 3 ? old - 3 : 0);
+            if (end == std::string::npos) {
+                return c->head.size() > 65536 ? -1 : 0;
+            }
+            i += end + 4 - old;
+            c->head.resize(end + 2);
+            if (!parseHead(c)) {
+                return -1;
+            }
+            if (c->state == ReadBody and c->left == 0) {
+                return 1;
+            }
+            break;
+        }
+        case ReadBody:
+        case ReadChunkData: {
+            size_t take = n - i < (size_t)c->left ? n - i : c->left;
+            i += take;
+            c->left -= take;
+            if (c->left == 0) {
+                if (c->state == ReadBody) {
+                    return 1;
+                }
+                c->state = ReadChunkEnd;
+            }
+            break;
+        }
+        case ReadUntilClose:
+            return 0;
+        case ReadChunkSize: {
+            char ch = p[i++];
+            if (ch == '\n') {
+                c->state = c->left ? ReadChunkData : ReadTrailer;
+                c->lineLen = 0;
+            } else if (ch >= '0' and ch <= '9') {
+                c->left = c->left * 16 + ch - '0';
+            } else if ((ch | 0x20) >= 'a' and (ch | 0x20) <= 'f') {
+                c->left = c->left * 16 + (ch | 0x20) - 'a' + 10;
+            } else if (ch != '\r' and ch != ';' and ch != ' ') {
+                c->left = -1; // chunk extensions end up here, harmlessly
+            }
+            if (c->left < 0) {
+                return -1;
+            }
+            break;
+        }
+        case ReadChunkEnd:
+            if (p[i++] == '\n') {
+                c->state = ReadChunkSize;
+            }
+            break;
+        case ReadTrailer: {
+            char ch = p[i++];
+            if (ch == '\n') {
+                if (c->lineLen == 0) {
+                    return 1;
+                }
+                c->lineLen = 0;
+            } else if (ch != '\r') {
+                c->lineLen++;
+            }
+            break;
+        }
+        }
+    }
+    return 0;
+}
+
+// Handles an event of c: a finished connect(), room to write, or input.
+static void handleEvent(Client *c, uint32_t events) {
+    Thread *t = c->t;
+    if (c->connecting) {
+        int err = 0;
+        socklen_t len = sizeof err;
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err or (events & (EPOLLERR | EPOLLHUP))) {
+            t->errors++;
+            c->busy = false;
+            disconnect(c);
+            return;
+        }
+        c->connecting = false;
+    }
+    if (c->busy and c->sent < request.size() and !writeRequest(c)) {
+        t->errors++;
+        c->busy = false;
+        disconnect(c);
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        return;
+    }
+    char buf[65536];
+    while (c->fd != -1) {
+        ssize_t r = read(c->fd, buf, sizeof buf);
+        if (r < 0 and (errno == EAGAIN or errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (r < 0 and errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            if (r == 0 and c->busy and c->state == ReadUntilClose) {
+                finishResponse(c);
+                return;
+            }
+            if (c->busy) {
+                t->errors++; // the response was cut off
+                c->busy = false;
+            }
+            disconnect(c);
+            return;
+        }
+        t->bytes += r;
+        if (!c->busy) {
+            continue; // nothing asked for it; dropped
+        }
+        int done = consume(c, buf, r);
+        if (done == -1) {
+            t->errors++;
+            c->busy = false;
+            disconnect(c);
+            return;
+        }
+        if (done == 1) {
+            finishResponse(c); // what followed the response is dropped
+        }
+    }
+}
+
+static void *runThread(void *arg) {
+    Thread *t = (Thread *)arg;
+    for (Client &c : t->clients) {
+        sendIfDue(&c, now());
+    }
+    struct epoll_event events[256];
+    while (true) {
+        double t0 = now();
+        if (t0 >= endTime) {
+            break;
+        }
+        double wake = endTime;
+        for (Client &c : t->clients) {
+            sendIfDue(&c, t0);
+            if (!c.busy and interval > 0 and c.next < wake) {
+                wake = c.next;
+            }
+        }
+        int timeout = (int)((wake - t0) * 1000) + 1;
+        int n = epoll_wait(t->epfd, events, 256, timeout);
+        for (int i = 0; i < n; i++) {
+            handleEvent((Client *)events[i].data.ptr, events[i].events);
+        }
+    }
+    for (Client &c : t->clients) {
+        disconnect(&c);
+    }
+    return NULL;
+}
+
+// Returns the CPU seconds process pid has used, or -1.
+static double processCpu(int pid) {
+    char path[64];
+    snprintf(path, sizeof path, "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof buf - 1, f);
+    fclose(f);
+    buf[n] = 0;
+    // the fields after the command name, which may contain spaces
+    const char *p = strrchr(buf, ')');
+    unsigned long utime, stime;
+    if (p == NULL or 2 != sscanf(p + 2,
+                                 "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u "
+                                 "%*u %lu %lu",
+                                 &utime, &stime)) {
+        return -1;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double selfCpu() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+int main(int argc, char **argv) {
+    int conns = 16;
+    int threads = 0;
+    double duration = 5;
+    double rate = 0;
+    int serverPid = 0;
+    bool json = false;
+    const char *label = "";
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "c:t:d:r:Np:jl:"))) {
+        switch (opt) {
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'N':
+            newConnections = true;
+            break;
+        case 'p':
+            serverPid = atoi(optarg);
+            break;
+        case 'j':
+            json = true;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            fputs(usage, stderr);
+            return 1;
+        }
+    }
+    if (argc - optind != 3 or conns < 1 or duration <= 0 or rate < 0) {
+        fputs(usage, stderr);
+        return 1;
+    }
+    if (threads < 1) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > conns) {
+        threads = conns;
+    }
+    target.sin_family = AF_INET;
+    target.sin_port = htons(atoi(argv[optind + 1]));
+    if (1 != inet_pton(AF_INET, argv[optind], &target.sin_addr)) {
+        fprintf(stderr, "invalid address %s\n", argv[optind]);
+        return 1;
+    }
+    request = std::string("GET ") + argv[optind + 2] +
+              " HTTP/1.1\r\nHost: " + argv[optind] + "\r\n" +
+              (newConnections ? "Connection: close\r\n" : "") + "\r\n";
+    interval = rate > 0 ? conns / rate : 0;
+    std::vector<Thread> ts(threads);
+    startTime = now();
+    endTime = startTime + duration;
+    for (int i = 0; i < conns; i++) {
+        Thread *t = &ts[i % threads];
+        Client c;
+        c.t = t;
+        c.fd = -1;
+        c.connecting = false;
+        c.busy = false;
+        // spread the connections' schedules over one interval
+        c.next = startTime + interval * i / conns;
+        t->clients.push_back(c);
+    }
+    double serverCpu = serverPid ? processCpu(serverPid) : -1;
+    double clientCpu = selfCpu();
+    for (Thread &t : ts) {
+        t.epfd = epoll_create1(EPOLL_CLOEXEC);
+        memset(&t.latency, 0, sizeof t.latency);
+        t.completed = t.errors = t.non2xx = 0;
+        t.bytes = 0;
+        pthread_create(&t.thread, 0, runThread, &t);
+    }
+    for (Thread &t : ts) {
+        pthread_join(t.thread, 0);
+        close(t.epfd);
+    }
+    double elapsed = now() - startTime;
+    if (serverCpu >= 0) {
+        double after = processCpu(serverPid);
+        serverCpu = after >= 0 ? after - serverCpu : -1;
+    }
+    clientCpu = selfCpu() - clientCpu;
+    static Latency l;
+    long completed = 0, errors = 0, non2xx = 0;
+    long long bytes = 0;
+    for (Thread &t : ts) {
+        latencyAdd(&l, t.latency);
+        completed += t.completed;
+        errors += t.errors;
+        non2xx += t.non2xx;
+        bytes += t.bytes;
+    }
+    double perRequest = completed ? 1e6 / completed : 0;
+    if (json) {
+        printf("{\"label\": \"%s\", \"mode\": \"%s\", \"conns\": %d, "
+               "\"threads\": %d, \"new_connections\": %s, "
+               "\"target_rate\": %.0f, \"duration_s\": %.3f, "
+               "\"requests\": %ld, \"errors\": %ld, \"non_2xx\": %ld, "
+               "\"rps\": %.1f, \"mbytes_per_s\": %.3f, "
+               "\"latency_us\": {\"mean\": %.1f, \"p50\": %llu, "
+               "\"p90\": %llu, \"p99\": %llu, \"p999\": %llu, "
+               "\"max\": %llu}, \"server_cpu_us_per_req\": ",
+               label, rate > 0 ? "open" : "closed", conns, threads,
+               newConnections ? "true" : "false", rate, elapsed, completed,
+               errors, non2xx, completed / elapsed, bytes / elapsed / 1e6,
+               l.count ? (double)l.sum / l.count : 0.0,
+               (unsigned long long)latencyQuantile(l, 0.5),
+               (unsigned long long)latencyQuantile(l, 0.9),
+               (unsigned long long)latencyQuantile(l, 0.99),
+               (unsigned long long)latencyQuantile(l, 0.999),
+               (unsigned long long)l.max);
+        if (serverCpu >= 0) {
+            printf("%.2f", serverCpu * perRequest);
+        } else {
+            printf("null");
+        }
+        printf(", \"client_cpu_us_per_req\": %.2f}\n", clientCpu * perRequest);
+        return 0;
+    }
+    printf("%ld requests, %ld failed, %.1f s, %.0f req/s\n", completed,
+           errors, elapsed, completed / elapsed);
+    if (non2xx) {
+        printf("%ld responses with a status outside 200-399\n", non2xx);
+    }
+    printf("latency us: mean %.1f p50 %llu p90 %llu p99 %llu p99.9 %llu "
+           "max %llu\n",
+           l.count ? (double)l.sum / l.count : 0.0,
+           (unsigned long long)latencyQuantile(l, 0.5),
+           (unsigned long long)latencyQuantile(l, 0.9),
+           (unsigned long long)latencyQuantile(l, 0.99),
+           (unsigned long long)latencyQuantile(l, 0.999),
+           (unsigned long long)l.max);
+    if (serverCpu >= 0) {
+        printf("cpu per request: server %.2f us, client %.2f us\n",
+               serverCpu * perRequest, clientCpu * perRequest);
+    }
+    return 0;
+}
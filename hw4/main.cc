@@ -1,48 +1,274 @@
 #include "webserver.cc"
 
-int main(int argc, char **argv) {
-    assert(argc == 3 && "usage: ./webserver PORT DOCROOT");
-    if (signal(SIGALRM, handleAlarm) == SIG_ERR) {
-        perror("signal() failed");
-        return 1;
-    }
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (-1 == chdir(argv[2])) {
-        perror("chdir() failed");
-        return 2;
-    }
+#include <getopt.h>
+#include <netinet/tcp.h>
+
+static const char *usage =
+    "usage: ./webserver [--workers N] [--backlog N] [--pin]\n"
+    "                   [--idle-timeout SECS] [--request-timeout SECS]\n"
+    "                   [--header-timeout SECS] [--body-timeout SECS]\n"
+    "                   [--response-timeout SECS] [--max-requests N]\n"
+    "                   [--max-header-bytes N] [--cache-bytes N]\n"
+    "                   [--cache-entries N] [--stat-ttl MS] [--gzip]\n"
+    "                   [--gzip-cache-bytes N] [--cgi-pool SCRIPT=N]...\n"
+    "                   [--io-uring] [--server-status] [--phase-timing]\n"
+    "                   [--access-log FILE|-|none] [--access-log-bytes N]\n"
+    "                   [--max-conns N] [--max-cgi N] [--max-queued-bytes N]\n"
+    "                   [--retry-after SECS] PORT DOCROOT\n";
+
+// Returns a non-blocking listening socket, or -1 after printing the error.
+// Connections are only accepted once their first data arrives, or after
+// deferSecs without it.
+int listenOn(int port, int backlog, bool reuseport, int deferSecs) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sock == -1) {
         perror("socket() failed");
-        return 3;
+        return -1;
     }
-    {
-        int yes = 1;
-        if (-1 ==
-            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes)) {
-            perror("setsockopt() failed");
-            return 5;
-        }
+    int yes = 1;
+    if (-1 == setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes)) {
+        perror("setsockopt() failed");
+        return -1;
+    }
+    if (reuseport and
+        -1 == setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof yes)) {
+        perror("setsockopt(SO_REUSEPORT) failed");
+        return -1;
+    }
+    if (deferSecs > 0 and -1 == setsockopt(sock, IPPROTO_TCP,
+                                           TCP_DEFER_ACCEPT, &deferSecs,
+                                           sizeof deferSecs)) {
+        perror("setsockopt(TCP_DEFER_ACCEPT) failed");
+        return -1;
     }
     struct sockaddr_in saddr;
     saddr.sin_family = AF_INET;
-    saddr.sin_port = htons(atoi(argv[1]));
+    saddr.sin_port = htons(port);
     saddr.sin_addr.s_addr = 0;
     if (-1 == bind(sock, (struct sockaddr *)&saddr, sizeof saddr)) {
         perror("bind() failed");
-        return 5;
+        return -1;
     }
-    if (-1 == listen(sock, 5)) {
+    if (-1 == listen(sock, backlog)) {
         perror("listen() failed");
-        return 6;
+        return -1;
+    }
+    return sock;
+}
+
+int main(int argc, char **argv) {
+    int workers = 1;
+    int backlog = SOMAXCONN;
+    bool pin = false;
+    bool gzip = false;
+    size_t gzipCacheBytes = 16 << 20;
+    const char *accessLogPath = "-";
+    size_t accessLogBytes = 1 << 20;
+    int retryAfter = 1;
+    static const struct option longopts[] = {
+        {"workers", required_argument, 0, 'w'},
+        {"backlog", required_argument, 0, 'b'},
+        {"pin", no_argument, 0, 'p'},
+        {"idle-timeout", required_argument, 0, 'i'},
+        {"request-timeout", required_argument, 0, 'r'},
+        {"header-timeout", required_argument, 0, 'h'},
+        {"body-timeout", required_argument, 0, 't'},
+        {"response-timeout", required_argument, 0, 'o'},
+        {"max-requests", required_argument, 0, 'm'},
+        {"max-header-bytes", required_argument, 0, 'H'},
+        {"cache-bytes", required_argument, 0, 'C'},
+        {"cache-entries", required_argument, 0, 'E'},
+        {"stat-ttl", required_argument, 0, 'T'},
+        {"gzip", no_argument, 0, 'z'},
+        {"gzip-cache-bytes", required_argument, 0, 'Z'},
+        {"cgi-pool", required_argument, 0, 'P'},
+        {"io-uring", no_argument, 0, 'U'},
+        {"server-status", no_argument, 0, 'S'},
+        {"phase-timing", no_argument, 0, 'x'},
+        {"access-log", required_argument, 0, 'L'},
+        {"access-log-bytes", required_argument, 0, 'B'},
+        {"max-conns", required_argument, 0, 'c'},
+        {"max-cgi", required_argument, 0, 'g'},
+        {"max-queued-bytes", required_argument, 0, 'q'},
+        {"retry-after", required_argument, 0, 'R'},
+        {0, 0, 0, 0},
+    };
+    int opt;
+    while (-1 != (opt = getopt_long(argc, argv, "", longopts, 0))) {
+        switch (opt) {
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'p':
+            pin = true;
+            break;
+        case 'i':
+            opts.idleTimeout = atoi(optarg);
+            break;
+        case 'r':
+            opts.requestTimeout = atoi(optarg);
+            break;
+        case 'h':
+            opts.headerTimeout = atoi(optarg);
+            break;
+        case 't':
+            opts.bodyTimeout = atoi(optarg);
+            break;
+        case 'o':
+            opts.responseTimeout = atoi(optarg);
+            break;
+        case 'm':
+            opts.maxRequests = atoi(optarg);
+            break;
+        case 'H':
+            opts.maxHeaderBytes = atoi(optarg);
+            break;
+        case 'C':
+            opts.cacheBytes = strtoul(optarg, 0, 10);
+            break;
+        case 'E':
+            opts.cacheEntries = strtoul(optarg, 0, 10);
+            break;
+        case 'T':
+            opts.statTTL = atol(optarg);
+            break;
+        case 'z':
+            gzip = true;
+            break;
+        case 'Z':
+            gzipCacheBytes = strtoul(optarg, 0, 10);
+            break;
+        case 'P': {
+            CgiPoolSpec spec;
+            if (!parseCgiPoolSpec(optarg, &spec)) {
+                fprintf(stderr, "invalid --cgi-pool %s\n", optarg);
+                return 1;
+            }
+            opts.cgiPools.push_back(spec);
+            break;
+        }
+        case 'U':
+            opts.ioUring = true;
+            break;
+        case 'S':
+            opts.serverStatus = true;
+            break;
+        case 'x':
+            opts.phaseTiming = true;
+            break;
+        case 'L':
+            accessLogPath = optarg;
+            break;
+        case 'B':
+            accessLogBytes = strtoul(optarg, 0, 10);
+            break;
+        case 'c':
+            opts.maxConns = atoi(optarg);
+            break;
+        case 'g':
+            opts.maxCgi = atoi(optarg);
+            break;
+        case 'q':
+            opts.maxQueuedBytes = atoll(optarg);
+            break;
+        case 'R':
+            retryAfter = atoi(optarg);
+            break;
+        default:
+            fputs(usage, stderr);
+            return 1;
+        }
+    }
+    if (argc - optind != 2 or workers < 1) {
+        fputs(usage, stderr);
+        return 1;
+    }
+    if (gzip) {
+        opts.gzipCacheBytes = gzipCacheBytes;
+    }
+    buildOverloadResponse(retryAfter);
+    if (opts.phaseTiming) {
+        calibrateTicks();
+    }
+    const char *port = argv[optind];
+    const char *docroot = argv[optind + 1];
+    if (signal(SIGUSR1, handleUsr1) == SIG_ERR or
+        signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        perror("signal() failed");
+        return 1;
+    }
+    // blocked before any thread starts, so that every thread inherits it;
+    // the workers read it from a signalfd
+    sigset_t sigchld;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, NULL);
+    srandom(time(0) ^ getpid());
+    int logFd = -1;
+    if (0 == strcmp(accessLogPath, "-")) {
+        logFd = STDERR_FILENO;
+    } else if (0 != strcmp(accessLogPath, "none")) {
+        // opened before chdir(), so a relative path is one to the cwd
+        logFd = open(accessLogPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                     0644);
+        if (logFd == -1) {
+            perror("cannot open the access log");
+            return 2;
+        }
+    }
+    struct stat rootSt;
+    if (0 == stat(docroot, &rootSt) and S_ISREG(rootSt.st_mode)) {
+        // a bundle from mkbundle rather than a directory
+        bundle = new Bundle;
+        if (-1 == bundleOpen(bundle, docroot)) {
+            perror("cannot open the bundle");
+            return 2;
+        }
+    } else if (-1 == chdir(docroot)) {
+        perror("chdir() failed");
+        return 2;
+    }
+    Worker *ws = new Worker[workers];
+    allWorkers = ws;
+    numWorkers = workers;
+    for (int i = 0; i < workers; i++) {
+        ws[i].id = i;
+        ws[i].pin = pin;
+        metricsInit(&ws[i].metrics, nowMs());
+        ws[i].log = NULL;
+        ws[i].logClock.second = 0;
+        // created before any worker runs, as any of them may poke it
+        ws[i].childWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (ws[i].childWake == -1) {
+            perror("eventfd() failed");
+            return 3;
+        }
+        if (logFd != -1) {
+            ws[i].log = new LogRing;
+            logRingInit(ws[i].log, accessLogBytes);
+            accessLog.rings.push_back(ws[i].log);
+        }
+        // a connection silent for that long would be closed anyway
+        ws[i].sock = listenOn(atoi(port), backlog, workers > 1,
+                              opts.requestTimeout);
+        if (ws[i].sock == -1) {
+            return 3;
+        }
+    }
+    if (logFd != -1 and -1 == accessLogStart(&accessLog, logFd)) {
+        perror("cannot start the access log thread");
+        return 4;
     }
-    while (true) {
-        struct sockaddr_in caddr;
-        socklen_t caddr_len = sizeof caddr;
-        int csock = accept(sock, (struct sockaddr *)&caddr, &caddr_len);
-        if (csock == -1) {
-            perror("accept() failed");
-            continue;
+    for (int i = 1; i < workers; i++) {
+        int err = pthread_create(&ws[i].thread, 0, runWorker, &ws[i]);
+        if (err) {
+            fprintf(stderr, "pthread_create() failed: %s\n", strerror(err));
+            return 4;
         }
-        handle(csock, caddr);
     }
+    runWorker(&ws[0]);
+    return 7;
 }
@@ -0,0 +1,493 @@
+// Per-worker metrics for the /server-status endpoint.
+//
+// Every worker owns a Metrics and is the only thread writing it, so the
+// counters are updated with a relaxed load and store instead of a locked
+// read-modify-write: the hot path pays for a plain add. /server-status,
+// served by whichever worker gets the request, reads all workers' counters
+// with relaxed loads into a MetricsSnapshot and renders that as Prometheus
+// text or JSON. Latencies go into log-bucketed histograms with 4 buckets
+// per power of two, so quantiles are accurate to 25%. With --phase-timing
+// the stages of the request pipeline are timed too, in nanoseconds.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <string>
+
+// What answered a request.
+enum Handler {
+    HandlerStatic,   // files, also 304 and 416
+    HandlerDir,      // directory listings
+    HandlerRedirect, // the slash redirect of directories
+    HandlerCgi,      // spawned and pooled CGI
+    HandlerError,    // 4xx and 5xx error pages
+    HandlerStatus,   // /server-status itself
+    HandlerCount,
+};
+
+static const char *const HandlerNames[HandlerCount] = {
+    "static", "dir", "redirect", "cgi", "error", "status",
+};
+
+// The per-worker caches whose hits and misses are reported.
+enum {
+    CacheFile,
+    CacheGzip,
+    CachePath,
+    CacheDir,
+    CacheCount,
+};
+
+static const char *const CacheNames[CacheCount] = {
+    "file", "gzip", "path", "dir",
+};
+
+// Why a request was answered with 503, see shedRequest().
+enum {
+    ShedConns, // --max-conns
+    ShedCgi,   // --max-cgi
+    ShedBytes, // --max-queued-bytes
+    ShedCount,
+};
+
+static const char *const ShedNames[ShedCount] = {
+    "conns", "cgi", "bytes",
+};
+
+// The stages of the request pipeline --phase-timing times, see phaseBegin().
+// dispatch is all of serve(), cleanup_path and stat included.
+enum Phase {
+    PhaseAccept,
+    PhaseRequestLine,
+    PhaseHeaders,
+    PhaseCleanupPath,
+    PhaseStat,
+    PhaseDispatch,
+    PhaseSendfile,
+    PhaseCgiSpawn,
+    PhaseCgiWait,
+    PhaseClose,
+    PhaseCount,
+};
+
+static const char *const PhaseNames[PhaseCount] = {
+    "accept",   "request_line", "headers",   "cleanup_path", "stat",
+    "dispatch", "sendfile",     "cgi_spawn", "cgi_wait",     "close",
+};
+
+// Buckets 0-3 hold the values 0-3; above, bucket 4 * (e - 1) + m holds
+// [(4 + m) << (e - 2), (5 + m) << (e - 2)), for values with their highest
+// bit at e. 160 buckets reach 2^41 us, about 25 days.
+static const int HistBuckets = 160;
+
+// Requests are also counted per second in a ring of RateSlots seconds, of
+// which the last RateWindow complete ones give the current rate.
+static const int RateSlots = 16;
+static const int RateWindow = 10;
+
+typedef std::atomic<uint64_t> Counter;
+
+struct Histogram {
+    Counter counts[HistBuckets];
+    Counter sum; // of the recorded values
+};
+
+struct Metrics {
+    Counter requests[HandlerCount];
+    Counter rateSecond[RateSlots]; // the second a slot counts
+    Counter rate[RateSlots][HandlerCount];
+    Histogram latency[HandlerCount]; // us from the parsed head to the end
+    Histogram cgiSpawn;              // us posix_spawn() took
+    Histogram phases[PhaseCount];    // ns, with --phase-timing
+    Counter bytesSent;
+    Counter accepted;
+    Counter closed; // active connections are accepted - closed
+    Counter logDropped; // access log lines that did not fit the ring
+    Counter shed[ShedCount]; // requests answered with 503
+    Counter queuedBytes;     // Worker::queued after the last batch
+    Counter cacheHits[CacheCount]; // published by metricsPublishCache()
+    Counter cacheMisses[CacheCount];
+    long startMs; // nowMs() when the worker started
+};
+
+// Adds n to a counter that only the calling thread writes.
+static inline void metricAdd(Counter *c, uint64_t n) {
+    c->store(c->load(std::memory_order_relaxed) + n,
+             std::memory_order_relaxed);
+}
+
+static inline void metricSet(Counter *c, uint64_t v) {
+    c->store(v, std::memory_order_relaxed);
+}
+
+static inline uint64_t metricGet(const Counter &c) {
+    return c.load(std::memory_order_relaxed);
+}
+
+static void resetCounters(Counter *c, int n) {
+    for (int i = 0; i < n; i++) {
+        metricSet(&c[i], 0);
+    }
+}
+
+static void resetHistograms(Histogram *h, int n) {
+    for (int i = 0; i < n; i++) {
+        resetCounters(h[i].counts, HistBuckets);
+        metricSet(&h[i].sum, 0);
+    }
+}
+
+void metricsInit(Metrics *m, long nowMs) {
+    // atomics are not zeroed by default-initialization
+    resetCounters(m->requests, HandlerCount);
+    resetCounters(m->rateSecond, RateSlots);
+    for (int i = 0; i < RateSlots; i++) {
+        resetCounters(m->rate[i], HandlerCount);
+    }
+    resetHistograms(m->latency, HandlerCount);
+    resetHistograms(&m->cgiSpawn, 1);
+    resetHistograms(m->phases, PhaseCount);
+    metricSet(&m->bytesSent, 0);
+    metricSet(&m->accepted, 0);
+    metricSet(&m->closed, 0);
+    metricSet(&m->logDropped, 0);
+    resetCounters(m->shed, ShedCount);
+    metricSet(&m->queuedBytes, 0);
+    resetCounters(m->cacheHits, CacheCount);
+    resetCounters(m->cacheMisses, CacheCount);
+    m->startMs = nowMs;
+}
+
+int histBucket(uint64_t v) {
+    if (v < 4) {
+        return v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    int b = 4 * (e - 1) + ((v >> (e - 2)) & 3);
+    return b < HistBuckets ? b : HistBuckets - 1;
+}
+
+// Returns the smallest value that falls into a bucket after b.
+uint64_t histBucketEnd(int b) {
+    if (b < 3) {
+        return b + 1;
+    }
+    b++;
+    int e = b / 4 + 1;
+    return (uint64_t)(4 + b % 4) << (e - 2);
+}
+
+static inline void histRecord(Histogram *h, uint64_t v) {
+    metricAdd(&h->counts[histBucket(v)], 1);
+    metricAdd(&h->sum, v);
+}
+
+// Counts a finished request of handler that took latencyUs.
+void metricsRequest(Metrics *m, int handler, uint64_t latencyUs, long now) {
+    metricAdd(&m->requests[handler], 1);
+    histRecord(&m->latency[handler], latencyUs);
+    uint64_t second = now / 1000;
+    int slot = second % RateSlots;
+    if (metricGet(m->rateSecond[slot]) != second) {
+        for (Counter &c : m->rate[slot]) {
+            metricSet(&c, 0);
+        }
+        metricSet(&m->rateSecond[slot], second);
+    }
+    metricAdd(&m->rate[slot][handler], 1);
+}
+
+void metricsCgiSpawn(Metrics *m, uint64_t us) { histRecord(&m->cgiSpawn, us); }
+
+void metricsPhase(Metrics *m, int phase, uint64_t ns) {
+    histRecord(&m->phases[phase], ns);
+}
+
+// Copies the hit and miss counters of a cache, which only its worker may
+// read, into m.
+void metricsPublishCache(Metrics *m, int cache, long hits, long misses) {
+    metricSet(&m->cacheHits[cache], hits);
+    metricSet(&m->cacheMisses[cache], misses);
+}
+
+struct HistSnapshot {
+    uint64_t counts[HistBuckets];
+    uint64_t count;
+    uint64_t sum;
+};
+
+// The sum of all workers' metrics at one point in time.
+struct MetricsSnapshot {
+    int workers;
+    double uptime; // seconds since the first worker started
+    uint64_t requests[HandlerCount];
+    double rate[HandlerCount]; // requests per second, recently
+    HistSnapshot latency[HandlerCount];
+    HistSnapshot cgiSpawn;
+    HistSnapshot phases[PhaseCount];
+    uint64_t bytesSent;
+    uint64_t accepted;
+    uint64_t active;
+    uint64_t logDropped;
+    uint64_t shed[ShedCount];
+    uint64_t queuedBytes;
+    uint64_t cacheHits[CacheCount];
+    uint64_t cacheMisses[CacheCount];
+};
+
+static void histAdd(HistSnapshot *s, const Histogram &h) {
+    for (int i = 0; i < HistBuckets; i++) {
+        uint64_t n = metricGet(h.counts[i]);
+        s->counts[i] += n;
+        s->count += n;
+    }
+    s->sum += metricGet(h.sum);
+}
+
+// Returns the value below which a fraction q of the recorded values lie,
+// rounded up to the end of its bucket; 0 if nothing was recorded.
+uint64_t histQuantile(const HistSnapshot &s, double q) {
+    if (s.count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)ceil(q * s.count);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HistBuckets; i++) {
+        seen += s.counts[i];
+        if (seen >= rank) {
+            return histBucketEnd(i);
+        }
+    }
+    return histBucketEnd(HistBuckets - 1);
+}
+
+void metricsSnapshotInit(MetricsSnapshot *s) { memset(s, 0, sizeof *s); }
+
+// Adds the metrics of one worker to s.
+void metricsCollect(MetricsSnapshot *s, const Metrics *m, long now) {
+    s->workers++;
+    double uptime = (now - m->startMs) / 1000.0;
+    if (uptime > s->uptime) {
+        s->uptime = uptime;
+    }
+    uint64_t second = now / 1000;
+    for (int h = 0; h < HandlerCount; h++) {
+        s->requests[h] += metricGet(m->requests[h]);
+        histAdd(&s->latency[h], m->latency[h]);
+        uint64_t recent = 0;
+        for (int i = 0; i < RateSlots; i++) {
+            uint64_t at = metricGet(m->rateSecond[i]);
+            if (at < second and at + RateWindow >= second) {
+                recent += metricGet(m->rate[i][h]);
+            }
+        }
+        s->rate[h] += (double)recent / RateWindow;
+    }
+    histAdd(&s->cgiSpawn, m->cgiSpawn);
+    for (int i = 0; i < PhaseCount; i++) {
+        histAdd(&s->phases[i], m->phases[i]);
+    }
+    s->bytesSent += metricGet(m->bytesSent);
+    uint64_t closed = metricGet(m->closed); // first, so active is >= 0
+    uint64_t accepted = metricGet(m->accepted);
+    s->accepted += accepted;
+    s->active += accepted - closed;
+    s->logDropped += metricGet(m->logDropped);
+    for (int i = 0; i < ShedCount; i++) {
+        s->shed[i] += metricGet(m->shed[i]);
+    }
+    s->queuedBytes += metricGet(m->queuedBytes);
+    for (int i = 0; i < CacheCount; i++) {
+        s->cacheHits[i] += metricGet(m->cacheHits[i]);
+        s->cacheMisses[i] += metricGet(m->cacheMisses[i]);
+    }
+}
+
+static const double Quantiles[] = {0.5, 0.99, 0.999};
+
+// Appends the quantiles, sum and count of h, whose values are in units of
+// unit seconds.
+static void appendPrometheusSummary(std::string *out, const char *name,
+                                    const char *labels, const HistSnapshot &h,
+                                    double unit = 1e-6) {
+    char buf[256];
+    const char *sep = *labels ? "," : "";
+    for (double q : Quantiles) {
+        out->append(buf, snprintf(buf, sizeof buf,
+                                  "%s{%s%squantile=\"%g\"} %g\n", name, labels,
+                                  sep, q, histQuantile(h, q) * unit));
+    }
+    const char *open = *labels ? "{" : "";
+    const char *close = *labels ? "}" : "";
+    out->append(buf, snprintf(buf, sizeof buf, "%s_sum%s%s%s %g\n", name,
+                              open, labels, close, h.sum * unit));
+    out->append(buf, snprintf(buf, sizeof buf, "%s_count%s%s%s %llu\n", name,
+                              open, labels, close,
+                              (unsigned long long)h.count));
+}
+
+// Renders s in the Prometheus text exposition format.
+void renderPrometheus(std::string *out, const MetricsSnapshot &s) {
+    char buf[512];
+    out->append("# HELP webserver_requests_total Requests answered.\n"
+                "# TYPE webserver_requests_total counter\n");
+    for (int h = 0; h < HandlerCount; h++) {
+        out->append(buf, snprintf(buf, sizeof buf,
+                                  "webserver_requests_total{handler=\"%s\"} "
+                                  "%llu\n",
+                                  HandlerNames[h],
+                                  (unsigned long long)s.requests[h]));
+    }
+    out->append("# HELP webserver_request_duration_seconds Time from "
+                "the parsed request head to the last byte sent.\n"
+                "# TYPE webserver_request_duration_seconds summary\n");
+    for (int h = 0; h < HandlerCount; h++) {
+        char labels[32];
+        snprintf(labels, sizeof labels, "handler=\"%s\"", HandlerNames[h]);
+        appendPrometheusSummary(out, "webserver_request_duration_seconds",
+                                labels, s.latency[h]);
+    }
+    out->append("# HELP webserver_cgi_spawn_seconds Time posix_spawn() of a "
+                "CGI process took.\n"
+                "# TYPE webserver_cgi_spawn_seconds summary\n");
+    appendPrometheusSummary(out, "webserver_cgi_spawn_seconds", "",
+                            s.cgiSpawn);
+    out->append("# HELP webserver_phase_seconds Time spent in a stage of "
+                "the request pipeline, with --phase-timing.\n"
+                "# TYPE webserver_phase_seconds summary\n");
+    for (int i = 0; i < PhaseCount; i++) {
+        char labels[32];
+        snprintf(labels, sizeof labels, "phase=\"%s\"", PhaseNames[i]);
+        appendPrometheusSummary(out, "webserver_phase_seconds", labels,
+                                s.phases[i], 1e-9);
+    }
+    out->append(buf, snprintf(buf, sizeof buf,
+                              "# TYPE webserver_sent_bytes_total counter\n"
+                              "webserver_sent_bytes_total %llu\n"
+                              "# TYPE webserver_accepted_connections_total "
+                              "counter\n"
+                              "webserver_accepted_connections_total %llu\n"
+                              "# TYPE webserver_connections gauge\n"
+                              "webserver_connections %llu\n"
+                              "# TYPE webserver_access_log_dropped_total "
+                              "counter\n"
+                              "webserver_access_log_dropped_total %llu\n",
+                              (unsigned long long)s.bytesSent,
+                              (unsigned long long)s.accepted,
+                              (unsigned long long)s.active,
+                              (unsigned long long)s.logDropped));
+    out->append("# HELP webserver_shed_total Requests answered with 503 "
+                "as a limit was reached.\n"
+                "# TYPE webserver_shed_total counter\n");
+    for (int i = 0; i < ShedCount; i++) {
+        out->append(buf, snprintf(buf, sizeof buf,
+                                  "webserver_shed_total{limit=\"%s\"} %llu\n",
+                                  ShedNames[i], (unsigned long long)s.shed[i]));
+    }
+    out->append(buf, snprintf(buf, sizeof buf,
+                              "# TYPE webserver_queued_bytes gauge\n"
+                              "webserver_queued_bytes %llu\n",
+                              (unsigned long long)s.queuedBytes));
+    out->append("# TYPE webserver_cache_hits_total counter\n");
+    for (int i = 0; i < CacheCount; i++) {
+        out->append(buf, snprintf(buf, sizeof buf,
+                                  "webserver_cache_hits_total{cache=\"%s\"} "
+                                  "%llu\n",
+                                  CacheNames[i],
+                                  (unsigned long long)s.cacheHits[i]));
+    }
+    out->append("# TYPE webserver_cache_misses_total counter\n");
+    for (int i = 0; i < CacheCount; i++) {
+        out->append(buf, snprintf(buf, sizeof buf,
+                                  "webserver_cache_misses_total{cache=\"%s\"} "
+                                  "%llu\n",
+                                  CacheNames[i],
+                                  (unsigned long long)s.cacheMisses[i]));
+    }
+    out->append(buf, snprintf(buf, sizeof buf,
+                              "# TYPE webserver_workers gauge\n"
+                              "webserver_workers %d\n"
+                              "# TYPE webserver_uptime_seconds gauge\n"
+                              "webserver_uptime_seconds %.3f\n",
+                              s.workers, s.uptime));
+}
+
+static void appendJsonQuantiles(std::string *out, const HistSnapshot &h) {
+    char buf[160];
+    out->append(buf, snprintf(buf, sizeof buf,
+                              "{\"count\": %llu, \"mean\": %.1f, "
+                              "\"p50\": %llu, \"p99\": %llu, \"p999\": %llu}",
+                              (unsigned long long)h.count,
+                              h.count ? (double)h.sum / h.count : 0.0,
+                              (unsigned long long)histQuantile(h, 0.5),
+                              (unsigned long long)histQuantile(h, 0.99),
+                              (unsigned long long)histQuantile(h, 0.999)));
+}
+
+// Renders s as a JSON object; latencies are in microseconds.
+void renderJson(std::string *out, const MetricsSnapshot &s) {
+    char buf[256];
+    double rate = 0;
+    for (int h = 0; h < HandlerCount; h++) {
+        rate += s.rate[h];
+    }
+    out->append(buf, snprintf(buf, sizeof buf,
+                              "{\"uptime_seconds\": %.3f, \"workers\": %d,\n"
+                              " \"requests_per_second\": %.1f,\n"
+                              " \"requests\": {\n",
+                              s.uptime, s.workers, rate));
+    for (int h = 0; h < HandlerCount; h++) {
+        out->append(buf, snprintf(buf, sizeof buf,
+                                  "  \"%s\": {\"total\": %llu, "
+                                  "\"per_second\": %.1f, \"latency_us\": ",
+                                  HandlerNames[h],
+                                  (unsigned long long)s.requests[h],
+                                  s.rate[h]));
+        appendJsonQuantiles(out, s.latency[h]);
+        out->append(h + 1 < HandlerCount ? "},\n" : "}\n");
+    }
+    out->append(buf, snprintf(buf, sizeof buf,
+                              " },\n \"bytes_sent\": %llu,\n"
+                              " \"connections\": {\"active\": %llu, "
+                              "\"accepted\": %llu},\n"
+                              " \"access_log_dropped\": %llu,\n"
+                              " \"queued_bytes\": %llu,\n"
+                              " \"shed\": {",
+                              (unsigned long long)s.bytesSent,
+                              (unsigned long long)s.active,
+                              (unsigned long long)s.accepted,
+                              (unsigned long long)s.logDropped,
+                              (unsigned long long)s.queuedBytes));
+    for (int i = 0; i < ShedCount; i++) {
+        out->append(buf, snprintf(buf, sizeof buf, "\"%s\": %llu%s",
+                                  ShedNames[i], (unsigned long long)s.shed[i],
+                                  i + 1 < ShedCount ? ", " : "},\n"));
+    }
+    out->append(" \"caches\": {\n");
+    for (int i = 0; i < CacheCount; i++) {
+        uint64_t total = s.cacheHits[i] + s.cacheMisses[i];
+        out->append(buf, snprintf(buf, sizeof buf,
+                                  "  \"%s\": {\"hits\": %llu, \"misses\": "
+                                  "%llu, \"hit_rate\": %.4f}%s\n",
+                                  CacheNames[i],
+                                  (unsigned long long)s.cacheHits[i],
+                                  (unsigned long long)s.cacheMisses[i],
+                                  total ? (double)s.cacheHits[i] / total : 0.0,
+                                  i + 1 < CacheCount ? "," : ""));
+    }
+    out->append(" },\n \"cgi_spawn_us\": ");
+    appendJsonQuantiles(out, s.cgiSpawn);
+    out->append(",\n \"phases_ns\": {\n");
+    for (int i = 0; i < PhaseCount; i++) {
+        out->append("  \"").append(PhaseNames[i]).append("\": ");
+        appendJsonQuantiles(out, s.phases[i]);
+        out->append(i + 1 < PhaseCount ? ",\n" : "\n");
+    }
+    out->append(" }\n}\n");
+}
@@ -0,0 +1,107 @@
+#include <gtest/gtest.h>
+#include <string>
+
+#include "metrics.cc"
+
+TEST(MetricsTest, HistogramBuckets) {
+    EXPECT_EQ(histBucket(0), 0);
+    EXPECT_EQ(histBucket(3), 3);
+    EXPECT_EQ(histBucket(4), 4);
+    EXPECT_EQ(histBucket(7), 7);
+    EXPECT_EQ(histBucket(8), 8);
+    EXPECT_EQ(histBucket(~0ull), HistBuckets - 1);
+    // every value lies before the end of its bucket and not before the end
+    // of the previous one, and buckets are at most 25% wide
+    for (uint64_t v = 1; v < (1ull << 40); v += v / 7 + 1) {
+        int b = histBucket(v);
+        EXPECT_LT(v, histBucketEnd(b));
+        EXPECT_GE(v, histBucketEnd(b - 1));
+        EXPECT_LE(histBucketEnd(b) - histBucketEnd(b - 1),
+                  histBucketEnd(b - 1) / 4 + 1);
+    }
+}
+
+TEST(MetricsTest, InitResetsEveryCounter) {
+    static Metrics m;
+    metricsInit(&m, 0);
+    metricsRequest(&m, HandlerCgi, 100, 1500);
+    metricsPhase(&m, PhaseClose, 10);
+    metricAdd(&m.cgiSpawn.sum, 1);
+    metricAdd(&m.accepted, 1);
+    metricAdd(&m.queuedBytes, 1);
+    metricsPublishCache(&m, CacheDir, 1, 1);
+    metricsInit(&m, 0);
+    MetricsSnapshot s;
+    metricsSnapshotInit(&s);
+    metricsCollect(&s, &m, 2000);
+    EXPECT_EQ(s.requests[HandlerCgi], 0u);
+    EXPECT_EQ(s.latency[HandlerCgi].count, 0u);
+    EXPECT_EQ(s.phases[PhaseClose].count, 0u);
+    EXPECT_EQ(s.cacheMisses[CacheDir], 0u);
+    EXPECT_DOUBLE_EQ(s.rate[HandlerCgi], 0);
+    EXPECT_EQ(m.cgiSpawn.sum.load(), 0u);
+    EXPECT_EQ(m.accepted.load(), 0u);
+    EXPECT_EQ(m.queuedBytes.load(), 0u);
+}
+
+TEST(MetricsTest, QuantilesAndCollect) {
+    static Metrics a, b;
+    metricsInit(&a, 1000);
+    metricsInit(&b, 2000);
+    for (int i = 1; i <= 1000; i++) {
+        metricsRequest(i % 2 ? &a : &b, HandlerStatic, i, 4999);
+    }
+    metricsRequest(&a, HandlerCgi, 100000, 14500);
+    metricAdd(&a.bytesSent, 10);
+    metricAdd(&b.bytesSent, 5);
+    metricAdd(&a.accepted, 3);
+    metricAdd(&a.closed, 1);
+    metricAdd(&a.shed[ShedConns], 4);
+    metricAdd(&b.shed[ShedConns], 1);
+    metricsPublishCache(&b, CacheFile, 3, 1);
+    metricsPhase(&a, PhaseStat, 1000);
+    metricsPhase(&b, PhaseStat, 3000);
+    MetricsSnapshot s;
+    metricsSnapshotInit(&s);
+    metricsCollect(&s, &a, 15000);
+    metricsCollect(&s, &b, 15000);
+    EXPECT_EQ(s.workers, 2);
+    EXPECT_DOUBLE_EQ(s.uptime, 14);
+    EXPECT_EQ(s.requests[HandlerStatic], 1000u);
+    EXPECT_EQ(s.latency[HandlerStatic].count, 1000u);
+    EXPECT_EQ(s.latency[HandlerStatic].sum, 500500u);
+    uint64_t p50 = histQuantile(s.latency[HandlerStatic], 0.5);
+    uint64_t p99 = histQuantile(s.latency[HandlerStatic], 0.99);
+    EXPECT_GT(p50, 500u);
+    EXPECT_LE(p50, 500u * 5 / 4 + 1);
+    EXPECT_GT(p99, 990u);
+    EXPECT_LE(p99, 990u * 5 / 4 + 1);
+    // second 4 is outside the 10 s window before second 15, second 14 in it
+    EXPECT_DOUBLE_EQ(s.rate[HandlerStatic], 0);
+    EXPECT_DOUBLE_EQ(s.rate[HandlerCgi], 0.1);
+    EXPECT_EQ(s.bytesSent, 15u);
+    EXPECT_EQ(s.active, 2u);
+    EXPECT_EQ(s.cacheHits[CacheFile], 3u);
+    EXPECT_EQ(s.phases[PhaseStat].count, 2u);
+    EXPECT_EQ(s.phases[PhaseStat].sum, 4000u);
+    EXPECT_EQ(s.phases[PhaseAccept].count, 0u);
+
+    std::string prom, json;
+    renderPrometheus(&prom, s);
+    EXPECT_NE(prom.find("webserver_requests_total{handler=\"static\"} 1000\n"),
+              std::string::npos);
+    EXPECT_NE(prom.find("webserver_request_duration_seconds_count{handler="
+                        "\"cgi\"} 1\n"),
+              std::string::npos);
+    EXPECT_NE(prom.find("webserver_shed_total{limit=\"conns\"} 5\n"),
+              std::string::npos);
+    EXPECT_NE(prom.find("webserver_phase_seconds_sum{phase=\"stat\"} 4e-06\n"),
+              std::string::npos);
+    renderJson(&json, s);
+    EXPECT_NE(json.find("\"bytes_sent\": 15"), std::string::npos);
+    EXPECT_NE(json.find("\"hit_rate\": 0.7500"), std::string::npos);
+    EXPECT_NE(json.find("\"shed\": {\"conns\": 5, \"cgi\": 0, \"bytes\": 0}"),
+              std::string::npos);
+    EXPECT_NE(json.find("\"stat\": {\"count\": 2, \"mean\": 2000.0"),
+              std::string::npos);
+}
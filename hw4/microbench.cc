@@ -0,0 +1,202 @@
+#include <benchmark/benchmark.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdlib.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "gzip.cc"
+#include "mime.cc"
+#include "parser.cc"
+#include "urlpath.cc"
+
+static const std::string typicalRequest =
+    "GET /assets/app.js?v=3 HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:68.0) Gecko/20100101\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://example.com/index.html\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static void BM_HttpParse(benchmark::State &state) {
+    HttpRequest r;
+    for (auto _ : state) {
+        httpRequestInit(&r);
+        int status = httpParse(&r, typicalRequest.data(),
+                               typicalRequest.size(), 8192);
+        benchmark::DoNotOptimize(status);
+        benchmark::DoNotOptimize(httpHeader(&r, "Content-Length"));
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * typicalRequest.size());
+}
+BENCHMARK(BM_HttpParse);
+
+// The same request arriving in 16-byte reads.
+static void BM_HttpParseFragmented(benchmark::State &state) {
+    HttpRequest r;
+    for (auto _ : state) {
+        httpRequestInit(&r);
+        int status = ParseIncomplete;
+        for (size_t n = 16; status == ParseIncomplete; n += 16) {
+            if (n > typicalRequest.size()) {
+                n = typicalRequest.size();
+            }
+            status = httpParse(&r, typicalRequest.data(), n, 8192);
+        }
+        benchmark::DoNotOptimize(status);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_HttpParseFragmented);
+
+// The compressible files of $BENCH_DOCROOT (default: the current
+// directory), concatenated.
+static const std::string &benchCorpus() {
+    static std::string corpus;
+    if (!corpus.empty()) {
+        return corpus;
+    }
+    const char *dir = getenv("BENCH_DOCROOT");
+    if (dir == NULL) {
+        dir = ".";
+    }
+    DIR *d = opendir(dir);
+    while (struct dirent *e = d ? readdir(d) : NULL) {
+        std::string path = std::string(dir) + "/" + e->d_name;
+        if (!isCompressible(path.c_str())) {
+            continue;
+        }
+        FILE *f = fopen(path.c_str(), "r");
+        char buf[4096];
+        size_t n;
+        while (f and (n = fread(buf, 1, sizeof buf, f)) > 0) {
+            corpus.append(buf, n);
+        }
+        if (f) {
+            fclose(f);
+        }
+    }
+    if (d) {
+        closedir(d);
+    }
+    return corpus;
+}
+
+// Bytes on the wire for the corpus at a zlib level, and the time it takes.
+static void BM_Gzip(benchmark::State &state) {
+    const std::string &corpus = benchCorpus();
+    std::string out;
+    for (auto _ : state) {
+        gzipCompress(corpus.data(), corpus.size(), &out, state.range(0));
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations() * corpus.size());
+    state.counters["in"] = corpus.size();
+    state.counters["out"] = out.size();
+    state.counters["ratio"] = corpus.empty() ? 0 : (double)out.size() /
+                                                       corpus.size();
+}
+BENCHMARK(BM_Gzip)->Arg(1)->Arg(6)->Arg(9);
+
+// Request targets as a static site and an API see them: mostly plain, and
+// a set with escapes, dot segments and double slashes that takes the slow
+// path.
+static const std::vector<std::string> plainTargets = {
+    "/",
+    "/index.html",
+    "/favicon.ico",
+    "/assets/css/site.3e8f1c.min.css",
+    "/assets/js/vendor/jquery-3.4.1.min.js?v=20191016",
+    "/images/2019/10/photo-of-the-day-large.jpg",
+    "/api/v1/users/1234567/repositories?page=2&per_page=100",
+    "/blog/2020/05/how-we-scaled-our-web-server-to-a-million-requests/",
+    "/docs/reference/configuration/server-options.html#timeouts",
+    "/downloads/releases/webserver-1.4.2-x86_64-linux.tar.gz",
+};
+static const std::vector<std::string> specialTargets = {
+    "/docs/Getting%20Started%20with%20the%20Server.html",
+    "/search/caf%C3%A9%20cr%C3%A8me?q=%E2%9C%93",
+    "//assets//js/app.js",
+    "/static/../static/css/site.css",
+    "/./images/./2019/../2019/logo.png",
+    "/.well-known/acme-challenge/Zx9Yh3kKdP2",
+    "/a/b/c/d/e/f/g/h/../../../../x/y/z",
+    "/%2e%2e/%2e%2e/etc/passwd",
+};
+
+static void BM_CleanupPath(benchmark::State &state) {
+    const std::vector<std::string> &targets =
+        state.range(0) ? specialTargets : plainTargets;
+    size_t bytes = 0;
+    for (const std::string &t : targets) {
+        bytes += t.size();
+    }
+    char buf[256];
+    for (auto _ : state) {
+        for (const std::string &t : targets) {
+            memcpy(buf, t.data(), t.size() + 1);
+            benchmark::DoNotOptimize(cleanupPath(buf, t.size()));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * targets.size());
+    state.SetBytesProcessed(state.iterations() * bytes);
+}
+BENCHMARK(BM_CleanupPath)->Arg(0)->Arg(1);
+
+// File names with common, upper-case, unknown and missing extensions.
+static const std::vector<std::string> mimePaths = {
+    "index.html",
+    "assets/css/site.3e8f1c.min.css",
+    "app.js",
+    "images/photo-of-the-day-large.jpg",
+    "favicon.ico",
+    "fonts/inter-var.woff2",
+    "README.MD",
+    "downloads/webserver-1.4.2.tar.gz",
+    "data/report.xlsx",
+    "bin/configure",
+    "a.b/Makefile",
+    "video/intro.webm",
+};
+
+// The perfect hash of mime.cc, or with range(0) a std::unordered_map of
+// the same table, keyed by lower-cased extension as such maps usually are.
+static void BM_MimeLookup(benchmark::State &state) {
+    std::unordered_map<std::string, const MimeType *> map;
+    for (const MimeType &m : MimeTypes) {
+        map[m.ext] = &m;
+    }
+    size_t found = 0;
+    for (auto _ : state) {
+        for (const std::string &path : mimePaths) {
+            const MimeType *m;
+            if (state.range(0) == 0) {
+                m = mimeLookup(path);
+            } else {
+                size_t dot = path.rfind('.');
+                m = NULL;
+                if (dot != std::string::npos and
+                    path.find('/', dot) == std::string::npos) {
+                    std::string ext = path.substr(dot + 1);
+                    for (char &ch : ext) {
+                        ch = tolower((unsigned char)ch);
+                    }
+                    auto it = map.find(ext);
+                    m = it == map.end() ? NULL : it->second;
+                }
+            }
+            found += m != NULL;
+            benchmark::DoNotOptimize(m);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * mimePaths.size());
+    benchmark::DoNotOptimize(found);
+}
+BENCHMARK(BM_MimeLookup)->Arg(0)->Arg(1);
@@ -0,0 +1,153 @@
+// Content types of static files, by extension.
+//
+// The extensions come from MIME_TYPES, mimetypes.def unless the build names
+// another list, and are found through a perfect hash: the compiler searches
+// for a seed under which every extension hashes to a slot of its own. A
+// lookup lower-cases the extension, hashes it and compares it with the one
+// entry in its slot; nothing is probed, allocated or built at startup.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string_view>
+
+#ifndef MIME_TYPES
+#define MIME_TYPES "mimetypes.def"
+#endif
+
+struct MimeType {
+    const char *ext;
+    const char *header; // "Content-Type: ...\r\n"
+    bool compressible;
+};
+
+static constexpr MimeType MimeTypes[] = {
+#define MIME_TYPE(ext, type, compressible)                                     \
+    {ext, "Content-Type: " type "\r\n", compressible},
+#include MIME_TYPES
+#undef MIME_TYPE
+};
+static constexpr size_t MimeTypeCount = sizeof MimeTypes / sizeof *MimeTypes;
+
+// Sent for files of other extensions.
+static const char DefaultContentType[] =
+    "Content-Type: application/octet-stream\r\n";
+
+// Longer extensions are not looked up.
+static const size_t MimeMaxExt = 15;
+
+constexpr uint32_t mimeHash(const char *s, size_t n, uint32_t seed) {
+    uint32_t h = seed;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h ^ h >> 15;
+}
+
+constexpr size_t constLength(const char *s) {
+    size_t n = 0;
+    while (s[n]) {
+        n++;
+    }
+    return n;
+}
+
+// Eight slots per extension makes a perfect seed quick to find.
+constexpr uint32_t mimeSlotCount() {
+    uint32_t n = 1;
+    while (n < 8 * MimeTypeCount) {
+        n *= 2;
+    }
+    return n;
+}
+static constexpr uint32_t MimeSlotCount = mimeSlotCount();
+
+struct MimeIndex {
+    uint32_t seed;
+    uint8_t slots[MimeSlotCount]; // index into MimeTypes + 1, or 0
+};
+
+constexpr bool mimeTypesValid() {
+    for (size_t i = 0; i < MimeTypeCount; i++) {
+        const char *ext = MimeTypes[i].ext;
+        size_t n = constLength(ext);
+        if (n == 0 or n > MimeMaxExt) {
+            return false;
+        }
+        for (size_t k = 0; k < n; k++) {
+            if (ext[k] >= 'A' and ext[k] <= 'Z') {
+                return false;
+            }
+        }
+        for (size_t j = 0; j < i; j++) {
+            std::string_view other = MimeTypes[j].ext;
+            if (other == ext) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+static_assert(MimeTypeCount < 255 and mimeTypesValid(),
+              "MIME_TYPES needs distinct, lower-case extensions of 1 to "
+              "MimeMaxExt characters");
+
+constexpr MimeIndex mimeIndex() {
+    for (uint32_t seed = 2166136261u;; seed++) {
+        MimeIndex index = {seed, {}};
+        bool perfect = true;
+        for (size_t i = 0; i < MimeTypeCount and perfect; i++) {
+            const char *ext = MimeTypes[i].ext;
+            uint32_t slot = mimeHash(ext, constLength(ext), seed) &
+                            (MimeSlotCount - 1);
+            perfect = index.slots[slot] == 0;
+            index.slots[slot] = i + 1;
+        }
+        if (perfect) {
+            return index;
+        }
+    }
+}
+static constexpr MimeIndex MimeIndexTable = mimeIndex();
+
+// Returns the entry for the extension of the last segment of path, or NULL
+// if it has none or an unknown one. Case does not matter.
+const MimeType *mimeLookup(std::string_view path) {
+    size_t dot = path.rfind('.');
+    if (dot == std::string_view::npos or
+        path.find('/', dot) != std::string_view::npos) {
+        return NULL;
+    }
+    size_t n = path.size() - dot - 1;
+    if (n == 0 or n > MimeMaxExt) {
+        return NULL;
+    }
+    char ext[MimeMaxExt];
+    for (size_t i = 0; i < n; i++) {
+        char ch = path[dot + 1 + i];
+        ext[i] = ch >= 'A' and ch <= 'Z' ? ch | 0x20 : ch;
+    }
+    uint32_t hash = mimeHash(ext, n, MimeIndexTable.seed);
+    uint8_t slot = MimeIndexTable.slots[hash & (MimeSlotCount - 1)];
+    if (slot == 0) {
+        return NULL;
+    }
+    const MimeType *m = &MimeTypes[slot - 1];
+    if (0 != strncmp(m->ext, ext, n) or m->ext[n] != 0) {
+        return NULL;
+    }
+    return m;
+}
+
+// Returns the Content-Type header line for the file path.
+const char *contentTypeHeader(std::string_view path) {
+    const MimeType *m = mimeLookup(path);
+    return m ? m->header : DefaultContentType;
+}
+
+// Reports whether a file is worth compressing, judging by its extension.
+bool isCompressible(std::string_view path) {
+    const MimeType *m = mimeLookup(path);
+    return m and m->compressible;
+}
@@ -0,0 +1,23 @@
+#include <gtest/gtest.h>
+#include <string>
+
+#include "mime.cc"
+
+TEST(MimeTest, Lookup) {
+    EXPECT_STREQ(contentTypeHeader("index.html"),
+                 "Content-Type: text/html; charset=utf-8\r\n");
+    EXPECT_STREQ(contentTypeHeader("img/A.PNG"), "Content-Type: image/png\r\n");
+    EXPECT_STREQ(contentTypeHeader("x.tar.gz"),
+                 "Content-Type: application/gzip\r\n");
+    for (const char *path : {"Makefile", "a.b/c", "dir.", ".x", "a.htmlx",
+                             "a.htm_", "a.verylongextension"}) {
+        EXPECT_EQ(mimeLookup(path), nullptr) << path;
+        EXPECT_STREQ(contentTypeHeader(path), DefaultContentType);
+    }
+    for (const MimeType &m : MimeTypes) {
+        EXPECT_EQ(mimeLookup(std::string("f.") + m.ext), &m) << m.ext;
+    }
+    EXPECT_TRUE(isCompressible("app.JS"));
+    EXPECT_FALSE(isCompressible("photo.jpg"));
+    EXPECT_FALSE(isCompressible("notes"));
+}
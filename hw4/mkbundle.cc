@@ -0,0 +1,16 @@
+// Packs a document root into a bundle the webserver can serve as DOCROOT;
+// see bundle.cc.
+
+#include "webserver.cc"
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: ./mkbundle DIR BUNDLE\n");
+        return 1;
+    }
+    if (-1 == bundleWrite(argv[1], argv[2])) {
+        perror("cannot write the bundle");
+        return 2;
+    }
+    return 0;
+}
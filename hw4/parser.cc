@@ -0,0 +1,395 @@
+// Incremental HTTP/1 request head parser.
+//
+// The parser works over the connection's input buffer and hands out
+// string_views into it; nothing is copied. Feed it the whole buffer again
+// after every read: scanning resumes where the previous call stopped. The
+// buffer must not move while a request is being parsed.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <string_view>
+
+static const int HttpMaxHeaders = 64;
+
+enum {
+    ParseTooLarge = -2, // the head exceeds maxBytes or HttpMaxHeaders
+    ParseBad = -1,
+    ParseIncomplete = 0,
+    ParseDone = 1,
+};
+
+struct HttpRequest {
+    std::string_view method;
+    std::string_view target;
+    std::string_view version;
+    std::string_view headerNames[HttpMaxHeaders];
+    std::string_view headerValues[HttpMaxHeaders];
+    int nheaders;
+    size_t length; // bytes of the head, including the empty line
+    // parser state
+    size_t scanned; // start of the first line not parsed yet
+    bool sawRequestLine;
+};
+
+void httpRequestInit(HttpRequest *r) {
+    r->nheaders = 0;
+    r->length = 0;
+    r->scanned = 0;
+    r->sawRequestLine = false;
+}
+
+static std::string_view trimLine(const char *p, const char *end) {
+    if (end > p and end[-1] == '\r') {
+        end--;
+    }
+    return std::string_view(p, end - p);
+}
+
+static int parseRequestLine(HttpRequest *r, std::string_view line) {
+    size_t sp1 = line.find(' ');
+    if (sp1 == 0 or sp1 == std::string_view::npos) {
+        return ParseBad;
+    }
+    size_t sp2 = line.find(' ', sp1 + 1);
+    if (sp2 == sp1 + 1 or sp2 == std::string_view::npos) {
+        return ParseBad;
+    }
+    r->method = line.substr(0, sp1);
+    r->target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    r->version = line.substr(sp2 + 1);
+    if (r->version.size() != 8 or r->version.compare(0, 5, "HTTP/") != 0) {
+        return ParseBad;
+    }
+    return ParseDone;
+}
+
+static int parseHeaderLine(HttpRequest *r, std::string_view line) {
+    size_t colon = line.find(':');
+    if (colon == 0 or colon == std::string_view::npos) {
+        return ParseBad;
+    }
+    if (r->nheaders == HttpMaxHeaders) {
+        return ParseTooLarge;
+    }
+    std::string_view name = line.substr(0, colon);
+    if (name.back() == ' ' or name.back() == '\t') {
+        return ParseBad; // no whitespace allowed before the colon
+    }
+    size_t b = colon + 1;
+    size_t e = line.size();
+    while (b < e and (line[b] == ' ' or line[b] == '\t')) {
+        b++;
+    }
+    while (e > b and (line[e - 1] == ' ' or line[e - 1] == '\t')) {
+        e--;
+    }
+    r->headerNames[r->nheaders] = name;
+    r->headerValues[r->nheaders] = line.substr(b, e - b);
+    r->nheaders++;
+    return ParseDone;
+}
+
+static int parseLines(HttpRequest *r, const char *buf, size_t len,
+                      size_t maxBytes, bool requestLineOnly) {
+    while (true) {
+        const char *p = buf + r->scanned;
+        size_t avail = len - r->scanned;
+        if (r->scanned + avail > maxBytes) {
+            avail = maxBytes > r->scanned ? maxBytes - r->scanned : 0;
+        }
+        const char *nl = (const char *)memchr(p, '\n', avail);
+        if (nl == NULL) {
+            return len >= maxBytes ? ParseTooLarge : ParseIncomplete;
+        }
+        std::string_view line = trimLine(p, nl);
+        r->scanned = nl + 1 - buf;
+        int status;
+        if (!r->sawRequestLine) {
+            if (line.empty()) {
+                continue; // tolerate stray CRLFs between requests
+            }
+            status = parseRequestLine(r, line);
+            r->sawRequestLine = true;
+            if (requestLineOnly and status == ParseDone) {
+                return ParseDone;
+            }
+        } else if (line.empty()) {
+            r->length = r->scanned;
+            return ParseDone;
+        } else {
+            status = parseHeaderLine(r, line);
+        }
+        if (status != ParseDone) {
+            return status;
+        }
+    }
+}
+
+// Parses the request head at the start of buf[0:len].
+// Returns ParseDone once the empty line ending the headers was seen, with
+// r->length set to the head's size; ParseIncomplete when more input is
+// needed; ParseBad or ParseTooLarge on errors.
+int httpParse(HttpRequest *r, const char *buf, size_t len, size_t maxBytes) {
+    return parseLines(r, buf, len, maxBytes, false);
+}
+
+// Like httpParse(), but returns ParseDone as soon as the request line is
+// parsed, so that the headers can be parsed by a separate httpParse().
+int httpParseRequestLine(HttpRequest *r, const char *buf, size_t len,
+                         size_t maxBytes) {
+    return parseLines(r, buf, len, maxBytes, true);
+}
+
+bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+    return a.size() == b.size() and
+           0 == strncasecmp(a.data(), b.data(), a.size());
+}
+
+// Returns the value of the first header called name (case-insensitively),
+// or an empty view with a NULL data() if there is none.
+std::string_view httpHeader(const HttpRequest *r, std::string_view name) {
+    for (int i = 0; i < r->nheaders; i++) {
+        if (equalsIgnoreCase(r->headerNames[i], name)) {
+            return r->headerValues[i];
+        }
+    }
+    return std::string_view();
+}
+
+// Parses a Content-Length value. Returns -1 if it is not a plain decimal
+// number or does not fit.
+ssize_t parseContentLength(std::string_view v) {
+    if (v.empty() or v.size() > 18) {
+        return -1;
+    }
+    ssize_t n = 0;
+    for (char ch : v) {
+        if (ch < '0' or ch > '9') {
+            return -1;
+        }
+        n = n * 10 + (ch - '0');
+    }
+    return n;
+}
+
+// What httpBodyLength() returns for requests whose body is not delimited
+// by a Content-Length.
+enum {
+    BodyEncoded = -3, // a Transfer-Encoding, which the server does not decode
+    BodyInvalid = -2, // invalid or conflicting framing headers
+    BodyNone = -1,
+};
+
+// Returns the length of the request's body, or BodyNone if it has none.
+// Bodies sent with a Transfer-Encoding are not supported: with keep-alive,
+// a server that ignored the header would take the body for the next
+// request. For the same reason a request whose Content-Length headers
+// disagree, or that has both headers, is invalid: a proxy in front of the
+// server may have settled on another length.
+ssize_t httpBodyLength(const HttpRequest *r) {
+    bool encoded = false;
+    ssize_t n = BodyNone;
+    for (int i = 0; i < r->nheaders; i++) {
+        if (equalsIgnoreCase(r->headerNames[i], "Transfer-Encoding")) {
+            encoded = true;
+        } else if (equalsIgnoreCase(r->headerNames[i], "Content-Length")) {
+            ssize_t v = parseContentLength(r->headerValues[i]);
+            if (v < 0 or (n != BodyNone and v != n)) {
+                return BodyInvalid;
+            }
+            n = v;
+        }
+    }
+    if (encoded) {
+        return n == BodyNone ? BodyEncoded : BodyInvalid;
+    }
+    return n;
+}
+
+// Formats the strong validator of a file from its inode, size and mtime.
+// suffix, at most 8 bytes, tells encodings of the same file apart. buf must
+// hold at least 64 bytes. Returns the length.
+int formatETag(char *buf, const struct stat &st, const char *suffix = "") {
+    return sprintf(buf, "\"%lx-%llx-%llx%s\"", (unsigned long)st.st_ino,
+                   (unsigned long long)st.st_size,
+                   (unsigned long long)st.st_mtim.tv_sec * 1000000000ull +
+                       st.st_mtim.tv_nsec,
+                   suffix);
+}
+
+// Formats t as an IMF-fixdate. buf must hold at least 32 bytes.
+int formatHttpDate(char *buf, time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return strftime(buf, 32, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// Parses an IMF-fixdate. Returns -1 if v is not one.
+time_t parseHttpDate(std::string_view v) {
+    char buf[32];
+    if (v.size() != 29) {
+        return -1;
+    }
+    memcpy(buf, v.data(), v.size());
+    buf[v.size()] = 0;
+    struct tm tm;
+    memset(&tm, 0, sizeof tm);
+    const char *end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL or *end != 0) {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+// Reports whether an If-None-Match value lists etag, using the weak
+// comparison RFC 7232 prescribes for it.
+bool etagMatches(std::string_view list, std::string_view etag) {
+    size_t i = 0;
+    while (i < list.size()) {
+        while (i < list.size() and (list[i] == ' ' or list[i] == ',')) {
+            i++;
+        }
+        if (i == list.size()) {
+            break;
+        }
+        if (list[i] == '*') {
+            return true;
+        }
+        if (list.compare(i, 2, "W/") == 0) {
+            i += 2;
+        }
+        if (i >= list.size() or list[i] != '"') {
+            return false;
+        }
+        size_t close = list.find('"', i + 1);
+        if (close == std::string_view::npos) {
+            return false;
+        }
+        if (list.substr(i, close + 1 - i) == etag) {
+            return true;
+        }
+        i = close + 1;
+    }
+    return false;
+}
+
+struct ByteRange {
+    off_t first;
+    off_t last; // inclusive
+};
+
+static const int MaxRanges = 16;
+
+static std::string_view trimSpace(std::string_view v) {
+    while (!v.empty() and (v.front() == ' ' or v.front() == '\t')) {
+        v.remove_prefix(1);
+    }
+    while (!v.empty() and (v.back() == ' ' or v.back() == '\t')) {
+        v.remove_suffix(1);
+    }
+    return v;
+}
+
+static bool parseOffset(std::string_view v, off_t *out) {
+    ssize_t n = parseContentLength(v);
+    *out = n;
+    return n >= 0;
+}
+
+// Parses a "Range: bytes=..." value against a representation of size
+// bytes into at most max ranges, clamped to the file. Returns the number of
+// ranges, 0 if none of them is satisfiable, or -1 if the header is invalid
+// or has more than max ranges, in which case it is to be ignored.
+int parseRange(std::string_view v, off_t size, ByteRange *out, int max) {
+    if (v.size() < 6 or !equalsIgnoreCase(v.substr(0, 6), "bytes=")) {
+        return -1;
+    }
+    v.remove_prefix(6);
+    int n = 0;
+    bool any = false;
+    while (true) {
+        size_t comma = v.find(',');
+        std::string_view spec = v.substr(0, comma);
+        spec = trimSpace(spec);
+        size_t dash = spec.find('-');
+        if (dash == std::string_view::npos) {
+            return -1;
+        }
+        any = true;
+        ByteRange r;
+        if (dash == 0) {
+            off_t suffix;
+            if (!parseOffset(spec.substr(1), &suffix)) {
+                return -1;
+            }
+            r.first = suffix < size ? size - suffix : 0;
+            r.last = size - 1;
+            if (suffix == 0) {
+                r.first = size; // unsatisfiable
+            }
+        } else {
+            if (!parseOffset(spec.substr(0, dash), &r.first)) {
+                return -1;
+            }
+            r.last = size - 1;
+            if (dash + 1 < spec.size()) {
+                off_t last;
+                if (!parseOffset(spec.substr(dash + 1), &last) or
+                    last < r.first) {
+                    return -1;
+                }
+                if (last < r.last) {
+                    r.last = last;
+                }
+            }
+        }
+        if (r.first < size) {
+            if (n == max) {
+                return -1;
+            }
+            out[n++] = r;
+        }
+        if (comma == std::string_view::npos) {
+            break;
+        }
+        v.remove_prefix(comma + 1);
+    }
+    return any ? n : -1;
+}
+
+// Reports whether an Accept-Encoding value allows gzip: listed, or covered
+// by *, with a non-zero quality.
+bool acceptsGzip(std::string_view v) {
+    int gzip = -1, any = -1; // -1: not listed, 0: refused, 1: accepted
+    while (!v.empty()) {
+        size_t comma = v.find(',');
+        std::string_view item = v.substr(0, comma);
+        v = comma == std::string_view::npos ? std::string_view()
+                                            : v.substr(comma + 1);
+        size_t semi = item.find(';');
+        std::string_view coding = trimSpace(item.substr(0, semi));
+        int ok = 1;
+        if (semi != std::string_view::npos) {
+            std::string_view q = trimSpace(item.substr(semi + 1));
+            if (q.size() >= 2 and (q[0] == 'q' or q[0] == 'Q') and
+                q[1] == '=') {
+                q.remove_prefix(2);
+                // q=0, q=0.0, q=0.000 refuse; anything else accepts
+                ok = q.find_first_not_of("0.") != std::string_view::npos;
+            }
+        }
+        if (equalsIgnoreCase(coding, "gzip") or
+            equalsIgnoreCase(coding, "x-gzip")) {
+            gzip = ok;
+        } else if (coding == "*") {
+            any = ok;
+        }
+    }
+    return gzip == -1 ? any == 1 : gzip == 1;
+}
@@ -1,6 +1,9 @@
 #include <gtest/gtest.h>
 #include <stdio.h>
 
+#include <string>
+#include <vector>
+
 #include "webserver.cc"
 
 #define EXPECT_PATH(before, expPath, expQuery)                                 \
@@ -42,3 +45,134 @@ TEST(CleanupPathTest, WithQuery) {
     EXPECT_PATH("/..?q=w", "", "q=w");
     EXPECT_PATH("..?q=w", "", "q=w");
 }
+
+TEST(CleanupPathTest, Decoding) {
+    EXPECT_PATH("/a%20b.txt", "a b.txt", "");
+    EXPECT_PATH("/%61/%62%2Fc", "a/b/c", "");
+    EXPECT_PATH("/a/%2e%2e/%2E%2e/etc/passwd", "etc/passwd", "");
+    EXPECT_PATH("/a/%2e/b/.%2e", "a", "");
+    EXPECT_PATH("/a%3Fb?c%3Fd", "a?b", "c%3Fd");
+    EXPECT_PATH("/a%2", "a%2", "");
+    EXPECT_PATH("/a%zz%", "a%zz%", "");
+    EXPECT_PATH("/100%25", "100%", "");
+    char crlf[] = "/a%0d%0aSet-Cookie:x";
+    EXPECT_EQ(cleanupPath(crlf, strlen(crlf)), nullptr);
+    char nul[] = "/a.cgi%00.txt";
+    EXPECT_EQ(cleanupPath(nul, strlen(nul)), nullptr);
+}
+
+TEST(CleanupPathTest, DotSegments) {
+    EXPECT_PATH("/a/./b", "a/b", "");
+    EXPECT_PATH("/a/.", "a", "");
+    EXPECT_PATH("/./", "", "");
+    EXPECT_PATH("/../a", "a", "");
+    EXPECT_PATH("/../../a/", "a/", "");
+    EXPECT_PATH("/.well-known/x", ".well-known/x", "");
+    EXPECT_PATH("/a/...", "a/...", "");
+    EXPECT_PATH("/a/..b/c.", "a/..b/c.", "");
+}
+
+TEST(CleanupPathTest, LongPaths) {
+    // special bytes on both sides of the 16-byte blocks
+    EXPECT_PATH("/assets/javascript/app.min.js", "assets/javascript/app.min.js",
+                "");
+    EXPECT_PATH("/0123456789abcde/?x=1", "0123456789abcde/", "x=1");
+    EXPECT_PATH("/0123456789abcdef/0123456789abcde?x", "0123456789abcdef/"
+                "0123456789abcde", "x");
+    EXPECT_PATH("/0123456789abcde//f", "0123456789abcde/f", "");
+    EXPECT_PATH("/0123456789abcdef/../x", "x", "");
+    EXPECT_PATH("/0123456789abcdefghijklmnopqrs%41", "0123456789abcdef"
+                "ghijklmnopqrsA", "");
+    EXPECT_PATH("/0123456789abcdefghijklmnopqrs?%41", "0123456789abcdef"
+                "ghijklmnopqrs", "%41");
+}
+
+// What cleanupPath() does, written plainly: returns false if the target is
+// rejected.
+static bool referenceCleanup(std::string target, std::string *path,
+                             std::string *query) {
+    size_t q = target.find('?');
+    *query = q == std::string::npos ? "" : target.substr(q + 1);
+    target = target.substr(0, q);
+    std::string decoded;
+    for (size_t i = 0; i < target.size(); i++) {
+        if (target[i] == '%' and i + 2 < target.size() and
+            isxdigit(target[i + 1]) and isxdigit(target[i + 2])) {
+            int ch = std::stoi(target.substr(i + 1, 2), 0, 16);
+            if (ch < 0x20 or ch == 0x7f) {
+                return false;
+            }
+            decoded += (char)ch;
+            i += 2;
+        } else {
+            decoded += target[i];
+        }
+    }
+    std::vector<std::string> segments;
+    bool slash = false; // the result ends with one
+    for (size_t start = 0;;) {
+        size_t end = decoded.find('/', start);
+        bool last = end == std::string::npos;
+        std::string s = decoded.substr(start, last ? end : end - start);
+        if (s == "..") {
+            if (!segments.empty()) {
+                segments.pop_back();
+            }
+        } else if (!s.empty() and s != ".") {
+            segments.push_back(s);
+        }
+        if (last) {
+            slash = slash and s.empty();
+            break;
+        }
+        slash = slash or !s.empty();
+        start = end + 1;
+    }
+    path->clear();
+    for (size_t i = 0; i < segments.size(); i++) {
+        *path += (i ? "/" : "") + segments[i];
+    }
+    if (slash and !segments.empty()) {
+        *path += '/';
+    }
+    return true;
+}
+
+TEST(CleanupPathTest, MatchesReference) {
+    // dense in special bytes, and long plain paths with a few of them
+    static const char *alphabets[] = {"ab/./.?%2eEfF0",
+                                      "abcdefghijklmnopqrstuvwxyz/////-_.?%"};
+    unsigned seed = 1;
+    for (int iter = 0; iter < 200000; iter++) {
+        const char *alphabet = alphabets[iter % 2];
+        std::string target;
+        size_t len = rand_r(&seed) % (iter % 2 ? 96 : 48);
+        for (size_t i = 0; i < len; i++) {
+            size_t k = rand_r(&seed) % strlen(alphabet);
+            if (iter % 2 and k >= 31 and rand_r(&seed) % 8) {
+                k = 0; // keep '.', '?' and '%' rare
+            }
+            target += alphabet[k];
+        }
+        std::string want, wantQuery;
+        bool ok = referenceCleanup(target, &want, &wantQuery);
+        std::vector<char> buf(target.begin(), target.end());
+        buf.push_back(0);
+        char *query = cleanupPath(buf.data(), target.size());
+        ASSERT_EQ(query != NULL, ok) << target;
+        if (!ok) {
+            continue;
+        }
+        ASSERT_EQ(std::string(buf.data()), want) << target;
+        ASSERT_EQ(std::string(query), wantQuery) << target;
+        // normalized paths have no empty or dot segments and stay put
+        std::string again = want;
+        if (again.find_first_of("%?") == std::string::npos) {
+            char *end = &again[0] + want.size();
+            ASSERT_EQ(cleanupPath(&again[0], again.size()), end);
+            ASSERT_EQ(again.c_str(), want) << target;
+        }
+        ASSERT_EQ(want.find("//"), std::string::npos) << target;
+        ASSERT_NE(want.substr(0, 1), "/") << target;
+    }
+}
@@ -0,0 +1,39 @@
+// Example --cgi-pool script: answers every request with its environment and
+// body, like cgi.sh. Run as a plain CGI program, without CGI_POOL set, it
+// serves one request and exits.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+static std::string answer(const std::string &env, const std::string &body) {
+    std::string out = "Content-Type: text/plain\n\n";
+    out += env;
+    out += body;
+    return out;
+}
+
+int main() {
+    if (getenv("CGI_POOL") == NULL) {
+        std::string env = std::string("REQUEST_METHOD=") +
+                          getenv("REQUEST_METHOD") + "\nQUERY_STRING=" +
+                          getenv("QUERY_STRING") + "\n";
+        fputs(answer(env, "").c_str(), stdout);
+        return 0;
+    }
+    size_t envLen, bodyLen;
+    while (2 == scanf("%zu %zu", &envLen, &bodyLen) and getchar() == '\n') {
+        std::string env(envLen, 0), body(bodyLen, 0);
+        if (envLen != fread(&env[0], 1, envLen, stdin) or
+            bodyLen != fread(&body[0], 1, bodyLen, stdin)) {
+            return 1;
+        }
+        std::string out = answer(env, body);
+        printf("%zu\n", out.size());
+        fwrite(out.data(), 1, out.size(), stdout);
+        fflush(stdout);
+    }
+    return 0;
+}
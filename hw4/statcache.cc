@@ -0,0 +1,150 @@
+// Per-worker cache of path lookups.
+//
+// Resolving a request used to walk the same path with stat(), access() and
+// open(), and once more for index.html. A PathInfo records the outcome of
+// one lookup, including an open read-only fd that connections share for
+// sendfile(). Entries expire after a fixed TTL and are dropped, closing
+// their fd, by statCacheExpire(), which the event loop calls when the
+// oldest one is due. As every entry lives for the same TTL, insertion order
+// is expiry order, and a full cache drops its oldest entry.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+struct PathInfo {
+    std::string path; // the lookup's, which keys it in StatCache
+    int err; // errno of the failed lookup, 0 if st is valid
+    struct stat st;
+    bool executable;
+    int fd;      // O_RDONLY fd of a regular file, or -1
+    int openErr; // errno of the failed open() if fd is -1
+    bool noGzip; // --gzip could not compress it, see sendCompressed()
+    long expires;
+
+    PathInfo()
+        : err(0), executable(false), fd(-1), openErr(0), noGzip(false),
+          expires(0) {}
+    ~PathInfo() {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+};
+
+struct StatCache {
+    long ttl; // milliseconds, 0 disables caching
+    size_t maxEntries;
+    std::list<std::shared_ptr<PathInfo>> order; // oldest first
+    // keyed by views of PathInfo::path, so that lookups need no copy
+    std::unordered_map<std::string_view,
+                       std::list<std::shared_ptr<PathInfo>>::iterator>
+        entries;
+    long hits;
+    long misses;
+};
+
+// The most entries a worker keeps, whatever the fd limit.
+static const size_t StatCacheMaxEntries = 4096;
+
+void statCacheInit(StatCache *sc, long ttl, size_t maxEntries) {
+    sc->ttl = maxEntries > 0 ? ttl : 0;
+    sc->maxEntries = maxEntries;
+    sc->hits = sc->misses = 0;
+}
+
+// Returns how many entries each of workers may keep: as every entry may
+// hold an fd, the caches of all workers get half of RLIMIT_NOFILE, and the
+// other half is left to connections, pipes and the rest.
+size_t statCacheCapacity(int workers) {
+    struct rlimit rl;
+    size_t n = StatCacheMaxEntries;
+    if (0 == getrlimit(RLIMIT_NOFILE, &rl) and rl.rlim_cur != RLIM_INFINITY) {
+        n = rl.rlim_cur / 2 / (workers > 0 ? workers : 1);
+    }
+    return n < StatCacheMaxEntries ? n : StatCacheMaxEntries;
+}
+
+static void statCacheErase(StatCache *sc,
+                           std::list<std::shared_ptr<PathInfo>>::iterator it) {
+    sc->entries.erase((*it)->path);
+    sc->order.erase(it); // closes the fd unless a connection still uses it
+}
+
+// Drops the entries that expired by now.
+void statCacheExpire(StatCache *sc, long now) {
+    while (!sc->order.empty() and sc->order.front()->expires <= now) {
+        statCacheErase(sc, sc->order.begin());
+    }
+}
+
+// Returns the time in ms by which statCacheExpire() should be called, or -1
+// if the cache is empty.
+long statCacheNext(const StatCache *sc) {
+    return sc->order.empty() ? -1 : sc->order.front()->expires;
+}
+
+// Reports whether a lookup failed for lack of resources rather than because
+// of the path; such outcomes are not cached.
+static bool isTransient(int err) {
+    return err == EMFILE or err == ENFILE or err == ENOMEM or err == EINTR;
+}
+
+static std::shared_ptr<PathInfo> lookupPath(std::string_view key) {
+    auto pi = std::make_shared<PathInfo>();
+    pi->path = key;
+    const char *path = pi->path.c_str();
+    // O_NONBLOCK keeps open() from hanging on FIFOs
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd == -1) {
+        pi->openErr = errno;
+        if (-1 == stat(path, &pi->st)) {
+            pi->err = errno;
+            return pi;
+        }
+    } else if (-1 == fstat(fd, &pi->st)) {
+        pi->err = errno;
+        close(fd);
+        return pi;
+    }
+    if (S_ISREG(pi->st.st_mode)) {
+        pi->executable = 0 == access(path, X_OK);
+        pi->fd = fd;
+    } else if (fd != -1) {
+        close(fd);
+    }
+    return pi;
+}
+
+// Returns what a lookup of path yields, from the cache if it is fresh.
+std::shared_ptr<PathInfo> statCacheGet(StatCache *sc, std::string_view path,
+                                       long now) {
+    if (sc->ttl > 0) {
+        statCacheExpire(sc, now);
+        auto it = sc->entries.find(path);
+        if (it != sc->entries.end()) {
+            sc->hits++;
+            return *it->second;
+        }
+    }
+    sc->misses++;
+    std::shared_ptr<PathInfo> pi = lookupPath(path);
+    if (sc->ttl <= 0 or isTransient(pi->err) or isTransient(pi->openErr)) {
+        return pi;
+    }
+    if (sc->entries.size() >= sc->maxEntries) {
+        statCacheErase(sc, sc->order.begin());
+    }
+    pi->expires = now + sc->ttl;
+    sc->order.push_back(pi);
+    sc->entries[pi->path] = std::prev(sc->order.end());
+    return pi;
+}
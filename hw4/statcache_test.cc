@@ -0,0 +1,49 @@
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+
+#include "statcache.cc"
+
+TEST(StatCacheTest, ExpiresAndClosesFds) {
+    char dir[] = "/tmp/statcache_test.XXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    std::string root = std::string(dir) + "/";
+    for (const char *name : {"a", "b", "c"}) {
+        close(open((root + name).c_str(), O_CREAT | O_WRONLY, 0644));
+    }
+    StatCache sc;
+    statCacheInit(&sc, 100, 2);
+    std::shared_ptr<PathInfo> a = statCacheGet(&sc, root + "a", 1000);
+    ASSERT_NE(a->fd, -1);
+    EXPECT_EQ(statCacheGet(&sc, root + "x", 1010)->err, ENOENT);
+    EXPECT_EQ(statCacheGet(&sc, root + "a", 1020), a);
+    EXPECT_EQ(statCacheNext(&sc), 1100);
+    // a full cache drops its oldest entry
+    statCacheGet(&sc, root + "b", 1030);
+    EXPECT_EQ(sc.entries.size(), 2u);
+    EXPECT_NE(statCacheGet(&sc, root + "a", 1040), a);
+    a.reset();
+    statCacheExpire(&sc, 1200);
+    EXPECT_EQ(sc.entries.size(), 0u);
+    EXPECT_EQ(statCacheNext(&sc), -1);
+
+    // running out of fds is not remembered
+    int probe = open("/dev/null", O_RDONLY);
+    close(probe);
+    struct rlimit old, low;
+    ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &old), 0);
+    low = old;
+    low.rlim_cur = probe;
+    ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &low), 0);
+    std::shared_ptr<PathInfo> c = statCacheGet(&sc, root + "c", 2000);
+    setrlimit(RLIMIT_NOFILE, &old);
+    EXPECT_EQ(c->openErr, EMFILE);
+    EXPECT_EQ(sc.entries.size(), 0u);
+    EXPECT_NE(statCacheGet(&sc, root + "c", 2001)->fd, -1);
+    EXPECT_EQ(sc.entries.size(), 1u);
+}
@@ -0,0 +1,145 @@
+// Hierarchical timer wheel for connection deadlines.
+//
+// Four levels of 64 slots; a slot of level i covers 64^i ticks of
+// TimerTick ms, so the wheel spans about two days. Timers are intrusive
+// list nodes: scheduling and cancelling are O(1), and an idle connection
+// costs one node and no work until it expires. When the lowest level wraps
+// around, the due slot of the level above is cascaded down, as in the
+// classic BSD and Linux timer wheels.
+
+#include <stddef.h>
+
+static const int TimerLevels = 4;
+static const int TimerSlotBits = 6;
+static const long TimerSlots = 1 << TimerSlotBits;
+static const long TimerTick = 10; // ms
+
+struct Timer {
+    Timer *prev; // NULL while the timer is not scheduled
+    Timer *next;
+    long expires; // tick
+    void *owner;
+};
+
+struct TimerWheel {
+    long now; // the current tick; slots up to it have been expired
+    long count;
+    Timer slots[TimerLevels][TimerSlots]; // list heads
+};
+
+void timerInit(Timer *t, void *owner) {
+    t->prev = t->next = NULL;
+    t->owner = owner;
+}
+
+void timerWheelInit(TimerWheel *tw, long nowMs) {
+    tw->now = nowMs / TimerTick;
+    tw->count = 0;
+    for (int l = 0; l < TimerLevels; l++) {
+        for (int i = 0; i < TimerSlots; i++) {
+            Timer *head = &tw->slots[l][i];
+            head->prev = head->next = head;
+        }
+    }
+}
+
+void timerCancel(TimerWheel *tw, Timer *t) {
+    if (t->prev == NULL) {
+        return;
+    }
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+    tw->count--;
+}
+
+static void timerInsert(TimerWheel *tw, Timer *t) {
+    long delta = t->expires - tw->now;
+    if (delta < 0) {
+        t->expires = tw->now;
+        delta = 0;
+    }
+    int level = 0;
+    while (level < TimerLevels - 1 and
+           delta >= TimerSlots << (TimerSlotBits * level)) {
+        level++;
+    }
+    long last = TimerSlots << (TimerSlotBits * level);
+    if (delta >= last) {
+        t->expires = tw->now + last - 1; // beyond the wheel; fires early
+    }
+    Timer *head = &tw->slots[level][(t->expires >> (TimerSlotBits * level)) &
+                                    (TimerSlots - 1)];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+    tw->count++;
+}
+
+// (Re)schedules t to expire at expiresMs, rounded up to the next tick.
+void timerSchedule(TimerWheel *tw, Timer *t, long expiresMs) {
+    timerCancel(tw, t);
+    t->expires = (expiresMs + TimerTick - 1) / TimerTick;
+    timerInsert(tw, t);
+}
+
+// Moves the timers of the due slot of level down into the levels below.
+static void timerCascade(TimerWheel *tw, int level) {
+    long i = (tw->now >> (TimerSlotBits * level)) & (TimerSlots - 1);
+    Timer *head = &tw->slots[level][i];
+    Timer *t = head->next;
+    head->prev = head->next = head;
+    while (t != head) {
+        Timer *next = t->next;
+        tw->count--;
+        timerInsert(tw, t);
+        t = next;
+    }
+}
+
+// Returns an unscheduled timer that expired by nowMs, or NULL once there
+// are none left. Call it in a loop after every wakeup.
+Timer *timerWheelExpire(TimerWheel *tw, long nowMs) {
+    long target = nowMs / TimerTick;
+    while (true) {
+        Timer *head = &tw->slots[0][tw->now & (TimerSlots - 1)];
+        if (head->next != head) {
+            Timer *t = head->next;
+            timerCancel(tw, t);
+            return t;
+        }
+        if (tw->now >= target) {
+            return NULL;
+        }
+        if (tw->count == 0) {
+            tw->now = target;
+            continue;
+        }
+        tw->now++;
+        for (int level = 1; level < TimerLevels; level++) {
+            if ((tw->now >> (TimerSlotBits * (level - 1))) &
+                (TimerSlots - 1)) {
+                break;
+            }
+            timerCascade(tw, level);
+        }
+    }
+}
+
+// Returns the time in ms by which timerWheelExpire() has to be called
+// again, which may be earlier than the first timer, or -1 if no timer is
+// scheduled.
+long timerWheelNext(const TimerWheel *tw) {
+    if (tw->count == 0) {
+        return -1;
+    }
+    long base = tw->now & ~(TimerSlots - 1);
+    for (long i = tw->now & (TimerSlots - 1); i < TimerSlots; i++) {
+        const Timer *head = &tw->slots[0][i];
+        if (head->next != head) {
+            return (base + i) * TimerTick;
+        }
+    }
+    return (base + TimerSlots) * TimerTick; // the next cascade
+}
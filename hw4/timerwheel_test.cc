@@ -0,0 +1,78 @@
+#include <gtest/gtest.h>
+#include <vector>
+
+#include "timerwheel.cc"
+
+static std::vector<long> expireAll(TimerWheel *tw, long nowMs) {
+    std::vector<long> fired;
+    while (Timer *t = timerWheelExpire(tw, nowMs)) {
+        fired.push_back((long)t->owner);
+    }
+    return fired;
+}
+
+TEST(TimerWheelTest, ExpiresInOrder) {
+    TimerWheel tw;
+    timerWheelInit(&tw, 1000);
+    Timer t[3];
+    long after[3] = {50, 5000, 700000}; // levels 0, 1 and 2
+    for (long i = 0; i < 3; i++) {
+        timerInit(&t[i], (void *)i);
+        timerSchedule(&tw, &t[i], 1000 + after[i]);
+    }
+    EXPECT_TRUE(expireAll(&tw, 1049).empty());
+    EXPECT_EQ(expireAll(&tw, 1050), std::vector<long>{0});
+    long next = timerWheelNext(&tw);
+    EXPECT_GT(next, 1050);
+    EXPECT_LE(next, 6000);
+    EXPECT_TRUE(expireAll(&tw, 5990).empty());
+    EXPECT_EQ(expireAll(&tw, 6000), std::vector<long>{1});
+    EXPECT_TRUE(expireAll(&tw, 700990).empty());
+    EXPECT_EQ(expireAll(&tw, 701000), std::vector<long>{2});
+    EXPECT_EQ(timerWheelNext(&tw), -1);
+}
+
+TEST(TimerWheelTest, RescheduleAndCancel) {
+    TimerWheel tw;
+    timerWheelInit(&tw, 0);
+    Timer a, b;
+    timerInit(&a, (void *)1);
+    timerInit(&b, (void *)2);
+    timerSchedule(&tw, &a, 100);
+    timerSchedule(&tw, &b, 100);
+    timerSchedule(&tw, &a, 3000);
+    timerCancel(&tw, &b);
+    timerCancel(&tw, &b);
+    EXPECT_TRUE(expireAll(&tw, 2990).empty());
+    EXPECT_EQ(expireAll(&tw, 3005), std::vector<long>{1});
+    // deadlines in the past fire on the next call
+    timerSchedule(&tw, &b, 10);
+    EXPECT_EQ(expireAll(&tw, 3005), std::vector<long>{2});
+}
+
+TEST(TimerWheelTest, RandomDeadlines) {
+    TimerWheel tw;
+    timerWheelInit(&tw, 12345);
+    std::vector<Timer> t(2000);
+    std::vector<long> due(t.size());
+    srandom(1);
+    for (size_t i = 0; i < t.size(); i++) {
+        timerInit(&t[i], (void *)i);
+        due[i] = 12345 + random() % 3000000;
+        timerSchedule(&tw, &t[i], due[i]);
+    }
+    size_t fired = 0;
+    long prev = 12345;
+    for (long now = prev; fired < t.size(); now += random() % 5000) {
+        for (long i : expireAll(&tw, now)) {
+            // on the first call after the deadline, rounded up to a tick
+            EXPECT_LE(due[i], now);
+            EXPECT_GT(due[i] + TimerTick, prev);
+            fired++;
+        }
+        if (fired < t.size()) {
+            EXPECT_GT(timerWheelNext(&tw), now);
+        }
+        prev = now;
+    }
+}
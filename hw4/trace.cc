@@ -0,0 +1,101 @@
+// Static tracepoints and a cheap clock for timing request phases.
+//
+// TRACEn(name, args...) places a USDT probe webserver:name of the kind
+// <sys/sdt.h> defines, which perf, bpftrace and SystemTap find through an
+// ELF note: the probe itself is a nop, and the note records its address and
+// where each argument lives at that point. An unattached probe costs the
+// nop and having its arguments in registers. The note is emitted here the
+// way sdt.h emits it, so no systemtap headers are needed to build; every
+// argument is passed as a signed 64-bit integer. Elsewhere than on x86-64
+// the probes compile to nothing.
+//
+// ticks() reads the TSC where there is one, which takes a few nanoseconds
+// and no system call; ticksToNs() converts differences with the rate
+// calibrateTicks() measured against CLOCK_MONOTONIC.
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+
+// The note of one probe. The comdat .stapsdt.base section lets tools
+// detect addresses that moved after linking, as with prelink.
+#define TRACE_NOTE(name, args)                                                 \
+    "990: nop\n"                                                               \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                              \
+    ".balign 4\n"                                                              \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                         \
+    "991: .asciz \"stapsdt\"\n"                                                \
+    "992: .balign 4\n"                                                         \
+    "993: .8byte 990b\n"                                                       \
+    ".8byte _.stapsdt.base\n"                                                  \
+    ".8byte 0\n"                                                               \
+    ".asciz \"webserver\"\n"                                                   \
+    ".asciz \"" #name "\"\n"                                                   \
+    ".asciz \"" args "\"\n"                                                    \
+    "994: .balign 4\n"                                                         \
+    ".popsection\n"                                                            \
+    ".ifndef _.stapsdt.base\n"                                                 \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"    \
+    ".weak _.stapsdt.base\n"                                                   \
+    ".hidden _.stapsdt.base\n"                                                 \
+    "_.stapsdt.base: .space 1\n"                                               \
+    ".size _.stapsdt.base, 1\n"                                                \
+    ".popsection\n"                                                            \
+    ".endif\n"
+
+#define TRACE_ARG(x) "nor"((int64_t)(x))
+#define TRACE0(name) __asm__ __volatile__(TRACE_NOTE(name, ""))
+#define TRACE1(name, a)                                                        \
+    __asm__ __volatile__(TRACE_NOTE(name, "-8@%0") ::TRACE_ARG(a))
+#define TRACE2(name, a, b)                                                     \
+    __asm__ __volatile__(TRACE_NOTE(name, "-8@%0 -8@%1") ::TRACE_ARG(a),      \
+                         TRACE_ARG(b))
+#define TRACE3(name, a, b, c)                                                  \
+    __asm__ __volatile__(TRACE_NOTE(name, "-8@%0 -8@%1 -8@%2") ::TRACE_ARG(a), \
+                         TRACE_ARG(b), TRACE_ARG(c))
+#define TRACE4(name, a, b, c, d)                                               \
+    __asm__ __volatile__(                                                      \
+        TRACE_NOTE(name, "-8@%0 -8@%1 -8@%2 -8@%3") ::TRACE_ARG(a),            \
+        TRACE_ARG(b), TRACE_ARG(c), TRACE_ARG(d))
+
+static inline uint64_t ticks() { return __rdtsc(); }
+
+#else
+
+#define TRACE0(name) ((void)0)
+#define TRACE1(name, a) ((void)0)
+#define TRACE2(name, a, b) ((void)0)
+#define TRACE3(name, a, b, c) ((void)0)
+#define TRACE4(name, a, b, c, d) ((void)0)
+
+static inline uint64_t ticks() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#endif
+
+static double nsPerTick = 1;
+
+// Measures the rate of ticks() over about 20 ms. Assumes the invariant TSC
+// of current x86 CPUs, which runs at one rate on all cores.
+void calibrateTicks() {
+    struct timespec a, b;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    uint64_t t0 = ticks();
+    usleep(20000);
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    uint64_t t1 = ticks();
+    double ns = (b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec);
+    if (t1 > t0) {
+        nsPerTick = ns / (t1 - t0);
+    }
+}
+
+static inline uint64_t ticksToNs(uint64_t n) {
+    return (uint64_t)(n * nsPerTick);
+}
@@ -0,0 +1,240 @@
+// Minimal io_uring support for the --io-uring backend, on raw system calls.
+//
+// The worker's ring carries what the epoll backend does one system call at
+// a time: the listener accepts through a multishot accept, requests are
+// received into buffers the kernel picks from a provided buffer ring, and
+// responses are sent with sendmsg requests; all of them are submitted and
+// reaped by the single io_uring_enter() that also waits for events. Other
+// descriptors (CGI pipes, pool sockets, inotify) get multishot polls,
+// which report readiness much like edge-triggered epoll.
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct Uring {
+    int fd;
+    unsigned sqEntries;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned pending; // queued SQEs not submitted yet
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    void *rings;
+    size_t ringsSize;
+    size_t sqesSize;
+    // provided buffers, group 0. The ring is indexed as a plain array: in
+    // C++, struct io_uring_buf_ring of older headers puts bufs at offset 8
+    // instead of 0. Its tail overlays the resv field of the first entry.
+    struct io_uring_buf *bufRing;
+    char *bufs;
+    unsigned bufCount; // a power of two
+    unsigned bufSize;
+};
+
+static int uringSetup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete,
+                      unsigned flags, void *arg, size_t argSize) {
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg,
+                   argSize);
+}
+
+// Sets up a ring with entries SQEs and bufCount provided buffers of
+// bufSize bytes. Returns -1 with errno set if the kernel lacks io_uring or
+// one of the features used here (Linux 5.19 or later).
+int uringInit(Uring *u, unsigned entries, unsigned bufCount,
+              unsigned bufSize) {
+    memset(u, 0, sizeof *u);
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    // only the worker thread touches the ring, and it only looks for
+    // completions when it enters the kernel anyway
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    u->fd = uringSetup(entries, &p);
+    if (u->fd == -1 and errno == EINVAL) {
+        memset(&p, 0, sizeof p);
+        u->fd = uringSetup(entries, &p);
+    }
+    if (u->fd == -1) {
+        return -1;
+    }
+    unsigned need =
+        IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((p.features & need) != need) {
+        close(u->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqSize =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ringsSize = sqSize > cqSize ? sqSize : cqSize;
+    u->rings = mmap(0, u->ringsSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *)mmap(
+        0, u->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        u->fd, IORING_OFF_SQES);
+    u->bufCount = bufCount;
+    u->bufSize = bufSize;
+    size_t bufRingSize = bufCount * sizeof(struct io_uring_buf);
+    u->bufRing = (struct io_uring_buf *)mmap(
+        0, bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+        -1, 0);
+    u->bufs = (char *)malloc((size_t)bufCount * bufSize);
+    if (u->rings == MAP_FAILED or u->sqes == MAP_FAILED or
+        u->bufRing == MAP_FAILED or u->bufs == NULL) {
+        close(u->fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    char *r = (char *)u->rings;
+    u->sqEntries = p.sq_entries;
+    u->sqHead = (unsigned *)(r + p.sq_off.head);
+    u->sqTail = (unsigned *)(r + p.sq_off.tail);
+    u->sqMask = (unsigned *)(r + p.sq_off.ring_mask);
+    u->sqArray = (unsigned *)(r + p.sq_off.array);
+    u->cqHead = (unsigned *)(r + p.cq_off.head);
+    u->cqTail = (unsigned *)(r + p.cq_off.tail);
+    u->cqMask = (unsigned *)(r + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(r + p.cq_off.cqes);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uintptr_t)u->bufRing;
+    reg.ring_entries = bufCount;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0) {
+        int err = errno;
+        close(u->fd);
+        errno = err;
+        return -1;
+    }
+    for (unsigned i = 0; i < bufCount; i++) {
+        struct io_uring_buf *b = &u->bufRing[i];
+        b->addr = (uintptr_t)(u->bufs + (size_t)i * bufSize);
+        b->len = bufSize;
+        b->bid = i;
+    }
+    __atomic_store_n(&u->bufRing[0].resv, (unsigned short)bufCount,
+                     __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Submits the queued SQEs without waiting. Returns -1 on failure.
+int uringSubmit(Uring *u) {
+    while (u->pending > 0) {
+        int r = uringEnter(u->fd, u->pending, 0, 0, NULL, 0);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        u->pending -= r;
+    }
+    return 0;
+}
+
+// Returns a cleared SQE to fill in; it is submitted with the next
+// uringSubmit() or uringWait().
+struct io_uring_sqe *uringSqe(Uring *u) {
+    unsigned tail = *u->sqTail;
+    if (tail - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) == u->sqEntries) {
+        uringSubmit(u);
+    }
+    unsigned i = tail & *u->sqMask;
+    struct io_uring_sqe *sqe = &u->sqes[i];
+    memset(sqe, 0, sizeof *sqe);
+    u->sqArray[i] = i;
+    __atomic_store_n(u->sqTail, tail + 1, __ATOMIC_RELEASE);
+    u->pending++;
+    return sqe;
+}
+
+// Submits the queued SQEs and waits up to timeoutMs (-1: forever) for a
+// completion. Returns -1 with errno set to ETIME on timeout, or EINTR.
+int uringWait(Uring *u, long timeoutMs) {
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeoutMs / 1000;
+    ts.tv_nsec = timeoutMs % 1000 * 1000000;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof arg);
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = timeoutMs >= 0 ? (uintptr_t)&ts : 0;
+    unsigned wait = timeoutMs == 0 ? 0 : 1;
+    int r = uringEnter(u->fd, u->pending, wait,
+                       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                       sizeof arg);
+    if (r >= 0) {
+        u->pending -= r;
+    }
+    return r < 0 ? -1 : 0;
+}
+
+// Takes the next completion off the queue. Returns false if there is none.
+bool uringNext(Uring *u, struct io_uring_cqe *out) {
+    unsigned head = *u->cqHead;
+    if (head == __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *out = u->cqes[head & *u->cqMask];
+    __atomic_store_n(u->cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Returns the provided buffer a completion with IORING_CQE_F_BUFFER used.
+char *uringBuffer(Uring *u, const struct io_uring_cqe &cqe) {
+    unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    return u->bufs + (size_t)bid * u->bufSize;
+}
+
+// Hands the buffer of cqe back to the kernel once its data was copied out.
+void uringRecycle(Uring *u, const struct io_uring_cqe &cqe) {
+    unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    unsigned short tail = u->bufRing[0].resv;
+    struct io_uring_buf *b = &u->bufRing[tail & (u->bufCount - 1)];
+    b->addr = (uintptr_t)(u->bufs + (size_t)bid * u->bufSize);
+    b->len = u->bufSize;
+    b->bid = bid;
+    __atomic_store_n(&u->bufRing[0].resv, (unsigned short)(tail + 1),
+                     __ATOMIC_RELEASE);
+}
+
+// Queues a request changing the events a pending poll carrying userData
+// waits for.
+void uringPollUpdate(Uring *u, uint64_t userData, uint32_t events) {
+    struct io_uring_sqe *sqe = uringSqe(u);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = userData;
+    sqe->len = IORING_POLL_UPDATE_EVENTS;
+    sqe->poll32_events = events;
+    sqe->user_data = ~(uint64_t)0;
+}
+
+// Queues a request to cancel every request carrying userData.
+void uringCancel(Uring *u, uint64_t userData, uint64_t cancelUserData) {
+    struct io_uring_sqe *sqe = uringSqe(u);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = userData;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = cancelUserData;
+}
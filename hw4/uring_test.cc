@@ -0,0 +1,66 @@
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+
+#include "uring.cc"
+
+// Receives what is waiting on fd into a provided buffer and returns it.
+static std::string ringRecv(Uring *u, int fd) {
+    struct io_uring_sqe *sqe = uringSqe(u);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = u->bufSize;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->user_data = 7;
+    uringWait(u, 1000);
+    struct io_uring_cqe cqe;
+    if (!uringNext(u, &cqe) or cqe.user_data != 7 or cqe.res < 0 or
+        !(cqe.flags & IORING_CQE_F_BUFFER)) {
+        return "<failed>";
+    }
+    std::string s(uringBuffer(u, cqe), cqe.res);
+    uringRecycle(u, cqe);
+    return s;
+}
+
+TEST(UringTest, ProvidedBuffersAndCancel) {
+    Uring u;
+    if (-1 == uringInit(&u, 8, 4, 16)) {
+        GTEST_SKIP() << "io_uring unavailable: " << strerror(errno);
+    }
+    int sv[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+    // more receives than buffers, so recycled buffers are reused
+    for (int i = 0; i < 10; i++) {
+        std::string msg = "message " + std::to_string(i);
+        ASSERT_EQ((ssize_t)msg.size(), write(sv[1], msg.data(), msg.size()));
+        EXPECT_EQ(ringRecv(&u, sv[0]), msg);
+    }
+    // a pending poll completes with -ECANCELED once cancelled
+    struct io_uring_sqe *sqe = uringSqe(&u);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = sv[0];
+    sqe->poll32_events = EPOLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = 9;
+    uringSubmit(&u);
+    uringCancel(&u, 9, 10);
+    std::map<uint64_t, int> results;
+    for (int i = 0; i < 10 and results.size() < 2; i++) {
+        uringWait(&u, 100);
+        struct io_uring_cqe cqe;
+        while (uringNext(&u, &cqe)) {
+            results[cqe.user_data] = cqe.res;
+        }
+    }
+    EXPECT_EQ(results[9], -ECANCELED);
+    EXPECT_EQ(results[10], 1);
+    close(sv[0]);
+    close(sv[1]);
+}
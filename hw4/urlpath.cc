@@ -0,0 +1,134 @@
+// Normalization of request targets.
+//
+// cleanupPath() turns a request target into a path relative to the
+// document root, in place and in one pass: it splits off the query,
+// percent-decodes, drops empty segments and resolves "." and ".."
+// segments, never climbing above the root. Most targets have nothing to
+// decode or resolve and only lose their leading slashes; plainPathLength()
+// recognizes those with SSE2, 16 bytes at a time.
+
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static int hexValue(unsigned char ch) {
+    if (ch >= '0' and ch <= '9') {
+        return ch - '0';
+    }
+    ch |= 0x20;
+    if (ch >= 'a' and ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+    return -1;
+}
+
+// Returns the length of the part of path[0, len) before the query if that
+// part is already normalized, or -1 if it has a '%', an empty segment or
+// a segment starting with '.'. path must not start with a slash.
+ssize_t plainPathLength(const char *path, ssize_t len) {
+    ssize_t i = 0;
+    unsigned carry = 1; // whether path[i - 1] ends a segment
+#ifdef __SSE2__
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i dot = _mm_set1_epi8('.');
+    const __m128i percent = _mm_set1_epi8('%');
+    const __m128i question = _mm_set1_epi8('?');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(path + i));
+        unsigned s = _mm_movemask_epi8(_mm_cmpeq_epi8(v, slash));
+        unsigned d = _mm_movemask_epi8(_mm_cmpeq_epi8(v, dot));
+        unsigned p = _mm_movemask_epi8(_mm_cmpeq_epi8(v, percent));
+        unsigned q = _mm_movemask_epi8(_mm_cmpeq_epi8(v, question));
+        unsigned start = (s << 1 | carry) & 0xffff; // bytes starting a segment
+        unsigned bad = p | ((s | d) & start);
+        if (q) {
+            unsigned before = (q & -q) - 1;
+            return bad & before ? -1 : i + __builtin_ctz(q);
+        }
+        if (bad) {
+            return -1;
+        }
+        carry = s >> 15;
+    }
+#endif
+    for (; i < len; i++) {
+        char ch = path[i];
+        if (ch == '?') {
+            return i;
+        }
+        if (ch == '%' or (carry and (ch == '/' or ch == '.'))) {
+            return -1;
+        }
+        carry = ch == '/';
+    }
+    return len;
+}
+
+// Normalizes path[0, len), which is followed by a NUL, in place and
+// NUL-terminates the result. "a/b/.." becomes "a", "a/b/../" becomes "a/".
+// Returns the query, the part after the first '?' (or an empty string), or
+// NULL if the path decodes to a control character, which no file name
+// served here has and which must not reach a header.
+char *cleanupPath(char *path, ssize_t len) {
+    ssize_t i = 0;
+    while (i < len and path[i] == '/') {
+        i++;
+    }
+    ssize_t n = plainPathLength(path + i, len - i);
+    if (n >= 0) {
+        memmove(path, path + i, n);
+        if (n < len) {
+            path[n] = 0;
+        }
+        return i + n < len ? path + i + n + 1 : path + len;
+    }
+    char *query = path + len;
+    ssize_t o = 0;   // output length, never ahead of i
+    ssize_t seg = 0; // where the current segment starts in the output
+    for (;; i++) {
+        bool end = i == len or path[i] == '?';
+        char ch = end ? '/' : path[i];
+        if (ch == '%' and i + 2 < len and hexValue(path[i + 1]) >= 0 and
+            hexValue(path[i + 2]) >= 0) {
+            ch = hexValue(path[i + 1]) << 4 | hexValue(path[i + 2]);
+            i += 2;
+            if ((unsigned char)ch < 0x20 or ch == 0x7f) {
+                return NULL;
+            }
+        }
+        if (ch != '/') {
+            path[o++] = ch;
+            continue;
+        }
+        ssize_t segLen = o - seg;
+        bool dots = (segLen == 1 or segLen == 2) and path[seg] == '.' and
+                    path[o - 1] == '.';
+        if (dots and segLen == 2 and seg > 0) {
+            // drop the previous segment along with its slash
+            for (seg--; seg > 0 and path[seg - 1] != '/'; seg--) {
+            }
+        }
+        if (dots) {
+            o = seg;
+            if (end and o > 0) {
+                o--;
+            }
+        } else if (segLen > 0 and !end) {
+            path[o++] = '/';
+            seg = o;
+        }
+        if (end) {
+            if (i < len) {
+                query = path + i + 1;
+            }
+            break;
+        }
+    }
+    if (o < len) {
+        path[o] = 0;
+    }
+    return query;
+}
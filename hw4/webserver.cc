@@ -1,348 +1,2628 @@
 #include <assert.h>
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <spawn.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "parser.cc"
+
+#include "accesslog.cc"
+#include "arena.cc"
+#include "cgipool.cc"
+#include "dirlist.cc"
+#include "filecache.cc"
+#include "gzip.cc"
+#include "metrics.cc"
+#include "mime.cc"
+#include "statcache.cc"
+#include "timerwheel.cc"
+#include "trace.cc"
+#include "uring.cc"
+#include "urlpath.cc"
+
+#include "bundle.cc"
+
 static const char *StatusOK = "200 OK";
+static const char *StatusPartialContent = "206 Partial Content";
 static const char *StatusMovedPermanently = "301 Moved Permanently";
+static const char *StatusNotModified = "304 Not Modified";
 static const char *StatusBadRequest = "400 Bad Request";
 static const char *StatusForbidden = "403 Forbidden";
 static const char *StatusNotFound = "404 Not Found";
+static const char *StatusRequestHeaderFieldsTooLarge =
+    "431 Request Header Fields Too Large";
+static const char *StatusRangeNotSatisfiable = "416 Range Not Satisfiable";
 static const char *StatusInternalServerError = "500 Internal Server Error";
+static const char *StatusNotImplemented = "501 Not Implemented";
+static const char *StatusBadGateway = "502 Bad Gateway";
+
+// The answer to requests shed under overload, built once by
+// buildOverloadResponse() and copied out as it is.
+static std::string overloadResponse;
+
+// The bundle serving every request when DOCROOT is one, or NULL.
+static Bundle *bundle;
+
+// SIGCHLD is blocked in every thread, see main(), and read from a
+// signalfd in each worker's event loop. A child that exits while the
+// workers are busy leaves the signal pending, so the next wait for events
+// returns at once. The signal does not say whose child exited, and any
+// worker may read it, so that worker pokes the others through their
+// childWake eventfds, and each then reaps only the children it spawned,
+// by pid, in reapChildren(). A worker thus never has a pid it still holds
+// (to kill a CGI child that timed out, or a pool process) reaped and
+// reused under it by another worker.
+
+// Counts SIGUSR1s; every worker prints its cache counters when it notices
+// a new one.
+static volatile sig_atomic_t statsRequested;
+void handleUsr1(int signum) { statsRequested++; }
+
+// The states a connection goes through. Each state is resumable: when the
+// socket runs dry the step returns and is retried on the next event.
+enum ConnState {
+    StateRequestLine, // reading "METHOD PATH VERSION\r\n"
+    StateHeaders,     // reading header lines until the empty line
+    StateServe,       // dispatching to a handler, which queues the response
+    StateDrain,       // flushing the queued response
+    StateCgiBody,     // reading the body of a pooled CGI request
+    StateCgiWait,     // waiting for a pool process to answer
+    StateCgiRun,      // a spawned CGI child runs, its output is streamed
+};
+
+// Tunables, set from the command line by main().
+struct Options {
+    int idleTimeout;     // seconds a connection may stay silent
+    int requestTimeout;  // seconds from a request's first byte to its line
+    int headerTimeout;   // seconds from a request's first byte to its end
+    int bodyTimeout;     // seconds a request body may take to arrive
+    int responseTimeout; // seconds from a request to the end of its response
+    int maxRequests;    // requests served per connection before closing it
+    int maxHeaderBytes; // size limit of the request line and headers
+    size_t cacheBytes;  // per-worker file cache budget, 0 disables it
+    size_t cacheEntries;
+    long statTTL; // milliseconds path lookups are cached, 0 disables it
+    size_t gzipCacheBytes; // per-worker budget of --gzip, 0 disables it
+    std::vector<CgiPoolSpec> cgiPools;
+    bool ioUring; // use the io_uring backend where the kernel has it
+    bool serverStatus; // answer /server-status with the metrics
+    bool phaseTiming;  // time the phases of requests, see phaseBegin()
+    // Admission limits per worker, 0 for none: open connections, CGI
+    // children streaming a response, and response bytes queued in memory
+    // or in files that are not sent yet. Beyond them requests get 503.
+    int maxConns;
+    int maxCgi;
+    long long maxQueuedBytes;
+};
+static Options opts = {5, 10, 20, 5, 60, 100, 8192, 32 << 20, 4096, 1000, 0};
+
+// Size of the io_uring backend's rings and of its provided receive buffers.
+static const unsigned RingEntries = 1024;
+static const unsigned RingBuffers = 1024;
+static const unsigned RingBufferSize = 4096;
+
+static const char *ConnectionKeepAlive = "Connection: keep-alive\r\n\r\n";
+static const char *ConnectionClose = "Connection: close\r\n\r\n";
+
+// Connections accepted per event before the worker turns to the others;
+// the rest are accepted after the current batch.
+static const int AcceptBatch = 64;
+
+// Holds the request head plus whatever was read past it: pipelined
+// requests or the start of a CGI request body.
+static const size_t InputBufferSize = 16384;
+
+// One event loop thread. With --workers N every worker has its own
+// SO_REUSEPORT listening socket, so the kernel spreads incoming connections
+// across workers without a shared accept lock.
+struct Worker {
+    int id;
+    int sock;
+    int epfd;
+    Uring *ring; // the io_uring backend's ring, NULL with epoll
+    bool pin;    // pin to a CPU chosen by id
+    int childFd; // signalfd of SIGCHLD, whose events carry the Worker
+    int childWake; // eventfd poked when another worker read SIGCHLD
+    std::vector<pid_t> children; // spawned and not reaped yet
+    pthread_t thread;
+    FileCache cache;
+    FileCache gzcache; // files compressed by --gzip
+    StatCache stats;
+    DirCache dirs;
+    int statsSeen;
+    std::vector<CgiPool> pools; // sized once, processes point into it
+    std::vector<struct Conn *> closed; // freed after the current events
+    TimerWheel timers; // one timer per connection, see connDeadline()
+    long now;          // nowMs() after the last wait for events
+    Metrics metrics;   // written by this worker only, see metrics.cc
+    LogRing *log;      // this worker's part of accessLog, or NULL
+    LogClock logClock;
+    int conns;          // open connections, for --max-conns
+    int cgiRunning;     // spawned CGI children streaming, for --max-cgi
+    long long queued;   // the sum of the Conns' queued, for --max-queued
+    bool acceptPending; // the listener is ready, or was left at AcceptBatch
+};
+
+// All workers, for /server-status; set up by main() before they start.
+static Worker *allWorkers;
+static int numWorkers;
 
-static int toClose;
-void handleAlarm(int signum) {
-    close(toClose);
-    dprintf(2, "  timeout reached\n");
+static AccessLog accessLog;
+
+// A part of the response body: data[off:end] in memory, or the byte range
+// [off, end) of the connection's file when data is NULL. off advances as
+// the piece is written, so a partial write resumes where it stopped.
+struct Piece {
+    const char *data;
+    off_t off;
+    off_t end;
+};
+
+struct Conn {
+    Worker *w;
+    int fd;
+    struct sockaddr_in caddr;
+    ConnState state;
+    bool eof;
+    char *in; // InputBufferSize bytes, or NULL while nothing is buffered
+    size_t inLen;
+    bool inPending; // the socket may have input no new edge will announce
+    HttpRequest req; // views into in
+    ssize_t contentLength;
+    std::string out;
+    size_t outOff;
+    std::vector<Piece> pieces; // written after out, see queuePiece()
+    size_t piecePos;           // first piece not completely written
+    std::string parts;         // multipart framing that pieces point into
+    std::shared_ptr<CachedFile> cached; // owns memory pieces of cached files
+    std::shared_ptr<DirListing> dir;    // owns the piece of a listing page
+    std::shared_ptr<PathInfo> file;     // the fd of file pieces
+    std::string cgiRequest; // frame for a pool process, see cgipool.cc
+    size_t cgiRequestSize;  // its size once the body is complete
+    CgiPool *cgiPool;       // the pool serving c's request
+    CgiProc *cgiProc;       // the process answering c
+    pid_t cgiPid;           // the spawned CGI child, or 0
+    int cgiStdin;           // the child's stdin while the body is pumped
+    int cgiStdout;          // the child's stdout until its end was seen
+    ssize_t cgiBodyLeft; // body bytes still to be read from the socket
+    size_t cgiInOff;     // body bytes of in already written to cgiStdin
+    size_t cgiInEnd;     // end of the body bytes in in; the next request
+                         // may follow
+    std::string cgiHead; // the child's output up to its CGI headers
+    bool cgiStreaming;   // the response head is queued, the body follows
+    bool cgiChunked;     // the body goes out with chunked encoding
+    bool cgiTrailer;     // the last chunk still lacks its CRLF
+    size_t cgiChunkLeft; // bytes of the current chunk still in the pipe
+    uint64_t cgiStart;   // phaseBegin() of the child's PhaseCgiWait
+    bool closed;         // waiting in Worker::closed to be freed
+    unsigned ringOps;    // 1 << tag for each request in flight on the ring
+    uint32_t pollEvents; // what the ring's TagPoll request waits for
+    struct RingSend *send; // the ring's sendmsg request, see stepDrain()
+    bool keepAlive;
+    bool head; // a HEAD request: the response goes out without its body
+    bool acceptGzip;
+    int requests;      // requests served on this connection
+    long lastActive;   // Worker::now of the last event
+    long requestStart; // Worker::now of the request's first byte, or 0
+    long responseStart; // Worker::now when the request was dispatched
+    long parsedUs;      // nowUs() when the request's head was parsed
+    int handler;        // the Handler answering the request
+    int status;         // the response's status code
+    long long sent;     // bytes of the response sent so far
+    std::string logRequest; // "METHOD /path", for the access log
+    long long queued;       // response bytes counted in Worker::queued
+    Arena arena;            // the request's strings, see arena.cc
+    Timer timer;
+};
+
+long nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-void statusResponse(int csock, const char *status, const char *description = "",
-                    bool useerrno = true) {
-    dprintf(csock,
-            "HTTP/1.1 %s\r\nContent-Type: text/plain\r\nConnection: "
-            "close\r\n\r\n%s\r\n%s\r\n",
-            status, status, description);
-    if (useerrno) {
-        dprintf(csock, "errno %d: %s\r\n", errno, strerror(errno));
+long nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Starts a phase of serving the connection fd, or -1 for none: fires the
+// webserver:phase_start probe and, with --phase-timing, returns the ticks()
+// to pass to phaseEnd().
+static inline uint64_t phaseBegin(int phase, int fd) {
+    TRACE2(phase_start, phase, fd);
+    return opts.phaseTiming ? ticks() : 0;
+}
+
+// Ends a phase: fires webserver:phase_done with its duration in ns, 0
+// without --phase-timing, and adds the duration to the metrics.
+static inline void phaseEnd(Worker *w, int phase, int fd, uint64_t start) {
+    uint64_t ns = start ? ticksToNs(ticks() - start) : 0;
+    TRACE3(phase_done, phase, fd, ns);
+    if (start) {
+        metricsPhase(&w->metrics, phase, ns);
     }
 }
 
-void writeHeader(int csock, const char *status, const char *etc = "",
-                 const char *end = "\r\n") {
-    dprintf(csock, "HTTP/1.1 %s\r\nConnection: close\r\n%s%s", status, etc,
-            end);
+void touch(Conn *c) { c->lastActive = c->w->now; }
+
+// Returns start plus secs, or -1 if the timeout is disabled by secs == 0.
+static long after(long start, int secs) {
+    return secs > 0 ? start + secs * 1000L : -1;
 }
 
-char *cleanupPath(char *path, ssize_t len) {
-    ssize_t o = 0;
-    ssize_t last_slash = -1;
-    char *query = path + strlen(path);
-    for (ssize_t i = 0; i < len; i++) {
-        if (path[i] == '?') {
-            query = path + i + 1;
-            break;
-        }
-        if (last_slash + 1 == i) {
-            if (path[i] == '.') {
-                if (path[i + 1] == '.') {
-                    if (path[i + 2] == 0 or path[i + 2] == '?' or
-                        path[i + 2] == '/') {
-                        for (o -= 2; o > 0; o--) {
-                            if (path[o] == '/') {
-                                break;
-                            }
-                        }
-                        i++;
-                        continue;
-                    }
-                }
-            }
+// Returns the earlier deadline; -1 stands for none.
+static long earliest(long a, long b) {
+    return a == -1 or (b != -1 and b < a) ? b : a;
+}
+
+// Returns the nowMs() by which c must have left its state, or -1. Waiting
+// on the client is also bounded by the idle timeout.
+long connDeadline(Conn *c) {
+    long limit = -1;
+    switch (c->state) {
+    case StateRequestLine:
+        if (c->inLen > 0) {
+            limit = after(c->requestStart, opts.requestTimeout);
         }
-        if (path[i] == '/') {
-            last_slash = i;
-            if (o > 0) {
-                if (path[o - 1] == '/') {
-                    continue;
-                }
-            }
-            if (o == 0) {
-                continue;
-            }
+        break;
+    case StateHeaders:
+        limit = after(c->requestStart, opts.headerTimeout);
+        break;
+    case StateServe:
+    case StateDrain:
+        limit = after(c->responseStart, opts.responseTimeout);
+        break;
+    case StateCgiBody:
+        limit = after(c->responseStart, opts.bodyTimeout);
+        break;
+    case StateCgiWait:
+        return after(c->responseStart, opts.responseTimeout);
+    case StateCgiRun:
+        limit = after(c->responseStart, opts.responseTimeout);
+        if (c->cgiStdin != -1) {
+            limit = earliest(limit, after(c->responseStart, opts.bodyTimeout));
         }
-        path[o] = path[i];
-        o++;
+        return limit;
     }
-    if (o < 0) {
-        o = 0;
-    }
-    if (o < len) {
-        path[o] = 0;
+    return earliest(limit, after(c->lastActive, opts.idleTimeout));
+}
+
+void updateTimer(Conn *c) {
+    long deadline = connDeadline(c);
+    if (deadline == -1) {
+        timerCancel(&c->w->timers, &c->timer);
+    } else {
+        timerSchedule(&c->w->timers, &c->timer, deadline);
     }
-    return query;
 }
 
-void handleDirListing(int csock, char *path) {
-    DIR *d = opendir(path);
-    if (d == NULL) {
-        statusResponse(csock, StatusNotFound, "directory not readable");
+void appendf(std::string *s, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char buf[512];
+    int n = vsnprintf(buf, sizeof buf, fmt, ap);
+    va_end(ap);
+    if (n < (int)sizeof buf) {
+        s->append(buf, n);
         return;
     }
-    writeHeader(csock, StatusOK, "Content-Type: text/html; charset=utf-8\r\n");
-    struct dirent *entry;
-    dprintf(csock, "<h1>%s</h1>\n<ul>\n", path);
-    while ((entry = readdir(d))) {
-        dprintf(csock, "<li><a href=\"/%s%s\">%s</a></li>\n", path,
-                entry->d_name, entry->d_name);
+    size_t old = s->size();
+    s->resize(old + n + 1);
+    va_start(ap, fmt);
+    vsnprintf(&(*s)[old], n + 1, fmt, ap);
+    va_end(ap);
+    s->resize(old + n);
+}
+
+// Passed as contentLength for responses that never have a body.
+static const off_t NoBody = -2;
+// Passed as contentLength for a body sent with chunked encoding.
+static const off_t Chunked = -3;
+
+// Queues the status line and headers. contentLength is -1 when the body is
+// not delimited, which forces the connection to be closed after it.
+void writeHeader(Conn *c, const char *status, off_t contentLength,
+                 const char *etc = "", const char *end = "\r\n") {
+    if (contentLength == -1) {
+        c->keepAlive = false;
+    }
+    c->status = atoi(status);
+    appendf(&c->out, "HTTP/1.1 %s\r\nConnection: %s\r\n", status,
+            c->keepAlive ? "keep-alive" : "close");
+    if (contentLength >= 0) {
+        appendf(&c->out, "Content-Length: %lld\r\n", (long long)contentLength);
+    } else if (contentLength == Chunked) {
+        c->out += "Transfer-Encoding: chunked\r\n";
+    }
+    appendf(&c->out, "%s%s", etc, end);
+}
+
+// Appends s to the response body in c->out. The response to a HEAD
+// request keeps the headers of a GET, Content-Length included, but never
+// the body: with keep-alive it would be read as the next response.
+void appendBody(Conn *c, std::string_view s) {
+    if (!c->head) {
+        c->out.append(s);
     }
-    closedir(d);
-    dprintf(csock, "</ul>\n");
 }
 
-void handleDirRedirect(int csock, char *path) {
-    char *hdr;
-    asprintf(&hdr, "Location: /%s/\r\n", path);
-    writeHeader(csock, StatusMovedPermanently, hdr);
-    free(hdr);
+void statusResponse(Conn *c, const char *status, const char *description = "",
+                    bool useerrno = true) {
+    int err = errno;
+    c->handler = HandlerError;
+    const char *body = arenaPrintf(&c->arena, "%s\r\n%s\r\n", status,
+                                   description);
+    if (useerrno) {
+        body = arenaPrintf(&c->arena, "%serrno %d: %s\r\n", body, err,
+                           strerror(err));
+    }
+    writeHeader(c, status, strlen(body), "Content-Type: text/plain\r\n");
+    appendBody(c, body);
 }
 
-int spliceN(int ifd, int ofd, ssize_t n) {
-    while (n > 0) {
-        ssize_t r = splice(ifd, 0, ofd, 0, n, 0);
-        if (r < 0) {
-            return -1;
-        }
-        n -= r;
+// Builds overloadResponse, which asks clients to retry after retryAfter
+// seconds.
+void buildOverloadResponse(int retryAfter) {
+    const char *body = "503 Service Unavailable\r\nserver overloaded\r\n";
+    overloadResponse.clear();
+    appendf(&overloadResponse,
+            "HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n"
+            "Retry-After: %d\r\nContent-Type: text/plain\r\n"
+            "Content-Length: %zu\r\n\r\n%s",
+            retryAfter, strlen(body), body);
+}
+
+// Answers the request of c with overloadResponse, counted under reason.
+void shedRequest(Conn *c, int reason) {
+    metricAdd(&c->w->metrics.shed[reason], 1);
+    c->keepAlive = false;
+    c->handler = HandlerError;
+    c->status = 503;
+    c->out += overloadResponse;
+    c->state = StateDrain;
+}
+
+void handleDirRedirect(Conn *c, char *path) {
+    c->handler = HandlerRedirect;
+    // the path is decoded; encode it again segment by segment
+    writeHeader(c, StatusMovedPermanently, 0, "Location: /", "");
+    for (char *p = path; *p;) {
+        size_t n = strcspn(p, "/");
+        appendUrlEscaped(&c->out, std::string_view(p, n));
+        c->out += '/';
+        p += n + (p[n] == '/');
+    }
+    c->out += "\r\n\r\n";
+}
+
+// Events of a spawned CGI child, and completions of the ring's requests
+// for a connection, carry the pointer of the connection with one of these
+// tags in the low bits, which are clear in real pointers.
+enum {
+    TagCgiStdout = 1, // the pipe from the child's stdout became readable
+    TagCgiStdin = 2,  // the pipe to the child's stdin became writable
+    TagRecv = 3,      // the ring received from the socket
+    TagSend = 4,      // the ring sent to the socket
+    TagPoll = 5,      // the socket became ready for what c waits for
+    TagMask = 7,
+};
+
+static void *tagConn(Conn *c, int tag) { return (void *)((uintptr_t)c | tag); }
+
+// user_data of ring requests whose completion is of no interest.
+static const uint64_t RingIgnore = ~(uint64_t)0;
+
+// Starts watching fd for events, which are reported with ptr: through the
+// epoll set, or as completions of a multishot poll on the ring.
+int watchFd(Worker *w, int fd, uint32_t events, void *ptr) {
+    if (w->ring == NULL) {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = ptr;
+        return epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev);
     }
+    struct io_uring_sqe *sqe = uringSqe(w->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = (uintptr_t)ptr;
     return 0;
 }
 
-void handleCGI(int csock, const char *method, char *path, const char *query, int contentLength) {
+// Stops the events of ptr; call it when closing the watched fd. Closing
+// is enough for epoll, but a ring request keeps the file open until it is
+// cancelled.
+void unwatchFd(Worker *w, void *ptr) {
+    if (w->ring) {
+        uringCancel(w->ring, (uintptr_t)ptr, RingIgnore);
+    }
+}
+
+// watchFd() for an fd belonging to c, reported with tag.
+void watchConnFd(Conn *c, int fd, uint32_t events, int tag) {
+    if (c->w->ring) {
+        c->ringOps |= 1u << tag;
+    }
+    watchFd(c->w, fd, events, tagConn(c, tag));
+}
+
+// Queues a oneshot poll of c's socket for events, or adds them to the one
+// that is pending.
+void ringPoll(Conn *c, uint32_t events) {
+    events |= EPOLLRDHUP;
+    if (c->ringOps & (1u << TagPoll)) {
+        if (events & ~c->pollEvents) {
+            c->pollEvents |= events;
+            uringPollUpdate(c->w->ring, (uintptr_t)tagConn(c, TagPoll),
+                            c->pollEvents);
+        }
+        return;
+    }
+    c->ringOps |= 1u << TagPoll;
+    c->pollEvents = events;
+    struct io_uring_sqe *sqe = uringSqe(c->w->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = events;
+    sqe->user_data = (uintptr_t)tagConn(c, TagPoll);
+}
+
+// Spawns a CGI child for c. The request body, if any, is pumped into the
+// child's stdin and its stdout is read back through a pipe by
+// stepCgiRun(), which turns the CGI headers into the response head and
+// streams the body.
+void handleCGI(Conn *c, const char *method, char *path, const char *query) {
+    if (opts.maxCgi > 0 and c->w->cgiRunning >= opts.maxCgi) {
+        shedRequest(c, ShedCgi);
+        return;
+    }
+    c->handler = HandlerCgi;
+    ssize_t contentLength = c->contentLength;
+    int inPipe[2], outPipe[2];
+    if (-1 == pipe2(outPipe, O_CLOEXEC)) {
+        statusResponse(c, StatusInternalServerError, "pipe() failed");
+        return;
+    }
+    if (contentLength >= 0 and -1 == pipe2(inPipe, O_CLOEXEC)) {
+        statusResponse(c, StatusInternalServerError, "pipe() failed");
+        close(outPipe[0]);
+        close(outPipe[1]);
+        return;
+    }
     pid_t pid;
     posix_spawn_file_actions_t actions;
     posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t sigdef;
+    sigemptyset(&sigdef);
+    sigaddset(&sigdef, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigdef);
+    // a process group of its own lets a timeout kill what the script started
+    posix_spawnattr_setpgroup(&attr, 0);
+    sigset_t none;
+    sigemptyset(&none);
+    posix_spawnattr_setsigmask(&attr, &none); // SIGCHLD is blocked here
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF |
+                                        POSIX_SPAWN_SETPGROUP |
+                                        POSIX_SPAWN_SETSIGMASK);
     char *argv[] = {path, 0};
-    char *envp[3] = {0, 0, 0};
-    asprintf(&envp[0], "REQUEST_METHOD=%s", method);
-    asprintf(&envp[1], "QUERY_STRING=%s", query);
-    int pipefd[2];
-    posix_spawn_file_actions_adddup2(&actions, csock, STDOUT_FILENO);
+    char *envp[] = {arenaPrintf(&c->arena, "REQUEST_METHOD=%s", method),
+                    arenaPrintf(&c->arena, "QUERY_STRING=%s", query), 0};
+    posix_spawn_file_actions_adddup2(&actions, outPipe[1], STDOUT_FILENO);
     if (contentLength >= 0) {
-        if (-1 == pipe(pipefd)) {
-            perror("pipe() failed");
-            goto cleanup;
-        }
-        posix_spawn_file_actions_adddup2(&actions, pipefd[0], STDIN_FILENO);
-        posix_spawn_file_actions_addclose(&actions, pipefd[0]);
-        posix_spawn_file_actions_addclose(&actions, pipefd[1]);
+        posix_spawn_file_actions_adddup2(&actions, inPipe[0], STDIN_FILENO);
     } else {
         posix_spawn_file_actions_addclose(&actions, STDIN_FILENO);
     }
-    writeHeader(csock, StatusOK, "", "");
-    if (-1 == posix_spawn(&pid, path, &actions, 0, argv, envp)) {
-        statusResponse(csock, StatusInternalServerError,
-                       "posix_spawn() failed");
-        goto cleanup;
+    long spawnStart = nowUs();
+    uint64_t phaseStart = phaseBegin(PhaseCgiSpawn, c->fd);
+    int err = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+    phaseEnd(c->w, PhaseCgiSpawn, c->fd, phaseStart);
+    metricsCgiSpawn(&c->w->metrics, nowUs() - spawnStart);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(outPipe[1]);
+    if (contentLength >= 0) {
+        close(inPipe[0]);
+    }
+    if (err) {
+        errno = err;
+        statusResponse(c, StatusInternalServerError, "posix_spawn() failed");
+        close(outPipe[0]);
+        if (contentLength >= 0) {
+            close(inPipe[1]);
+        }
+        return;
     }
+    c->w->children.push_back(pid);
+    c->cgiPid = pid;
+    c->cgiStart = phaseBegin(PhaseCgiWait, c->fd);
+    c->w->cgiRunning++;
+    c->cgiStdout = outPipe[0];
+    fcntl(c->cgiStdout, F_SETFL, O_NONBLOCK);
+    watchConnFd(c, c->cgiStdout, EPOLLIN | EPOLLET, TagCgiStdout);
+    c->cgiStreaming = false;
+    c->cgiChunked = c->req.version == "HTTP/1.1";
+    c->cgiTrailer = false;
+    c->cgiChunkLeft = 0;
+    c->cgiBodyLeft = 0;
     if (contentLength >= 0) {
-        close(pipefd[0]);
-        toClose = pipefd[1];
-        alarm(5);
-        if (-1 == spliceN(csock, pipefd[1], contentLength)) {
-            perror("splice failed");
-        } else {
-            alarm(0);
-            fprintf(stderr, "  splice() completed\n");
-        }
-        close(pipefd[1]);
-    }
-    int status;
-    if (-1 == waitpid(pid, &status, 0)) {
-        perror("waitpid failed");
-    } else if (WIFEXITED(status)) {
-        fprintf(stderr, "  CGI exit status %d\n", WEXITSTATUS(status));
-    } else if (WIFSIGNALED(status)) {
-        fprintf(stderr, "  CGI exit signal %d: %s\n", WTERMSIG(status),
-                strsignal(WTERMSIG(status)));
-    } else {
-        fprintf(stderr, "  CGI unknown status %d\n", status);
+        // part of the body may already sit in the input buffer
+        size_t buffered = c->inLen - c->req.length;
+        if ((ssize_t)buffered > contentLength) {
+            buffered = contentLength; // a pipelined request follows
+        }
+        c->inLen -= c->req.length;
+        memmove(c->in, c->in + c->req.length, c->inLen);
+        // the request is gone from the buffer, and the body is consumed
+        // here instead of being skipped by resetRequest()
+        c->req.length = 0;
+        c->contentLength = -1;
+        c->cgiInOff = 0;
+        c->cgiInEnd = buffered;
+        c->cgiBodyLeft = contentLength - buffered;
+        c->cgiStdin = inPipe[1];
+        fcntl(c->cgiStdin, F_SETFL, O_NONBLOCK);
+        watchConnFd(c, c->cgiStdin, EPOLLOUT | EPOLLET, TagCgiStdin);
     }
-cleanup:
-    free(envp[0]);
-    free(envp[1]);
+    c->state = StateCgiRun;
 }
 
-void handleStatic(int csock, char *path) {
-    int fd = open(path, O_RDONLY);
-    if (fd == -1) {
-        if (errno == ENOENT) {
-            statusResponse(csock, StatusForbidden);
-        } else {
-            statusResponse(csock, StatusNotFound);
-        }
-    } else {
-        writeHeader(csock, StatusOK);
-        sendfile(csock, fd, 0, 0x7ffff000);
-        close(fd);
-    }
+// Closes the pipe to the CGI child's stdin, which then sees the end of the
+// body.
+void closeCgiStdin(Conn *c) {
+    unwatchFd(c->w, tagConn(c, TagCgiStdin));
+    close(c->cgiStdin);
+    c->cgiStdin = -1;
 }
 
-int readHeader(FILE *r, char **buf, size_t *buflen, char **value) {
-    ssize_t nread = getline(buf, buflen, r);
-    if (nread <= 0) {
-        return -1;
-    }
-    if (nread == 2) {
-        if (**buf == '\r') {
+void closeCgiStdout(Conn *c) {
+    unwatchFd(c->w, tagConn(c, TagCgiStdout));
+    close(c->cgiStdout);
+    c->cgiStdout = -1;
+}
+
+// Writes the request body to the CGI child, reading more from the socket
+// as needed. Returns 1 once the body is through or the child stopped
+// reading it, 0 to wait for the socket or the pipe.
+int pumpCgiBody(Conn *c) {
+    while (true) {
+        if (c->cgiInOff < c->cgiInEnd) {
+            ssize_t r = write(c->cgiStdin, c->in + c->cgiInOff,
+                              c->cgiInEnd - c->cgiInOff);
+            if (r < 0) {
+                if (errno == EAGAIN or errno == EWOULDBLOCK) {
+                    return 0;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                break; // EPIPE: the child does not want the rest
+            }
+            c->cgiInOff += r;
+            continue;
+        }
+        if (c->cgiBodyLeft == 0) {
+            // keep what follows the body for resetRequest()
+            c->inLen -= c->cgiInEnd;
+            memmove(c->in, c->in + c->cgiInEnd, c->inLen);
+            c->cgiInOff = c->cgiInEnd = 0;
+            closeCgiStdin(c);
             return 1;
         }
+        size_t want = InputBufferSize;
+        if ((ssize_t)want > c->cgiBodyLeft) {
+            want = c->cgiBodyLeft;
+        }
+        ssize_t r = recv(c->fd, c->in, want, MSG_DONTWAIT);
+        if (r < 0) {
+            if (errno == EAGAIN or errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (r == 0) {
+            break;
+        }
+        c->inLen = c->cgiInEnd = r;
+        c->cgiInOff = 0;
+        c->cgiBodyLeft -= r;
     }
-    int i = 0;
-    for (; i < nread; i++) {
-        if ((*buf)[i] == ':') {
+    // the rest of the body is left unread on the socket
+    c->keepAlive = false;
+    closeCgiStdin(c);
+    return 1;
+}
+
+// Largest CGI header block; output without a blank line by then is an
+// error.
+static const size_t CgiHeadMax = 8192;
+
+// Splits CGI output into the response status and the headers to pass on:
+// a Status header replaces the status line, and the headers framing the
+// body are left to the server. Leaves the body in *out. Returns false if
+// out does not start with a complete header block.
+bool parseCgiHeaders(std::string_view *out, std::string *status,
+                     std::string *headers) {
+    *status = StatusOK;
+    headers->clear();
+    std::string_view rest = *out;
+    while (true) {
+        size_t nl = rest.find('\n');
+        if (nl == std::string_view::npos) {
+            return false;
+        }
+        std::string_view line = rest.substr(0, nl);
+        rest.remove_prefix(nl + 1);
+        if (!line.empty() and line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        if (line.empty()) {
             break;
         }
+        size_t colon = line.find(':');
+        if (colon == std::string_view::npos) {
+            continue;
+        }
+        std::string_view name = line.substr(0, colon);
+        if (equalsIgnoreCase(name, "Status")) {
+            *status = trimSpace(line.substr(colon + 1));
+        } else if (!equalsIgnoreCase(name, "Content-Length") and
+                   !equalsIgnoreCase(name, "Transfer-Encoding") and
+                   !equalsIgnoreCase(name, "Connection")) {
+            headers->append(line);
+            *headers += "\r\n";
+        }
     }
-    if (i == nread) {
-        return -1;
+    *out = rest;
+    return true;
+}
+
+// Releases what is left of a CGI child whose response is complete; the
+// child itself is reaped by reapChildren().
+static void finishCgi(Conn *c) {
+    if (c->cgiStdin != -1) {
+        c->keepAlive = false; // the rest of the body is still on its way
+        closeCgiStdin(c);
     }
-    (*buf)[i] = 0;
-    for (i++; i < nread; i++) {
-        if ((*buf)[i] != ' ') {
+    if (c->cgiStdout != -1) {
+        closeCgiStdout(c);
+    }
+    if (c->cgiPid) {
+        phaseEnd(c->w, PhaseCgiWait, c->fd, c->cgiStart);
+    }
+    c->cgiHead.clear();
+    c->cgiPid = 0;
+    c->w->cgiRunning--;
+    c->state = StateDrain;
+}
+
+// Reads the child's output up to the end of its CGI headers and queues the
+// response head. Output that already ended there is answered with a
+// Content-Length, anything else is streamed by streamCgiOutput(). Returns
+// 1 when the head is queued, 0 to wait for the child.
+static int readCgiHead(Conn *c) {
+    bool eof = false;
+    while (c->cgiHead.size() < CgiHeadMax) {
+        char buf[4096];
+        ssize_t r = read(c->cgiStdout, buf, sizeof buf);
+        if (r > 0) {
+            c->cgiHead.append(buf, r);
+            continue;
+        }
+        if (r < 0 and errno == EINTR) {
+            continue;
+        }
+        if (r < 0 and (errno == EAGAIN or errno == EWOULDBLOCK)) {
             break;
         }
+        eof = true;
+        break;
     }
-    *value = *buf + i;
-    for (int j = nread - 1; j > i; j--) {
-        if ((*buf)[j] != '\r' and (*buf)[j] != '\n') {
-            break;
+    std::string_view body = c->cgiHead;
+    std::string status, headers;
+    if (!parseCgiHeaders(&body, &status, &headers)) {
+        if (!eof and c->cgiHead.size() < CgiHeadMax) {
+            return 0;
         }
-        (*buf)[j] = 0;
+        c->keepAlive = false;
+        statusResponse(c, StatusBadGateway, "malformed CGI output", false);
+        finishCgi(c);
+        return 1;
     }
-    return 0;
+    c->cgiStreaming = true;
+    if (eof) {
+        writeHeader(c, status.c_str(), body.size(), headers.c_str());
+        appendBody(c, body);
+        finishCgi(c);
+        return 1;
+    }
+    // HTTP/1.0 clients get a body delimited by the end of the connection
+    writeHeader(c, status.c_str(), c->cgiChunked ? Chunked : -1,
+                headers.c_str());
+    if (c->head) {
+        finishCgi(c); // the rest of the output is not sent
+        return 1;
+    }
+    if (!body.empty()) {
+        if (c->cgiChunked) {
+            appendf(&c->out, "%zx\r\n", body.size());
+        }
+        c->out.append(body);
+        c->cgiTrailer = c->cgiChunked;
+    }
+    c->cgiHead.clear();
+    return 1;
 }
 
-void handle(int csock, sockaddr_in caddr) {
-    char *method;
-    ssize_t nread;
-    char *query;
-    char localDir[] = "./";
-    FILE *r = fdopen(csock, "r");
-    ssize_t contentLength = -1;
-    setbuf(r, 0);
-    {
-        size_t mlen = 0;
-        if (-1 == (nread = getdelim(&method, &mlen, ' ', r))) {
-            if (!mlen) {
-                free(method);
-            }
-            statusResponse(csock, StatusBadRequest, "", false);
-            goto cleanup;
-        }
-    }
-    method[nread - 1] = 0; // clear the delimeter
-    char *pathbuf;
-    char *path;
-    path = (char *)malloc(2);
-    {
-        size_t plen = 0;
-        if (-1 == (nread = getdelim(&pathbuf, &plen, ' ', r))) {
-            if (plen) {
-                free(pathbuf);
+static void consumeOutput(Conn *c, size_t r);
+
+// Moves the child's output to the client. Whatever the pipe holds becomes
+// one chunk, which is spliced from the pipe into the socket without
+// passing through user space. Returns 1 once the output ended and all of
+// it is sent, 0 to wait for the socket or the child.
+static int streamCgiOutput(Conn *c) {
+    while (true) {
+        if (c->outOff < c->out.size()) {
+            // hold back a partial segment when a chunk follows right away
+            ssize_t r = send(c->fd, &c->out[c->outOff],
+                             c->out.size() - c->outOff,
+                             c->cgiChunkLeft > 0 ? MSG_MORE : 0);
+            if (r < 0) {
+                if (errno == EAGAIN or errno == EWOULDBLOCK) {
+                    return 0;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
             }
-            free(pathbuf);
-            statusResponse(csock, StatusBadRequest, "", false);
-            goto cleanup;
-        }
-        path = pathbuf;
-    }
-    {
-        char *buf = 0;
-        size_t buflen = 0;
-        char *value;
-        if (-1 != getline(&buf, &buflen, r)) {
-            while (true) {
-                int status = readHeader(r, &buf, &buflen, &value);
-                if (status) {
-                    free(buf);
-                    break;
+            consumeOutput(c, r);
+            continue;
+        }
+        c->out.clear();
+        c->outOff = 0;
+        if (c->cgiChunkLeft > 0) {
+            ssize_t r = splice(c->cgiStdout, NULL, c->fd, NULL,
+                               c->cgiChunkLeft,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK |
+                                   (c->cgiChunked ? SPLICE_F_MORE : 0));
+            if (r < 0) {
+                // the pipe holds the chunk, so it is the socket that is full
+                if (errno == EAGAIN) {
+                    return 0;
                 }
-                if (0 == strcmp(buf, "Content-Length")) {
-                    errno = 0;
-                    contentLength = strtol(value, 0, 10);
-                    if (errno or contentLength < 0) {
-                        statusResponse(csock, StatusBadRequest, "invalid Content-Length header");
-                        goto cleanup;
-                    }
+                if (errno == EINTR) {
+                    continue;
                 }
-                // fprintf(stderr, "%s: %s\n", buf, value);
+                return -1;
+            }
+            if (r == 0) {
+                return -1;
+            }
+            metricAdd(&c->w->metrics.bytesSent, r);
+            c->sent += r;
+            c->cgiChunkLeft -= r;
+            c->cgiTrailer = c->cgiChunked and c->cgiChunkLeft == 0;
+            continue;
+        }
+        if (c->cgiStdout == -1) {
+            return 1;
+        }
+        // frame what the pipe holds behind the trailer of the last chunk
+        const char *crlf = c->cgiTrailer ? "\r\n" : "";
+        c->cgiTrailer = false;
+        int n = 0;
+        if (-1 == ioctl(c->cgiStdout, FIONREAD, &n)) {
+            n = 0;
+        }
+        if (n > 0) {
+            if (c->cgiChunked) {
+                appendf(&c->out, "%s%x\r\n", crlf, n);
             }
+            c->cgiChunkLeft = n;
+            continue;
         }
+        // an empty pipe: see whether the output ended
+        char buf[4096];
+        ssize_t r = read(c->cgiStdout, buf, sizeof buf);
+        if (r > 0) {
+            if (c->cgiChunked) {
+                appendf(&c->out, "%s%zx\r\n", crlf, (size_t)r);
+            }
+            c->out.append(buf, r); // written since FIONREAD looked
+            c->cgiTrailer = c->cgiChunked;
+            continue;
+        }
+        c->out += crlf;
+        if (r == 0) {
+            closeCgiStdout(c);
+            if (c->cgiChunked) {
+                c->out += "0\r\n\r\n";
+            }
+            continue;
+        }
+        if (errno == EINTR or c->outOff < c->out.size()) {
+            continue;
+        }
+        return errno == EAGAIN ? 0 : -1;
     }
-    if (0 == strcmp("POST", method) and contentLength == -1) {
-        statusResponse(csock, StatusBadRequest, "POST without Content-Length header unsupported");
-        goto cleanup;
+}
+
+// Handles StateCgiRun: pumps the request body into the child and its
+// output to the client. Moves on to StateDrain, with nothing left to
+// send, once the response is complete.
+int stepCgiRun(Conn *c) {
+    if (c->cgiStdin != -1) {
+        pumpCgiBody(c);
     }
-    path[nread - 1] = 0; // clear the delimeter
-    query = cleanupPath(path, nread);
-    if (strlen(path) == 0) {
-        path = localDir;
+    if (!c->cgiStreaming) {
+        int r = readCgiHead(c);
+        if (r != 1 or c->state != StateCgiRun) {
+            return r;
+        }
     }
-    fprintf(stderr, "%s %s\n", method, path);
-    {
-        struct stat st;
-        if (-1 == stat(path, &st)) {
-            if (errno == ENOENT) {
-                statusResponse(csock, StatusForbidden);
-            } else {
-                statusResponse(csock, StatusNotFound);
+    int r = streamCgiOutput(c);
+    if (r == 1) {
+        finishCgi(c);
+    }
+    return r;
+}
+
+// Empties fd, w's signalfd or childWake, and collects the children of w
+// that exited. A SIGCHLD read from the signalfd may be for the children of
+// any worker, so the other workers are woken to look for theirs.
+void reapChildren(Worker *w, int fd) {
+    struct signalfd_siginfo si[8];
+    bool signaled = false;
+    while (read(fd, si, sizeof si) > 0) {
+        signaled = fd == w->childFd;
+    }
+    for (int i = 0; signaled and i < numWorkers; i++) {
+        uint64_t one = 1;
+        if (&allWorkers[i] != w) {
+            write(allWorkers[i].childWake, &one, sizeof one);
+        }
+    }
+    for (size_t i = 0; i < w->children.size();) {
+        int status;
+        pid_t pid = waitpid(w->children[i], &status, WNOHANG);
+        if (pid == 0) {
+            i++;
+            continue;
+        }
+        w->children[i] = w->children.back();
+        w->children.pop_back();
+        if (pid == -1) {
+            continue;
+        }
+        if (WIFEXITED(status)) {
+            if (WEXITSTATUS(status)) {
+                fprintf(stderr, "  CGI %d exit status %d\n", pid,
+                        WEXITSTATUS(status));
             }
-            goto cleanup;
-        }
-        if (S_ISDIR(st.st_mode)) {
-            if (path[strlen(path) - 1] == '/') {
-                char *indexHtml;
-                asprintf(&indexHtml, "%sindex.html", path);
-                int ifd = open(indexHtml, O_RDONLY);
-                if (ifd != -1) {
-                    writeHeader(csock, StatusOK);
-                    sendfile(csock, ifd, 0, 0x7ffff000);
-                    close(ifd);
-                } else {
-                    if (errno == ENOENT) {
-                        handleDirListing(csock, path);
-                    } else {
-                        statusResponse(csock, StatusForbidden,
-                                       "index.html not readable");
-                    }
+        } else if (WIFSIGNALED(status)) {
+            fprintf(stderr, "  CGI %d exit signal %d: %s\n", pid,
+                    WTERMSIG(status), strsignal(WTERMSIG(status)));
+        } else {
+            fprintf(stderr, "  CGI %d unknown status %d\n", pid, status);
+        }
+    }
+}
+
+CgiPool *findCgiPool(Worker *w, const char *path) {
+    for (CgiPool &pool : w->pools) {
+        if (pool.path == path) {
+            return &pool;
+        }
+    }
+    return NULL;
+}
+
+// Returns the pool process an epoll event pointer refers to, if any.
+CgiProc *findCgiProc(Worker *w, void *ptr) {
+    for (CgiPool &pool : w->pools) {
+        CgiProc *first = pool.procs.data();
+        if (ptr >= first and ptr < first + pool.procs.size()) {
+            return (CgiProc *)ptr;
+        }
+    }
+    return NULL;
+}
+
+// Turns the output of a pool process into the response. The CGI headers
+// are passed on, except that a Status header replaces the status line.
+void respondCgiOutput(Conn *c, std::string_view out) {
+    std::string status, headers;
+    if (!parseCgiHeaders(&out, &status, &headers)) {
+        statusResponse(c, StatusBadGateway, "malformed CGI output", false);
+        return;
+    }
+    writeHeader(c, status.c_str(), out.size(), headers.c_str());
+    appendBody(c, out);
+}
+
+void advance(Conn *c);
+
+void failPooledCGI(Conn *c) {
+    statusResponse(c, StatusBadGateway, "CGI pool process failed", false);
+    c->state = StateDrain;
+    advance(c);
+}
+
+// Returns an idle process of pool, restarting dead processes at most once
+// a second. *alive tells whether any process is running.
+CgiProc *idleCgiProc(CgiPool *pool, bool *alive) {
+    long now = nowMs();
+    CgiProc *idle = NULL;
+    *alive = false;
+    for (CgiProc &p : pool->procs) {
+        if (p.fd == -1 and now - p.spawned >= 1000) {
+            p.spawned = now;
+            long spawnStart = nowUs();
+            int r = cgiProcSpawn(&p);
+            metricsCgiSpawn(&pool->w->metrics, nowUs() - spawnStart);
+            if (r == 0) {
+                pool->w->children.push_back(p.pid);
+                if (-1 == watchFd(pool->w, p.fd,
+                                  EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                                  &p)) {
+                    perror("epoll_ctl() failed");
+                    kill(p.pid, SIGTERM);
+                    close(p.fd);
+                    p.fd = -1;
                 }
-                free(indexHtml);
-            } else {
-                handleDirRedirect(csock, path);
             }
-        } else {
-            if (0 == access(path, X_OK)) {
-                handleCGI(csock, method, path, query, contentLength);
+        }
+        if (p.fd == -1) {
+            continue;
+        }
+        *alive = true;
+        if (!p.busy and idle == NULL) {
+            idle = &p;
+        }
+    }
+    return idle;
+}
+
+// Writes as much of the pending request to p as the socket takes.
+// Returns -1 if the process is gone.
+int writeCgiProc(CgiProc *p) {
+    while (p->sendOff < p->send.size()) {
+        ssize_t r = write(p->fd, p->send.data() + p->sendOff,
+                          p->send.size() - p->sendOff);
+        if (r < 0) {
+            if (errno == EAGAIN or errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno != EINTR) {
+                return -1;
+            }
+            continue;
+        }
+        p->sendOff += r;
+    }
+    return 0;
+}
+
+// Sends the request of c to p. The answer, or the process dying, is seen
+// by runCgiProc() on a later event, so c is never resumed from here.
+void startCgiProc(CgiProc *p, Conn *c) {
+    p->busy = true;
+    p->conn = c;
+    p->send = std::move(c->cgiRequest);
+    p->sendOff = 0;
+    p->recv.clear();
+    c->cgiRequest.clear();
+    c->cgiProc = p;
+    writeCgiProc(p);
+}
+
+// Hands the request of c to an idle process of pool, or queues c. Returns
+// false if none of the pool's processes is running.
+bool dispatchCGI(Conn *c, CgiPool *pool) {
+    bool alive;
+    CgiProc *p = idleCgiProc(pool, &alive);
+    if (p) {
+        startCgiProc(p, c);
+        return true;
+    }
+    if (!alive) {
+        return false;
+    }
+    pool->waiting.push_back(c);
+    return true;
+}
+
+// Starts the next queued request after a process of pool became idle or
+// died; queued requests fail once no process is left.
+void cgiPoolNext(CgiPool *pool) {
+    while (!pool->waiting.empty()) {
+        bool alive;
+        CgiProc *p = idleCgiProc(pool, &alive);
+        if (p == NULL and alive) {
+            return;
+        }
+        Conn *c = pool->waiting.front();
+        pool->waiting.pop_front();
+        if (p) {
+            startCgiProc(p, c);
+            return;
+        }
+        failPooledCGI(c);
+    }
+}
+
+void cgiProcDied(CgiProc *p) {
+    kill(p->pid, SIGTERM); // reapChildren() collects it
+    unwatchFd(p->pool->w, p);
+    close(p->fd);
+    p->fd = -1;
+    p->busy = false;
+    Conn *c = p->conn;
+    p->conn = NULL;
+    if (c) {
+        c->cgiProc = NULL;
+    }
+    cgiPoolNext(p->pool);
+    if (c) {
+        failPooledCGI(c);
+    }
+}
+
+// Handles an event of a pool process: writes the rest of the request and
+// reads the answer, resuming the connection once it is complete.
+void runCgiProc(CgiProc *p) {
+    if (p->fd == -1) {
+        return;
+    }
+    if (-1 == writeCgiProc(p)) {
+        cgiProcDied(p);
+        return;
+    }
+    bool eof = false;
+    char buf[65536];
+    while (true) {
+        ssize_t r = read(p->fd, buf, sizeof buf);
+        if (r > 0) {
+            p->recv.append(buf, r);
+        } else if (r == 0) {
+            eof = true;
+            break;
+        } else if (errno == EAGAIN or errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            eof = true;
+            break;
+        }
+    }
+    bool bad = false;
+    std::string_view out;
+    if (p->busy) {
+        out = cgiResponseOutput(p->recv, &bad);
+    } else {
+        bad = !p->recv.empty();
+    }
+    if (bad) {
+        fprintf(stderr, "  CGI pool %s: malformed answer from pid %d\n",
+                p->pool->path.c_str(), p->pid);
+        cgiProcDied(p);
+        return;
+    }
+    if (out.data() == NULL) {
+        if (eof) {
+            cgiProcDied(p);
+        }
+        return;
+    }
+    std::string frame = std::move(p->recv);
+    p->recv.clear();
+    p->send.clear();
+    p->busy = false;
+    Conn *c = p->conn;
+    p->conn = NULL;
+    if (eof) {
+        unwatchFd(p->pool->w, p);
+        close(p->fd);
+        p->fd = -1;
+    }
+    cgiPoolNext(p->pool);
+    if (c) {
+        c->cgiProc = NULL;
+        respondCgiOutput(c, cgiResponseOutput(frame, &bad));
+        c->state = StateDrain;
+        advance(c);
+    }
+}
+
+// Builds the request frame for a pooled CGI script; the part of the body
+// that is not buffered yet is read by stepCgiBody().
+void handlePooledCGI(Conn *c, CgiPool *pool, const char *method,
+                     const char *query) {
+    c->handler = HandlerCgi;
+    size_t bodyLen = c->contentLength > 0 ? c->contentLength : 0;
+    cgiRequestHead(&c->cgiRequest, method, query, bodyLen);
+    c->cgiRequestSize = c->cgiRequest.size() + bodyLen;
+    size_t buffered = c->inLen - c->req.length;
+    if (buffered > bodyLen) {
+        buffered = bodyLen;
+    }
+    c->cgiRequest.append(c->in + c->req.length, buffered);
+    // the request is consumed here rather than by resetRequest(), which
+    // keeps what follows the body as the next request
+    size_t used = c->req.length + buffered;
+    c->inLen -= used;
+    memmove(c->in, c->in + used, c->inLen);
+    c->req.length = 0;
+    c->contentLength = -1;
+    c->cgiPool = pool;
+    c->state = StateCgiBody;
+}
+
+// Queues a buffer that is written after c->out. It must stay valid until
+// the response is drained, e.g. by being owned by c->cached.
+void queueSegment(Conn *c, const void *p, size_t n) {
+    c->pieces.push_back(Piece{(const char *)p, 0, (off_t)n});
+}
+
+// Queues the bytes [first, last] of c->file, or of mem if it is not NULL.
+void queueRange(Conn *c, const char *mem, off_t first, off_t last) {
+    c->pieces.push_back(Piece{mem, first, last + 1});
+}
+
+// Lists the directory path, whose metadata is st, a page at a time; see
+// dirlist.cc.
+void handleDirListing(Conn *c, char *path, const struct stat &st,
+                      const char *query) {
+    c->handler = HandlerDir;
+    std::shared_ptr<DirListing> d = dirCacheGet(&c->w->dirs, path, st);
+    if (d == nullptr) {
+        statusResponse(c, StatusNotFound, "directory not readable");
+        return;
+    }
+    const char *urlPath =
+        arenaConcat(&c->arena, "/", strcmp(path, "./") ? path : "");
+    std::string body;
+    std::string_view page = dirListingPage(d.get(), urlPath, query, &body);
+    writeHeader(c, StatusOK, page.size(),
+                "Content-Type: text/html; charset=utf-8\r\n");
+    if (page.data() == body.data()) {
+        appendBody(c, body);
+    } else if (!c->head) {
+        c->dir = d;
+        queueSegment(c, page.data(), page.size());
+    }
+}
+
+// Reports whether a GET carries validators matching the file, so that it
+// is answered with 304. If-None-Match takes precedence over
+// If-Modified-Since.
+bool isNotModified(Conn *c, std::string_view etag, time_t mtime) {
+    if (c->req.method != "GET") {
+        return false;
+    }
+    std::string_view inm = httpHeader(&c->req, "If-None-Match");
+    if (inm.data()) {
+        return etagMatches(inm, etag);
+    }
+    std::string_view ims = httpHeader(&c->req, "If-Modified-Since");
+    if (ims.data()) {
+        time_t t = parseHttpDate(ims);
+        return t != -1 and mtime <= t;
+    }
+    return false;
+}
+
+// Answers a GET with a Range header for the file of the given size, whose
+// contents are either mem or c->file. Returns false, with nothing queued,
+// if the whole file should be sent instead.
+bool serveRanges(Conn *c, const char *mem, off_t size, const char *etag,
+                 time_t mtime, const char *validators) {
+    std::string_view range = httpHeader(&c->req, "Range");
+    if (!range.data() or c->req.method != "GET") {
+        return false;
+    }
+    // If-Range: only honor the ranges if the client's copy is current
+    std::string_view ifRange = httpHeader(&c->req, "If-Range");
+    if (ifRange.data()) {
+        if (ifRange.substr(0, 1) == "\"" ? ifRange != etag
+                                          : parseHttpDate(ifRange) != mtime) {
+            return false;
+        }
+    }
+    ByteRange ranges[MaxRanges];
+    int n = parseRange(range, size, ranges, MaxRanges);
+    if (n < 0) {
+        return false;
+    }
+    char hdr[512];
+    if (n == 0) {
+        snprintf(hdr, sizeof hdr, "Content-Range: bytes */%lld\r\n",
+                 (long long)size);
+        writeHeader(c, StatusRangeNotSatisfiable, 0, hdr);
+        return true;
+    }
+    if (n == 1) {
+        snprintf(hdr, sizeof hdr, "Content-Range: bytes %lld-%lld/%lld\r\n%s",
+                 (long long)ranges[0].first, (long long)ranges[0].last,
+                 (long long)size, validators);
+        writeHeader(c, StatusPartialContent,
+                    ranges[0].last - ranges[0].first + 1, hdr);
+        queueRange(c, mem, ranges[0].first, ranges[0].last);
+        return true;
+    }
+    char boundary[32];
+    snprintf(boundary, sizeof boundary, "%016lx%08x", (unsigned long)random(),
+             (unsigned)c->requests);
+    // the file's Content-Type, which leads validators, goes in the parts
+    std::string_view type;
+    if (0 == strncmp(validators, "Content-Type:", 13)) {
+        const char *end = strstr(validators, "\r\n") + 2;
+        type = std::string_view(validators, end - validators);
+        validators = end;
+    }
+    // The framing is built completely before queueing pieces into it, so
+    // that c->parts is not reallocated under them.
+    std::vector<size_t> offsets;
+    for (int i = 0; i < n; i++) {
+        offsets.push_back(c->parts.size());
+        appendf(&c->parts,
+                "\r\n--%s\r\n%.*sContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                boundary, (int)type.size(), type.data(),
+                (long long)ranges[i].first, (long long)ranges[i].last,
+                (long long)size);
+    }
+    offsets.push_back(c->parts.size());
+    appendf(&c->parts, "\r\n--%s--\r\n", boundary);
+    off_t length = c->parts.size();
+    for (int i = 0; i < n; i++) {
+        length += ranges[i].last - ranges[i].first + 1;
+    }
+    snprintf(hdr, sizeof hdr,
+             "Content-Type: multipart/byteranges; boundary=%s\r\n%s",
+             boundary, validators);
+    writeHeader(c, StatusPartialContent, length, hdr);
+    for (int i = 0; i < n; i++) {
+        queueSegment(c, c->parts.data() + offsets[i],
+                     offsets[i + 1] - offsets[i]);
+        queueRange(c, mem, ranges[i].first, ranges[i].last);
+    }
+    queueSegment(c, c->parts.data() + offsets[n],
+                 c->parts.size() - offsets[n]);
+    return true;
+}
+
+void serveCached(Conn *c, std::shared_ptr<CachedFile> f) {
+    c->cached = f;
+    if (httpHeader(&c->req, "Range").data()) {
+        // keep the lines of the cached header after Content-Length
+        size_t v = f->head.find("\r\n", f->head.find("Content-Length:")) + 2;
+        if (serveRanges(c, f->body.data(), f->body.size(), f->etag.c_str(),
+                        f->mtime, f->head.c_str() + v)) {
+            return;
+        }
+    }
+    bool notModified = isNotModified(c, f->etag, f->mtime);
+    c->status = notModified ? 304 : 200;
+    if (notModified) {
+        queueSegment(c, f->notModifiedHead.data(), f->notModifiedHead.size());
+    } else {
+        queueSegment(c, f->head.data(), f->head.size());
+    }
+    if (c->keepAlive) {
+        queueSegment(c, ConnectionKeepAlive, strlen(ConnectionKeepAlive));
+    } else {
+        queueSegment(c, ConnectionClose, strlen(ConnectionClose));
+    }
+    if (!notModified and !c->head) {
+        queueSegment(c, f->body.data(), f->body.size());
+    }
+}
+
+// Answers a request for path from the bundle, the way serve() would from
+// the directory it was packed from.
+void serveBundled(Conn *c, char *path) {
+    std::string_view key = strcmp(path, "./") ? path : "";
+    const BundleEntry *e = bundleLookup(bundle, key);
+    if (e == NULL) {
+        statusResponse(c, StatusForbidden);
+        return;
+    }
+    if (e->kind == BundleDir) {
+        handleDirRedirect(c, path);
+        return;
+    }
+    const BundleVariant &v = c->acceptGzip and e->hasGzip ? e->gzip : e->plain;
+    std::string_view body = bundleBytes(bundle, v.body);
+    std::string_view head = bundleBytes(bundle, v.head);
+    std::string_view etag = bundleBytes(bundle, v.etag);
+    if (httpHeader(&c->req, "Range").data()) {
+        size_t after = head.find("\r\n", head.find("Content-Length:")) + 2;
+        if (serveRanges(c, body.data(), body.size(), etag.data(), v.mtime,
+                        head.data() + after)) {
+            return;
+        }
+    }
+    bool notModified = isNotModified(c, etag, v.mtime);
+    c->status = notModified ? 304 : 200;
+    if (notModified) {
+        head = bundleBytes(bundle, v.notModifiedHead);
+    }
+    queueSegment(c, head.data(), head.size());
+    if (c->keepAlive) {
+        queueSegment(c, ConnectionKeepAlive, strlen(ConnectionKeepAlive));
+    } else {
+        queueSegment(c, ConnectionClose, strlen(ConnectionClose));
+    }
+    if (notModified or c->head or body.empty()) {
+        return;
+    }
+    if (body.size() < BundleSendfileSize) {
+        queueSegment(c, body.data(), body.size());
+    } else {
+        c->file = bundle->file;
+        queueRange(c, NULL, v.body.off, v.body.off + v.body.len - 1);
+    }
+}
+
+// Queues the regular file pi, looked up from path, as the response. Small
+// files are added to the worker's cache under key and served from memory.
+// extra is added to the response headers.
+void sendFileAs(Conn *c, std::string_view key, const char *path,
+                std::shared_ptr<PathInfo> pi, const char *extra) {
+    std::shared_ptr<CachedFile> f =
+        fileCacheInsert(&c->w->cache, key, path, pi->fd, pi->st, extra);
+    if (f) {
+        serveCached(c, f);
+        return;
+    }
+    char etag[64], date[32], hdr[512];
+    formatETag(etag, pi->st);
+    formatHttpDate(date, pi->st.st_mtime);
+    snprintf(hdr, sizeof hdr,
+             "%sAccept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\n",
+             extra, etag, date);
+    if (isNotModified(c, etag, pi->st.st_mtime)) {
+        writeHeader(c, StatusNotModified, NoBody, hdr);
+        return;
+    }
+    c->file = pi;
+    if (serveRanges(c, NULL, pi->st.st_size, etag, pi->st.st_mtime, hdr)) {
+        return;
+    }
+    writeHeader(c, StatusOK, pi->st.st_size, hdr);
+    if (pi->st.st_size > 0 and !c->head) {
+        queueRange(c, NULL, 0, pi->st.st_size - 1);
+    }
+}
+
+// Compresses the file pi into the worker's gzip cache and queues the
+// result with the headers extra. Returns false if the compressed file
+// could not be cached; pi is then marked, so that requests for it do not
+// read and compress it again until its path cache entry expires.
+bool sendCompressed(Conn *c, std::string_view key, const char *path,
+                    std::shared_ptr<PathInfo> pi, const char *extra) {
+    FileCache *gz = &c->w->gzcache;
+    pi->noGzip = true;
+    int wd = fileCacheWatch(gz, key, path);
+    if (wd == -1) {
+        return false;
+    }
+    std::string body(pi->st.st_size, 0);
+    size_t got = 0;
+    while (got < body.size()) {
+        ssize_t r = pread(pi->fd, &body[got], body.size() - got, got);
+        if (r <= 0) {
+            fileCacheUnwatch(gz, wd);
+            return false;
+        }
+        got += r;
+    }
+    std::string compressed;
+    if (!gzipCompress(body.data(), body.size(), &compressed)) {
+        fileCacheUnwatch(gz, wd);
+        return false;
+    }
+    std::shared_ptr<CachedFile> f = fileCacheStore(
+        gz, key, wd, std::move(compressed), pi->st, extra, "-gz");
+    if (!f) {
+        return false;
+    }
+    pi->noGzip = false;
+    serveCached(c, f);
+    return true;
+}
+
+// Queues the regular file pi, looked up from path, as the response,
+// choosing between the file, a precompressed path.gz next to it and, with
+// --gzip, a copy compressed on the fly. key names the file in the caches.
+void sendFile(Conn *c, const char *key, const char *path,
+              std::shared_ptr<PathInfo> pi) {
+    const char *gzPath = arenaConcat(&c->arena, path, ".gz");
+    std::shared_ptr<PathInfo> gpi =
+        statCacheGet(&c->w->stats, gzPath, nowMs());
+    bool sidecar = gpi->fd != -1 and S_ISREG(gpi->st.st_mode) and
+                   gpi->st.st_mtime >= pi->st.st_mtime;
+    // only what the gzip cache can keep is compressed: anything larger
+    // would be read and compressed again by every request
+    off_t maxSize = std::min<off_t>(MaxCompressSize,
+                                    fileCacheMaxFileSize(&c->w->gzcache));
+    bool onTheFly = !sidecar and c->w->gzcache.inotifyFd != -1 and
+                    !pi->noGzip and isCompressible(path) and
+                    pi->st.st_size >= MinCompressSize and
+                    pi->st.st_size <= maxSize;
+    const char *type = contentTypeHeader(path);
+    if (c->acceptGzip and (sidecar or onTheFly)) {
+        const char *extra = arenaConcat(&c->arena, type, GzipHeaders);
+        if (sidecar) {
+            sendFileAs(c, arenaConcat(&c->arena, key, "\ngzip"), gzPath, gpi,
+                       extra);
+            return;
+        }
+        if (sendCompressed(c, key, path, pi, extra)) {
+            return;
+        }
+    }
+    sendFileAs(c, key, path, pi,
+               arenaConcat(&c->arena, type,
+                           sidecar or onTheFly ? "Vary: Accept-Encoding\r\n"
+                                               : ""));
+    if (c->cached and (sidecar or onTheFly)) {
+        c->cached->hasVariant = true;
+    }
+}
+
+void handleStatic(Conn *c, char *path, std::shared_ptr<PathInfo> pi) {
+    if (pi->fd == -1) {
+        errno = pi->openErr;
+        if (errno == ENOENT) {
+            statusResponse(c, StatusForbidden);
+        } else {
+            statusResponse(c, StatusNotFound);
+        }
+    } else {
+        sendFile(c, path, path, pi);
+    }
+}
+
+// Reads what is available on the socket into c->in, as long as it fits.
+// Returns -1 on a socket error.
+int fillInput(Conn *c) {
+    if (c->w->ring) {
+        return 0; // ringReceived() fills the buffer instead
+    }
+    if (c->in == NULL) {
+        c->in = (char *)malloc(InputBufferSize);
+    }
+    while (!c->eof and c->inLen < InputBufferSize) {
+        ssize_t r = read(c->fd, c->in + c->inLen, InputBufferSize - c->inLen);
+        if (r > 0) {
+            c->inLen += r;
+        } else if (r == 0) {
+            c->eof = true;
+        } else {
+            if (errno == EAGAIN or errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno != EINTR) {
+                return -1;
+            }
+        }
+    }
+    c->inPending = c->inLen == InputBufferSize;
+    if (c->inLen == 0) {
+        // idle connections do not hold on to a buffer
+        free(c->in);
+        c->in = NULL;
+    }
+    return 0;
+}
+
+// Step functions return 1 when the state is done, 0 when they need to wait
+// for the socket and -1 when the connection should be closed.
+
+// Handles both StateRequestLine and StateHeaders.
+int stepParse(Conn *c) {
+    if (c->in == NULL or c->inLen == 0) {
+        return c->eof ? -1 : 0; // nothing sent yet
+    }
+    HttpRequest *req = &c->req;
+    size_t limit = opts.maxHeaderBytes;
+    if (limit > InputBufferSize) {
+        limit = InputBufferSize;
+    }
+    int status = ParseDone;
+    if (!req->sawRequestLine) {
+        uint64_t start = phaseBegin(PhaseRequestLine, c->fd);
+        status = httpParseRequestLine(req, c->in, c->inLen, limit);
+        phaseEnd(c->w, PhaseRequestLine, c->fd, start);
+    }
+    if (status == ParseDone) {
+        uint64_t start = phaseBegin(PhaseHeaders, c->fd);
+        status = httpParse(req, c->in, c->inLen, limit);
+        phaseEnd(c->w, PhaseHeaders, c->fd, start);
+    }
+    if (status == ParseIncomplete) {
+        if (req->sawRequestLine) {
+            c->state = StateHeaders;
+        }
+        if (!c->eof) {
+            return 0;
+        }
+        if (!req->sawRequestLine and req->scanned == c->inLen) {
+            return -1; // the client closed an idle connection
+        }
+        status = ParseBad;
+    }
+    c->parsedUs = nowUs();
+    if (status != ParseDone) {
+        c->keepAlive = false;
+        if (c->w->log and !req->method.empty()) {
+            c->logRequest.assign(req->method).append(" ");
+            c->logRequest.append(req->target);
+        }
+        if (status == ParseTooLarge) {
+            statusResponse(c, StatusRequestHeaderFieldsTooLarge, "", false);
+        } else {
+            statusResponse(c, StatusBadRequest, "", false);
+        }
+        c->state = StateDrain;
+        return 1;
+    }
+    // HTTP/1.1 connections are persistent unless a side asks otherwise
+    c->keepAlive = req->version == "HTTP/1.1";
+    std::string_view conn = httpHeader(req, "Connection");
+    if (equalsIgnoreCase(conn, "close")) {
+        c->keepAlive = false;
+    } else if (equalsIgnoreCase(conn, "keep-alive")) {
+        c->keepAlive = true;
+    }
+    ssize_t length = httpBodyLength(req);
+    if (length == BodyEncoded or length == BodyInvalid) {
+        // where the body ends is unknown, so nothing after it can be read
+        c->keepAlive = false;
+        if (length == BodyEncoded) {
+            statusResponse(c, StatusNotImplemented,
+                           "Transfer-Encoding unsupported", false);
+        } else {
+            errno = EINVAL;
+            statusResponse(c, StatusBadRequest,
+                           "invalid or conflicting Content-Length or "
+                           "Transfer-Encoding headers");
+        }
+        c->state = StateDrain;
+        return 1;
+    }
+    c->contentLength = length;
+    c->state = StateServe;
+    return 1;
+}
+
+// Reads the rest of a pooled CGI request's body into its frame and hands it
+// to the pool.
+int stepCgiBody(Conn *c) {
+    while (c->cgiRequest.size() < c->cgiRequestSize) {
+        size_t old = c->cgiRequest.size();
+        c->cgiRequest.resize(c->cgiRequestSize);
+        ssize_t r = read(c->fd, &c->cgiRequest[old], c->cgiRequestSize - old);
+        c->cgiRequest.resize(old + (r > 0 ? r : 0));
+        if (r == 0) {
+            return -1;
+        }
+        if (r < 0) {
+            if (errno == EAGAIN or errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno != EINTR) {
+                return -1;
+            }
+        }
+    }
+    c->state = StateCgiWait;
+    if (!dispatchCGI(c, c->cgiPool)) {
+        statusResponse(c, StatusBadGateway, "no CGI pool process", false);
+        c->state = StateDrain;
+        return 1;
+    }
+    return 0;
+}
+
+// Answers /server-status with the metrics of all workers, as JSON with
+// ?format=json or "Accept: application/json", else as Prometheus text.
+void handleServerStatus(Conn *c, const char *query) {
+    c->handler = HandlerStatus;
+    MetricsSnapshot snap;
+    metricsSnapshotInit(&snap);
+    long now = nowMs();
+    for (int i = 0; i < numWorkers; i++) {
+        metricsCollect(&snap, &allWorkers[i].metrics, now);
+    }
+    std::string body;
+    const char *type;
+    if (queryParam(query, "format") == "json" or
+        httpHeader(&c->req, "Accept").find("application/json") !=
+            std::string_view::npos) {
+        renderJson(&body, snap);
+        type = "Content-Type: application/json\r\n";
+    } else {
+        renderPrometheus(&body, snap);
+        type = "Content-Type: text/plain; version=0.0.4\r\n";
+    }
+    std::string headers = std::string(type) + "Cache-Control: no-store\r\n";
+    writeHeader(c, StatusOK, body.size(), headers.c_str());
+    appendBody(c, body);
+}
+
+void serve(Conn *c) {
+    c->state = StateDrain;
+    c->responseStart = c->w->now;
+    if (++c->requests >= opts.maxRequests) {
+        c->keepAlive = false;
+    }
+    bool keepAlive = c->keepAlive; // for CGI, which reads the body itself
+    if (c->contentLength > 0) {
+        // skip a body no handler but CGI reads, as long as it is buffered
+        size_t buffered = c->inLen - c->req.length;
+        if ((ssize_t)buffered < c->contentLength) {
+            c->keepAlive = false;
+        }
+    }
+    // Method and target are followed by a space in the buffer; terminate
+    // them in place.
+    char *method = (char *)c->req.method.data();
+    method[c->req.method.size()] = 0;
+    char *path = (char *)c->req.target.data();
+    path[c->req.target.size()] = 0;
+    c->head = 0 == strcmp("HEAD", method);
+    if (0 == strcmp("POST", method) and c->contentLength == -1) {
+        statusResponse(c, StatusBadRequest,
+                       "POST without Content-Length header unsupported");
+        return;
+    }
+    char localDir[] = "./";
+    uint64_t start = phaseBegin(PhaseCleanupPath, c->fd);
+    char *query = cleanupPath(path, c->req.target.size());
+    phaseEnd(c->w, PhaseCleanupPath, c->fd, start);
+    TRACE3(request_start, c->fd, method, path);
+    if (query == NULL) {
+        statusResponse(c, StatusBadRequest, "invalid path", false);
+        return;
+    }
+    if (strlen(path) == 0) {
+        path = localDir;
+    }
+    if (c->w->log) {
+        // kept, as the input buffer gets reused before the request is done
+        c->logRequest.assign(method).append(" /");
+        c->logRequest.append(path == localDir ? "" : path);
+    }
+    if (opts.serverStatus and 0 == strcmp(path, "server-status")) {
+        handleServerStatus(c, query);
+        return;
+    }
+    if (opts.maxQueuedBytes > 0 and c->w->queued >= opts.maxQueuedBytes) {
+        shedRequest(c, ShedBytes);
+        return;
+    }
+    c->acceptGzip = acceptsGzip(httpHeader(&c->req, "Accept-Encoding"));
+    if (bundle) {
+        serveBundled(c, path);
+        return;
+    }
+    if (c->acceptGzip) {
+        const char *key = arenaConcat(&c->arena, path, "\ngzip");
+        if (auto f = fileCacheLookup(&c->w->cache, key)) {
+            serveCached(c, f);
+            return;
+        }
+        if (auto f = fileCacheLookup(&c->w->gzcache, path)) {
+            serveCached(c, f);
+            return;
+        }
+    }
+    if (auto f = fileCacheLookup(&c->w->cache, path)) {
+        // with a compressed variant that is not cached, take the slow path
+        if (!(c->acceptGzip and f->hasVariant)) {
+            serveCached(c, f);
+            return;
+        }
+    }
+    long now = nowMs();
+    start = phaseBegin(PhaseStat, c->fd);
+    std::shared_ptr<PathInfo> pi = statCacheGet(&c->w->stats, path, now);
+    phaseEnd(c->w, PhaseStat, c->fd, start);
+    if (pi->err) {
+        errno = pi->err;
+        if (errno == ENOENT) {
+            statusResponse(c, StatusForbidden);
+        } else {
+            statusResponse(c, StatusNotFound);
+        }
+        return;
+    }
+    if (S_ISDIR(pi->st.st_mode)) {
+        if (path[strlen(path) - 1] == '/') {
+            const char *indexHtml = arenaConcat(&c->arena, path, "index.html");
+            std::shared_ptr<PathInfo> ipi =
+                statCacheGet(&c->w->stats, indexHtml, now);
+            if (ipi->fd != -1) {
+                sendFile(c, path, indexHtml, ipi);
+            } else {
+                errno = ipi->err ? ipi->err : ipi->openErr;
+                if (errno == ENOENT) {
+                    handleDirListing(c, path, pi->st, query);
+                } else {
+                    statusResponse(c, StatusForbidden,
+                                   "index.html not readable");
+                }
+            }
+        } else {
+            handleDirRedirect(c, path);
+        }
+        return;
+    }
+    if (pi->executable) {
+        c->keepAlive = keepAlive;
+        CgiPool *pool = findCgiPool(c->w, path);
+        if (pool and c->contentLength <= (ssize_t)CgiPoolMaxBody) {
+            handlePooledCGI(c, pool, method, query);
+            return;
+        }
+        handleCGI(c, method, path, query);
+        return;
+    }
+    handleStatic(c, path, pi);
+}
+
+// Fills iov with the header and the memory pieces up to the next file
+// piece. Returns their number and sets *more if a file piece follows.
+static int gatherOutput(Conn *c, struct iovec *iov, int max, bool *more) {
+    int n = 0;
+    if (c->outOff < c->out.size()) {
+        iov[n].iov_base = &c->out[c->outOff];
+        iov[n].iov_len = c->out.size() - c->outOff;
+        n++;
+    }
+    size_t i = c->piecePos;
+    for (; i < c->pieces.size() and n < max; i++) {
+        Piece *q = &c->pieces[i];
+        if (q->data == NULL) {
+            break;
+        }
+        iov[n].iov_base = (void *)(q->data + q->off);
+        iov[n].iov_len = q->end - q->off;
+        n++;
+    }
+    *more = i < c->pieces.size();
+    return n;
+}
+
+// Counts the response serve() queued for c in Worker::queued.
+static void countQueued(Conn *c) {
+    long long n = c->out.size() - c->outOff;
+    for (size_t i = c->piecePos; i < c->pieces.size(); i++) {
+        n += c->pieces[i].end - c->pieces[i].off;
+    }
+    c->queued += n;
+    c->w->queued += n;
+}
+
+// Takes n bytes of c's response, or all that are left, off Worker::queued.
+static void dequeue(Conn *c, long long n) {
+    if (n > c->queued) {
+        n = c->queued;
+    }
+    c->queued -= n;
+    c->w->queued -= n;
+}
+
+// Marks r bytes of what gatherOutput() returned as written.
+static void consumeOutput(Conn *c, size_t r) {
+    metricAdd(&c->w->metrics.bytesSent, r);
+    c->sent += r;
+    dequeue(c, r);
+    size_t left = c->out.size() - c->outOff;
+    if (r <= left) {
+        c->outOff += r;
+        return;
+    }
+    c->outOff = c->out.size();
+    r -= left;
+    while (r > 0) {
+        Piece *q = &c->pieces[c->piecePos];
+        if ((off_t)r < q->end - q->off) {
+            q->off += r;
+            break;
+        }
+        r -= q->end - q->off;
+        c->piecePos++;
+    }
+}
+
+// A sendmsg request on the ring. It refers to the Conn's output, which
+// stays put until the completion arrives.
+struct RingSend {
+    struct msghdr msg;
+    struct iovec iov[16];
+    ssize_t result;
+    bool done; // result is set and not consumed yet
+};
+
+// Queues the output up to the next file piece as a sendmsg request.
+static void ringSend(Conn *c) {
+    if (c->send == NULL) {
+        c->send = new RingSend();
+    }
+    RingSend *rs = c->send;
+    bool more;
+    memset(&rs->msg, 0, sizeof rs->msg);
+    rs->msg.msg_iov = rs->iov;
+    rs->msg.msg_iovlen = gatherOutput(c, rs->iov, 16, &more);
+    c->ringOps |= 1u << TagSend;
+    struct io_uring_sqe *sqe = uringSqe(c->w->ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t)&rs->msg;
+    sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    sqe->user_data = (uintptr_t)tagConn(c, TagSend);
+}
+
+int stepDrain(Conn *c) {
+    if (c->send and c->send->done) {
+        c->send->done = false;
+        if (c->send->result == -EAGAIN) {
+            ringPoll(c, EPOLLOUT);
+            return 0;
+        }
+        if (c->send->result < 0) {
+            return -1;
+        }
+        consumeOutput(c, c->send->result);
+    }
+    if (c->ringOps & (1u << TagSend)) {
+        return 0;
+    }
+    while (c->outOff < c->out.size() or c->piecePos < c->pieces.size()) {
+        Piece *p = c->piecePos < c->pieces.size() ? &c->pieces[c->piecePos]
+                                                   : NULL;
+        if (c->outOff == c->out.size() and p->data == NULL) {
+            off_t n = p->end - p->off;
+            uint64_t start = phaseBegin(PhaseSendfile, c->fd);
+            ssize_t r = sendfile(c->fd, c->file->fd, &p->off,
+                                 n < 0x7ffff000 ? n : 0x7ffff000);
+            phaseEnd(c->w, PhaseSendfile, c->fd, start);
+            if (r < 0) {
+                if (errno == EAGAIN or errno == EWOULDBLOCK) {
+                    if (c->w->ring) {
+                        ringPoll(c, EPOLLOUT);
+                    }
+                    return 0;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            if (r == 0) {
+                // the file shrank, Content-Length can no longer be honored
+                return -1;
+            }
+            metricAdd(&c->w->metrics.bytesSent, r);
+            c->sent += r;
+            dequeue(c, r);
+            if (p->off == p->end) {
+                c->piecePos++;
+            }
+            continue;
+        }
+        if (c->w->ring) {
+            ringSend(c);
+            return 0;
+        }
+        struct iovec iov[16];
+        bool more;
+        // With more to follow, MSG_MORE holds back a partial segment so the
+        // header shares packets with the file that sendfile() sends next.
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = gatherOutput(c, iov, 16, &more);
+        ssize_t r = sendmsg(c->fd, &msg, more ? MSG_MORE : 0);
+        if (r < 0) {
+            if (errno == EAGAIN or errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        consumeOutput(c, r);
+    }
+    return 1;
+}
+
+Conn *newConn(Worker *w, int fd, const struct sockaddr_in &caddr) {
+    Conn *c = new Conn;
+    c->w = w;
+    c->fd = fd;
+    c->caddr = caddr;
+    c->state = StateRequestLine;
+    c->eof = false;
+    c->in = NULL; // allocated by fillInput()
+    c->inPending = false;
+    c->inLen = 0;
+    httpRequestInit(&c->req);
+    c->contentLength = -1;
+    c->outOff = 0;
+    c->piecePos = 0;
+    c->cgiPool = NULL;
+    c->cgiProc = NULL;
+    c->cgiPid = 0;
+    c->cgiStdin = -1;
+    c->cgiStdout = -1;
+    c->cgiStreaming = false;
+    c->cgiChunkLeft = 0;
+    c->closed = false;
+    c->ringOps = 0;
+    c->pollEvents = 0;
+    c->send = NULL;
+    c->keepAlive = false;
+    c->head = false;
+    c->requests = 0;
+    c->requestStart = 0;
+    c->responseStart = 0;
+    c->parsedUs = 0;
+    c->handler = HandlerStatic;
+    c->status = 0;
+    c->sent = 0;
+    c->queued = 0;
+    arenaInit(&c->arena);
+    w->conns++;
+    metricAdd(&w->metrics.accepted, 1);
+    timerInit(&c->timer, c);
+    touch(c);
+    updateTimer(c);
+    return c;
+}
+
+// Counts the request of c as answered and logs it.
+void requestDone(Conn *c) {
+    Worker *w = c->w;
+    long now = nowUs();
+    metricsRequest(&w->metrics, c->handler, now - c->parsedUs, now / 1000);
+    TRACE4(request_done, c->fd, c->status, c->sent, now - c->parsedUs);
+    if (w->log == NULL) {
+        return;
+    }
+    char line[LogLineMax];
+    size_t n = formatAccessLine(
+        line, &w->logClock, c->caddr,
+        c->logRequest.empty() ? "-" : std::string_view(c->logRequest),
+        c->status, c->sent, now - c->parsedUs);
+    if (!logRingPut(w->log, line, n)) {
+        metricAdd(&w->metrics.logDropped, 1);
+    }
+}
+
+// Prepares a kept-alive connection for the next request. Pipelined
+// requests that are already buffered stay in c->in.
+void resetRequest(Conn *c) {
+    dequeue(c, c->queued);
+    c->file.reset();
+    size_t used = c->req.length;
+    if (c->contentLength > 0) {
+        used += c->contentLength; // the body was skipped, see serve()
+    }
+    memmove(c->in, c->in + used, c->inLen - used);
+    c->inLen -= used;
+    httpRequestInit(&c->req);
+    c->contentLength = -1;
+    c->out.clear();
+    c->outOff = 0;
+    c->pieces.clear();
+    c->piecePos = 0;
+    c->parts.clear();
+    c->cached.reset();
+    c->dir.reset();
+    c->cgiPool = NULL;
+    c->head = false;
+    c->handler = HandlerStatic;
+    c->status = 0;
+    c->sent = 0;
+    c->logRequest.clear();
+    arenaReset(&c->arena);
+    c->requestStart = c->inLen > 0 ? c->w->now : 0;
+    c->state = StateRequestLine;
+}
+
+// The Conn is freed after the current batch of events, which may still
+// refer to it, and once no ring request refers to it anymore.
+void closeConn(Conn *c) {
+    Worker *w = c->w;
+    uint64_t start = phaseBegin(PhaseClose, c->fd);
+    if (c->state == StateCgiRun) {
+        requestDone(c); // the child's response ends with it
+    }
+    metricAdd(&w->metrics.closed, 1);
+    w->conns--;
+    dequeue(c, c->queued);
+    if (c->cgiPid) {
+        w->cgiRunning--; // closed before the child's output ended
+    }
+    timerCancel(&w->timers, &c->timer);
+    for (int tag = 1; tag <= TagMask; tag++) {
+        if (c->ringOps & (1u << tag)) {
+            uringCancel(w->ring, (uintptr_t)tagConn(c, tag), RingIgnore);
+        }
+    }
+    if (c->cgiProc) {
+        c->cgiProc->conn = NULL; // the answer is dropped when it comes
+    } else if (c->state == StateCgiWait) {
+        std::deque<Conn *> &q = c->cgiPool->waiting;
+        q.erase(std::find(q.begin(), q.end(), c));
+    }
+    // a CGI child that is still running gets EPIPE or SIGPIPE
+    if (c->cgiStdin != -1) {
+        close(c->cgiStdin);
+        c->cgiStdin = -1;
+    }
+    if (c->cgiStdout != -1) {
+        close(c->cgiStdout);
+        c->cgiStdout = -1;
+    }
+    shutdown(c->fd, SHUT_WR);
+    close(c->fd); // also removes it from the epoll set
+    c->closed = true;
+    w->closed.push_back(c);
+    phaseEnd(w, PhaseClose, c->fd, start);
+}
+
+// Queues the ring request that resumes c once it has to wait for the
+// socket: a receive while reading a request, a poll in the CGI states.
+// stepDrain() queues its own.
+void ringArm(Conn *c) {
+    switch (c->state) {
+    case StateRequestLine:
+    case StateHeaders: {
+        if (c->eof or (c->ringOps & (1u << TagRecv)) or
+            c->inLen == InputBufferSize) {
+            break;
+        }
+        if (c->inLen == 0) {
+            // idle connections do not hold on to a buffer
+            free(c->in);
+            c->in = NULL;
+        }
+        size_t space = InputBufferSize - c->inLen;
+        c->ringOps |= 1u << TagRecv;
+        struct io_uring_sqe *sqe = uringSqe(c->w->ring);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = c->fd;
+        sqe->len = space < RingBufferSize ? space : RingBufferSize;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = (uintptr_t)tagConn(c, TagRecv);
+        break;
+    }
+    case StateCgiBody:
+        ringPoll(c, EPOLLIN);
+        break;
+    case StateCgiRun: {
+        uint32_t events = 0;
+        if (c->cgiStdin != -1 and c->cgiInOff == c->cgiInEnd) {
+            events |= EPOLLIN; // pumpCgiBody() ran out of body
+        }
+        if (c->outOff < c->out.size() or c->cgiChunkLeft > 0) {
+            events |= EPOLLOUT; // streamCgiOutput() filled the socket
+        }
+        if (events) {
+            ringPoll(c, events);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Runs the connection state machine as far as the socket allows.
+void advance(Conn *c) {
+    if (c->closed) {
+        return;
+    }
+    touch(c);
+    if (c->state == StateRequestLine or c->state == StateHeaders) {
+        if (-1 == fillInput(c)) {
+            closeConn(c);
+            return;
+        }
+        if (c->requestStart == 0 and c->inLen > 0) {
+            c->requestStart = c->w->now;
+        }
+    } else {
+        c->inPending = true; // the event may have been an input edge
+    }
+    int r = 1;
+    while (r == 1) {
+        switch (c->state) {
+        case StateRequestLine:
+        case StateHeaders:
+            r = stepParse(c);
+            break;
+        case StateServe: {
+            uint64_t start = phaseBegin(PhaseDispatch, c->fd);
+            serve(c);
+            phaseEnd(c->w, PhaseDispatch, c->fd, start);
+            countQueued(c);
+            break;
+        }
+        case StateDrain:
+            r = stepDrain(c);
+            if (r == 1) {
+                requestDone(c);
+                if (!c->keepAlive) {
+                    r = -1;
+                    break;
+                }
+                resetRequest(c);
+                // skip the read when the last one ended in EAGAIN
+                if (c->inPending and -1 == fillInput(c)) {
+                    r = -1;
+                }
+            }
+            break;
+        case StateCgiBody:
+            r = stepCgiBody(c);
+            break;
+        case StateCgiWait:
+            r = 0; // runCgiProc() resumes c
+            break;
+        case StateCgiRun:
+            r = stepCgiRun(c);
+            break;
+        }
+    }
+    if (r == -1) {
+        closeConn(c);
+        return;
+    }
+    if (c->w->ring) {
+        ringArm(c);
+    }
+    updateTimer(c);
+}
+
+// Appends what a receive request of the ring read from the socket to c->in
+// and resumes c.
+void ringReceived(Conn *c, const struct io_uring_cqe &cqe) {
+    Uring *u = c->w->ring;
+    if (cqe.res > 0 and !c->closed) {
+        if (c->in == NULL) {
+            c->in = (char *)malloc(InputBufferSize);
+        }
+        memcpy(c->in + c->inLen, uringBuffer(u, cqe), cqe.res);
+        c->inLen += cqe.res;
+    }
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        uringRecycle(u, cqe);
+    }
+    if (c->closed) {
+        return;
+    }
+    if (cqe.res == 0) {
+        c->eof = true;
+    } else if (cqe.res < 0 and cqe.res != -ENOBUFS and cqe.res != -EINTR) {
+        closeConn(c);
+        return;
+    }
+    advance(c); // also queues the next receive
+}
+
+// Called when the timer of c fires. A CGI child that missed the body
+// deadline gets EOF on its stdin; anything else that ran out of time is
+// closed.
+void expireConn(Conn *c) {
+    long now = c->w->now;
+    long deadline = connDeadline(c);
+    if (deadline == -1 or deadline > now) {
+        updateTimer(c);
+        return;
+    }
+    if (c->state == StateCgiRun) {
+        long body = after(c->responseStart, opts.bodyTimeout);
+        if (c->cgiStdin != -1 and body != -1 and body <= now) {
+            fprintf(stderr, "  CGI %d: request body timeout\n", c->cgiPid);
+            c->keepAlive = false;
+            closeCgiStdin(c);
+            advance(c);
+            return;
+        }
+        fprintf(stderr, "  CGI %d: response timeout\n", c->cgiPid);
+        kill(-c->cgiPid, SIGTERM);
+    }
+    closeConn(c);
+}
+
+// Answers a connection beyond --max-conns with overloadResponse, without
+// setting up a Conn for it, and closes it.
+static void shedConn(Worker *w, int fd) {
+    metricAdd(&w->metrics.shed[ShedConns], 1);
+    // With TCP_DEFER_ACCEPT the request has usually arrived; reading it
+    // lets close() end with a FIN rather than a reset, which could destroy
+    // the answer before the client reads it.
+    char buf[4096];
+    recv(fd, buf, sizeof buf, MSG_DONTWAIT);
+    send(fd, overloadResponse.data(), overloadResponse.size(),
+         MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+}
+
+// Accepts up to AcceptBatch connections; w->acceptPending tells whether
+// more may be waiting.
+void acceptAll(Worker *w) {
+    w->acceptPending = false;
+    for (int i = 0; i < AcceptBatch; i++) {
+        struct sockaddr_in caddr;
+        socklen_t caddr_len = sizeof caddr;
+        uint64_t start = phaseBegin(PhaseAccept, w->sock);
+        int csock = accept4(w->sock, (struct sockaddr *)&caddr, &caddr_len,
+                            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        phaseEnd(w, PhaseAccept, csock, start);
+        if (csock == -1) {
+            if (errno != EAGAIN and errno != EWOULDBLOCK and errno != EINTR) {
+                perror("accept() failed");
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        if (opts.maxConns > 0 and w->conns >= opts.maxConns) {
+            shedConn(w, csock);
+            continue;
+        }
+        Conn *c = newConn(w, csock, caddr);
+        if (-1 == watchFd(w, csock, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                          c)) {
+            perror("epoll_ctl() failed");
+            closeConn(c);
+            continue;
+        }
+        // data may already be waiting; edge-triggered epoll reports it anyway
+    }
+    w->acceptPending = true;
+}
+
+// Queues the multishot accept of the listening socket on the ring. Its
+// completions carry user_data 0, like the listener's epoll events.
+void ringAccept(Worker *w) {
+    struct io_uring_sqe *sqe = uringSqe(w->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = w->sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = 0;
+}
+
+// Handles a completion of the ring. A multishot request that ends without
+// being cancelled, e.g. when the completion queue overflowed, is queued
+// again.
+void handleCompletion(Worker *w, const struct io_uring_cqe &cqe) {
+    if (cqe.user_data == RingIgnore) {
+        return;
+    }
+    void *ptr = (void *)(uintptr_t)cqe.user_data;
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    uintptr_t tag = cqe.user_data & TagMask;
+    if (ptr == NULL) {
+        if (!more) {
+            ringAccept(w);
+        }
+        if (cqe.res < 0) {
+            errno = -cqe.res;
+            perror("accept() failed");
+            return;
+        }
+        if (opts.maxConns > 0 and w->conns >= opts.maxConns) {
+            shedConn(w, cqe.res);
+            return;
+        }
+        struct sockaddr_in caddr;
+        socklen_t caddr_len = sizeof caddr;
+        memset(&caddr, 0, sizeof caddr);
+        getpeername(cqe.res, (struct sockaddr *)&caddr, &caddr_len);
+        advance(newConn(w, cqe.res, caddr));
+    } else if (tag) {
+        Conn *c = (Conn *)((uintptr_t)ptr ^ tag);
+        // the cancelled watch of a closed pipe may end after the next CGI
+        // request of a kept-alive c started watching its own
+        int pipe = tag == TagCgiStdin    ? c->cgiStdin
+                   : tag == TagCgiStdout ? c->cgiStdout
+                                         : -1;
+        if (!more and !(cqe.res == -ECANCELED and pipe != -1)) {
+            c->ringOps &= ~(1u << tag);
+        }
+        if (tag == TagRecv) {
+            ringReceived(c, cqe);
+            return;
+        }
+        if (c->closed or (cqe.res < 0 and tag != TagSend)) {
+            return; // cancelled
+        }
+        if (tag == TagSend) {
+            c->send->result = cqe.res;
+            c->send->done = true;
+        } else if (!more and pipe != -1) {
+            uint32_t events = tag == TagCgiStdin ? EPOLLOUT : EPOLLIN;
+            watchConnFd(c, pipe, events | EPOLLET, tag);
+        }
+        advance(c);
+    } else if (cqe.res < 0) {
+        return; // a cancelled poll
+    } else if (CgiProc *p = findCgiProc(w, ptr)) {
+        if (!more and p->fd != -1) {
+            watchFd(w, p->fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, p);
+        }
+        runCgiProc(p);
+    } else if (ptr == &w->cache or ptr == &w->gzcache) {
+        FileCache *fc = (FileCache *)ptr;
+        if (!more) {
+            watchFd(w, fc->inotifyFd, EPOLLIN, fc);
+        }
+        fileCacheProcessEvents(fc);
+    } else if (ptr == w) {
+        if (!more) {
+            watchFd(w, w->childFd, EPOLLIN, w);
+        }
+        reapChildren(w, w->childFd);
+    } else if (ptr == &w->children) {
+        if (!more) {
+            watchFd(w, w->childWake, EPOLLIN, &w->children);
+        }
+        reapChildren(w, w->childWake);
+    }
+}
+
+// Frees a closed Conn.
+void freeConn(Conn *c) {
+    free(c->in);
+    arenaFree(&c->arena);
+    delete c->send;
+    delete c;
+}
+
+// Pins the calling thread to one CPU of the process' affinity mask,
+// chosen round-robin by index.
+int pinToCPU(int index) {
+    cpu_set_t allowed;
+    if (-1 == sched_getaffinity(0, sizeof allowed, &allowed)) {
+        return -1;
+    }
+    int n = CPU_COUNT(&allowed);
+    int want = index % n;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) and want-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            return pthread_setaffinity_np(pthread_self(), sizeof set, &set)
+                       ? -1
+                       : cpu;
+        }
+    }
+    return -1;
+}
+
+// Sets up what the worker keeps apart from its event backend: the clock,
+// the timers, the caches and the admission counters.
+void initWorkerState(Worker *w) {
+    w->now = nowMs();
+    w->conns = 0;
+    w->cgiRunning = 0;
+    w->queued = 0;
+    w->acceptPending = false;
+    timerWheelInit(&w->timers, w->now);
+    fileCacheInit(&w->cache, opts.cacheBytes, opts.cacheEntries);
+    fileCacheInit(&w->gzcache, opts.gzipCacheBytes, opts.cacheEntries);
+    statCacheInit(&w->stats, opts.statTTL, statCacheCapacity(numWorkers));
+    dirCacheInit(&w->dirs, opts.cacheBytes, 256);
+    w->statsSeen = statsRequested;
+}
+
+// Serves connections on the worker's non-blocking listening socket forever.
+// Used as a pthread start routine; each worker owns its own epoll set, or
+// its own ring with --io-uring.
+void *runWorker(void *arg) {
+    Worker *w = (Worker *)arg;
+    if (w->pin) {
+        int cpu = pinToCPU(w->id);
+        if (cpu == -1) {
+            fprintf(stderr, "worker %d: failed to set CPU affinity\n", w->id);
+        } else {
+            fprintf(stderr, "worker %d: pinned to CPU %d\n", w->id, cpu);
+        }
+    }
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1() failed");
+        return NULL;
+    }
+    w->epfd = epfd;
+    w->ring = NULL;
+    if (opts.ioUring) {
+        w->ring = new Uring;
+        if (-1 == uringInit(w->ring, RingEntries, RingBuffers,
+                            RingBufferSize)) {
+            fprintf(stderr, "worker %d: io_uring unavailable (%s), "
+                    "using epoll\n", w->id, strerror(errno));
+            delete w->ring;
+            w->ring = NULL;
+        }
+    }
+    initWorkerState(w);
+    if (w->ring) {
+        ringAccept(w);
+    } else {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = NULL;
+        if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, w->sock, &ev)) {
+            perror("epoll_ctl() failed");
+            return NULL;
+        }
+    }
+    w->pools.resize(opts.cgiPools.size());
+    for (size_t i = 0; i < w->pools.size(); i++) {
+        CgiPool *pool = &w->pools[i];
+        pool->w = w;
+        pool->path = opts.cgiPools[i].path;
+        pool->procs.resize(opts.cgiPools[i].procs);
+        for (CgiProc &p : pool->procs) {
+            p.pool = pool;
+            p.fd = -1;
+            p.spawned = 0;
+            p.busy = false;
+            p.conn = NULL;
+        }
+        bool alive;
+        idleCgiProc(pool, &alive); // starts the processes
+    }
+    sigset_t sigchld;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    w->childFd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (w->childFd == -1 or
+        -1 == watchFd(w, w->childFd, EPOLLIN, w)) {
+        perror("signalfd() failed");
+        return NULL;
+    }
+    if (-1 == watchFd(w, w->childWake, EPOLLIN, &w->children)) {
+        perror("epoll_ctl() failed");
+        return NULL;
+    }
+    for (FileCache *fc : {&w->cache, &w->gzcache}) {
+        if (fc->inotifyFd == -1) {
+            continue;
+        }
+        if (-1 == watchFd(w, fc->inotifyFd, EPOLLIN, fc)) {
+            perror("epoll_ctl() failed");
+            return NULL;
+        }
+    }
+    struct epoll_event events[256];
+    while (true) {
+        long wake = timerWheelNext(&w->timers);
+        long expires = statCacheNext(&w->stats);
+        if (expires != -1 and (wake == -1 or expires < wake)) {
+            wake = expires; // to close the fds of expired entries
+        }
+        long now = nowMs();
+        int timeout = wake == -1 ? -1 : wake > now ? wake - now : 0;
+        if (w->acceptPending) {
+            timeout = 0;
+        }
+        int n = 0;
+        if (w->ring) {
+            if (-1 == uringWait(w->ring, timeout) and errno != ETIME and
+                errno != EINTR) {
+                perror("io_uring_enter() failed");
+            }
+        } else {
+            n = epoll_wait(epfd, events, 256, timeout);
+            if (n == -1 and errno != EINTR) {
+                perror("epoll_wait() failed");
+            }
+        }
+        if (w->statsSeen != statsRequested) {
+            w->statsSeen = statsRequested;
+            fprintf(stderr,
+                    "worker %d: file cache %ld hits %ld misses, "
+                    "path cache %ld hits %ld misses, "
+                    "directory cache %ld hits %ld misses\n",
+                    w->id, w->cache.hits, w->cache.misses, w->stats.hits,
+                    w->stats.misses, w->dirs.hits, w->dirs.misses);
+        }
+        w->now = nowMs();
+        while (Timer *t = timerWheelExpire(&w->timers, w->now)) {
+            expireConn((Conn *)t->owner);
+        }
+        statCacheExpire(&w->stats, w->now);
+        struct io_uring_cqe cqe;
+        while (w->ring and uringNext(w->ring, &cqe)) {
+            handleCompletion(w, cqe);
+        }
+        for (int i = 0; i < n; i++) {
+            uintptr_t tag = (uintptr_t)events[i].data.ptr & TagMask;
+            if (events[i].data.ptr == NULL) {
+                w->acceptPending = true; // after the connections' events
+            } else if (tag) {
+                advance((Conn *)((uintptr_t)events[i].data.ptr ^ tag));
+            } else if (CgiProc *p = findCgiProc(w, events[i].data.ptr)) {
+                runCgiProc(p);
+            } else if (events[i].data.ptr == &w->cache or
+                       events[i].data.ptr == &w->gzcache) {
+                fileCacheProcessEvents((FileCache *)events[i].data.ptr);
+            } else if (events[i].data.ptr == w) {
+                reapChildren(w, w->childFd);
+            } else if (events[i].data.ptr == &w->children) {
+                reapChildren(w, w->childWake);
+            } else {
+                advance((Conn *)events[i].data.ptr);
+            }
+        }
+        if (w->acceptPending) {
+            acceptAll(w);
+        }
+        if (w->log) {
+            accessLogKick(&accessLog, w->log);
+        }
+        Metrics *m = &w->metrics;
+        metricsPublishCache(m, CacheFile, w->cache.hits, w->cache.misses);
+        metricsPublishCache(m, CacheGzip, w->gzcache.hits, w->gzcache.misses);
+        metricsPublishCache(m, CachePath, w->stats.hits, w->stats.misses);
+        metricsPublishCache(m, CacheDir, w->dirs.hits, w->dirs.misses);
+        metricSet(&m->queuedBytes, w->queued);
+        size_t kept = 0;
+        for (Conn *c : w->closed) {
+            if (c->ringOps) {
+                w->closed[kept++] = c; // until the cancellations complete
             } else {
-                handleStatic(csock, path);
+                freeConn(c);
             }
         }
+        w->closed.resize(kept);
     }
-    shutdown(csock, SHUT_RD);
-cleanup:
-    shutdown(csock, SHUT_WR);
-    close(csock);
 }
@@ -0,0 +1,260 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "webserver.cc"
+
+TEST(CgiTest, ParseHeaders) {
+    std::string_view out = "Status: 404 Not Found\r\nContent-Type: text/x\r\n"
+                           "Content-Length: 3\nConnection: close\n"
+                           "no colon\n\r\nbody";
+    std::string status, headers;
+    ASSERT_TRUE(parseCgiHeaders(&out, &status, &headers));
+    EXPECT_EQ(status, "404 Not Found");
+    EXPECT_EQ(headers, "Content-Type: text/x\r\n");
+    EXPECT_EQ(out, "body");
+
+    out = "\n";
+    ASSERT_TRUE(parseCgiHeaders(&out, &status, &headers));
+    EXPECT_EQ(status, "200 OK");
+    EXPECT_EQ(headers, "");
+    EXPECT_EQ(out, "");
+
+    out = "Content-Type: text/plain\r\n";
+    EXPECT_FALSE(parseCgiHeaders(&out, &status, &headers));
+    EXPECT_EQ(out, "Content-Type: text/plain\r\n");
+}
+
+TEST(OverloadTest, Response) {
+    buildOverloadResponse(7);
+    std::string_view r = overloadResponse;
+    ASSERT_EQ(r.substr(0, 34), "HTTP/1.1 503 Service Unavailable\r\n");
+    EXPECT_NE(r.find("\r\nRetry-After: 7\r\n"), std::string_view::npos);
+    EXPECT_NE(r.find("\r\nConnection: close\r\n"), std::string_view::npos);
+    size_t end = r.find("\r\n\r\n");
+    ASSERT_NE(end, std::string_view::npos);
+    size_t cl = r.find("Content-Length: ");
+    ASSERT_LT(cl, end);
+    EXPECT_EQ(parseContentLength(r.substr(cl + 16, r.find('\r', cl) - cl - 16)),
+              (ssize_t)(r.size() - end - 4));
+}
+
+// Serves requests through a Conn on one end of a socketpair, the way a
+// worker does, from a temporary docroot that is the working directory.
+class ServeTest : public testing::Test {
+  protected:
+    void SetUp() override {
+        char dir[] = "/tmp/serve_test.XXXXXX";
+        ASSERT_NE(mkdtemp(dir), nullptr);
+        root = dir;
+        ASSERT_NE(getcwd(cwd, sizeof cwd), nullptr);
+        ASSERT_EQ(chdir(dir), 0);
+        writeFile("a.txt", "hello\n");
+        w.ring = NULL;
+        w.log = NULL;
+        initWorkerState(&w);
+        metricsInit(&w.metrics, w.now);
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+        c = newConn(&w, sv[0], sockaddr_in{});
+    }
+
+    void TearDown() override {
+        if (!c->closed) {
+            closeConn(c);
+        }
+        for (Conn *d : w.closed) {
+            freeConn(d);
+        }
+        close(sv[1]);
+        for (FileCache *fc : {&w.cache, &w.gzcache}) {
+            if (fc->inotifyFd != -1) {
+                close(fc->inotifyFd);
+            }
+        }
+        for (const std::string &name : files) {
+            unlink(name.c_str());
+        }
+        chdir(cwd);
+        rmdir(root.c_str());
+    }
+
+    void writeFile(const std::string &name, const std::string &data) {
+        int fd = open(name.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        ASSERT_NE(fd, -1);
+        ASSERT_EQ(write(fd, data.data(), data.size()), (ssize_t)data.size());
+        close(fd);
+        files.push_back(name);
+    }
+
+    // Sends request and returns what the server writes until it closes the
+    // connection or stops making progress.
+    std::string exchange(const std::string &request) {
+        EXPECT_EQ(write(sv[1], request.data(), request.size()),
+                  (ssize_t)request.size());
+        std::string out;
+        char buf[65536];
+        for (int idle = 0; idle < 3;) {
+            advance(c);
+            ssize_t r = read(sv[1], buf, sizeof buf);
+            if (r == 0) {
+                break;
+            }
+            if (r > 0) {
+                out.append(buf, r);
+                idle = 0;
+            } else {
+                idle++;
+            }
+        }
+        return out;
+    }
+
+    Worker w{};
+    Conn *c;
+    int sv[2];
+    std::string root;
+    char cwd[4096];
+    std::vector<std::string> files;
+};
+
+// Returns the number of times what occurs in s.
+static int count(const std::string &s, const std::string &what) {
+    int n = 0;
+    for (size_t i = s.find(what); i != std::string::npos;
+         i = s.find(what, i + 1)) {
+        n++;
+    }
+    return n;
+}
+
+TEST_F(ServeTest, Range) {
+    std::string r = exchange("GET /a.txt HTTP/1.1\r\nRange: bytes=1-3\r\n\r\n");
+    EXPECT_EQ(r.find("HTTP/1.1 206 Partial Content\r\n"), 0u);
+    EXPECT_NE(r.find("\r\nContent-Range: bytes 1-3/6\r\n"), std::string::npos);
+    EXPECT_NE(r.find("\r\nContent-Length: 3\r\n"), std::string::npos);
+    EXPECT_EQ(r.substr(r.size() - 7), "\r\n\r\nell");
+    EXPECT_FALSE(c->closed);
+
+    r = exchange("GET /a.txt HTTP/1.1\r\nRange: bytes=0-0,4-5\r\n\r\n");
+    EXPECT_EQ(r.find("HTTP/1.1 206 Partial Content\r\n"), 0u);
+    EXPECT_NE(r.find("Content-Type: multipart/byteranges; boundary="),
+              std::string::npos);
+    EXPECT_NE(r.find("Content-Range: bytes 0-0/6\r\n\r\nh\r\n--"),
+              std::string::npos);
+    EXPECT_NE(r.find("Content-Range: bytes 4-5/6\r\n\r\no\n\r\n--"),
+              std::string::npos);
+    size_t body = r.find("\r\n\r\n") + 4;
+    size_t cl = r.find("Content-Length: ") + 16;
+    EXPECT_EQ(std::stoul(r.substr(cl)), r.size() - body);
+}
+
+TEST_F(ServeTest, PipelinedRequests) {
+    std::string r = exchange("GET /a.txt HTTP/1.1\r\n\r\n"
+                             "GET /a.txt HTTP/1.1\r\nIf-None-Match: *\r\n"
+                             "Connection: close\r\n\r\n");
+    size_t second = r.find("HTTP/1.1 304 Not Modified\r\n");
+    ASSERT_NE(second, std::string::npos);
+    std::string first = r.substr(0, second);
+    EXPECT_EQ(first.find("HTTP/1.1 200 OK\r\n"), 0u);
+    EXPECT_NE(first.find("\r\nConnection: keep-alive\r\n"), std::string::npos);
+    EXPECT_EQ(first.substr(first.size() - 10), "\r\n\r\nhello\n");
+    EXPECT_NE(r.find("\r\nConnection: close\r\n", second), std::string::npos);
+    EXPECT_EQ(r.substr(r.size() - 4), "\r\n\r\n"); // 304 has no body
+    EXPECT_EQ(count(r, "HTTP/1.1 "), 2);
+    EXPECT_TRUE(c->closed);
+}
+
+TEST_F(ServeTest, HeadHasNoBody) {
+    // the first HEAD fills the file cache, the second is served from it
+    std::string r = exchange("HEAD /a.txt HTTP/1.1\r\n\r\n"
+                             "HEAD /a.txt HTTP/1.1\r\n\r\n"
+                             "HEAD /missing HTTP/1.1\r\n\r\n"
+                             "GET /a.txt HTTP/1.1\r\n"
+                             "Connection: close\r\n\r\n");
+    EXPECT_EQ(count(r, "HTTP/1.1 "), 4);
+    EXPECT_EQ(count(r, "\r\nContent-Length: 6\r\n"), 3);
+    size_t get = r.rfind("HTTP/1.1 200 OK\r\n");
+    size_t missing = r.find("HTTP/1.1 403 Forbidden\r\n");
+    ASSERT_LT(missing, get);
+    for (size_t end : {r.find("HTTP/1.1 ", 1), missing, get}) {
+        EXPECT_EQ(r.substr(end - 4, 4), "\r\n\r\n");
+    }
+    EXPECT_EQ(r.substr(get).find("hello\n"), r.size() - get - 6);
+    EXPECT_TRUE(c->closed);
+}
+
+TEST_F(ServeTest, SendfileResumesAfterShortWrites) {
+    // larger than the file cache takes, so it is sent with sendfile()
+    std::string big(fileCacheMaxFileSize(&w.cache) + 100000, 0);
+    for (size_t i = 0; i < big.size(); i++) {
+        big[i] = 'a' + i * 7 % 26;
+    }
+    writeFile("big.txt", big);
+    int size = 4096;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+    std::string r = exchange("GET /big.txt HTTP/1.1\r\n\r\n");
+    size_t body = r.find("\r\n\r\n") + 4;
+    EXPECT_EQ(r.find("HTTP/1.1 200 OK\r\n"), 0u);
+    EXPECT_TRUE(r.compare(body, std::string::npos, big) == 0);
+
+    r = exchange("GET /big.txt HTTP/1.1\r\nRange: bytes=-5\r\n"
+                 "Connection: close\r\n\r\n");
+    EXPECT_NE(r.find("\r\nContent-Range: bytes "), std::string::npos);
+    EXPECT_EQ(r.substr(r.size() - 5), big.substr(big.size() - 5));
+    EXPECT_TRUE(c->closed);
+}
+
+// ServeTest with --gzip and a gzip cache that keeps files up to 8 KiB.
+class GzipServeTest : public ServeTest {
+  protected:
+    void SetUp() override {
+        opts.gzipCacheBytes = 64 << 10;
+        ServeTest::SetUp();
+    }
+
+    void TearDown() override {
+        ServeTest::TearDown();
+        opts.gzipCacheBytes = 0;
+    }
+
+    std::string get(const std::string &name) {
+        return exchange("GET /" + name + " HTTP/1.1\r\n"
+                        "Accept-Encoding: gzip\r\n\r\n");
+    }
+};
+
+TEST_F(GzipServeTest, CompressesOnlyWhatTheCacheKeeps) {
+    size_t max = fileCacheMaxFileSize(&w.gzcache);
+    writeFile("small.txt", std::string(1000, 'a'));
+    std::string r = get("small.txt");
+    EXPECT_NE(r.find("\r\nContent-Encoding: gzip\r\n"), std::string::npos);
+    EXPECT_EQ(w.gzcache.index.size(), 1u);
+
+    // compresses well, but is not even read for it
+    writeFile("big.txt", std::string(max + 1, 'a'));
+    r = get("big.txt");
+    EXPECT_EQ(r.find("Content-Encoding"), std::string::npos);
+    EXPECT_NE(r.find(std::string("\r\nContent-Length: ") +
+                     std::to_string(max + 1) + "\r\n"),
+              std::string::npos);
+    EXPECT_FALSE(statCacheGet(&w.stats, "big.txt", nowMs())->noGzip);
+    EXPECT_EQ(w.gzcache.index.size(), 1u);
+
+    // fits, but its compressed copy does not: refused once, then remembered
+    std::string noise(max, 0);
+    uint32_t x = 1;
+    for (char &ch : noise) {
+        x = x * 1103515245 + 12345;
+        ch = x >> 24;
+    }
+    writeFile("noise.txt", noise);
+    r = get("noise.txt");
+    EXPECT_EQ(r.find("Content-Encoding"), std::string::npos);
+    EXPECT_TRUE(r.compare(r.find("\r\n\r\n") + 4, std::string::npos,
+                          noise) == 0);
+    std::shared_ptr<PathInfo> pi = statCacheGet(&w.stats, "noise.txt", nowMs());
+    EXPECT_TRUE(pi->noGzip);
+    r = get("noise.txt");
+    EXPECT_EQ(r.find("Content-Encoding"), std::string::npos);
+    EXPECT_EQ(w.gzcache.index.size(), 1u);
+}